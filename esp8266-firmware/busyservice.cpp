@@ -0,0 +1,67 @@
+#include <string.h>
+#include "busyservice.h"
+
+/* acceptClients
+    gives each new client a slot or turns it away if there is none
+*/
+void BusyService::acceptClients()
+{
+    int i;
+
+    while (m_server.hasClient()) {
+        for (i = 0; i < MAX_WAITING_CLIENTS && m_waiting[i].client; ++i)
+            ;
+        if (i >= MAX_WAITING_CLIENTS) {
+            m_server.available().stop();
+            break;
+        }
+        m_waiting[i].client = m_server.available();
+        m_waiting[i].start = millis();
+        m_waiting[i].request.reset();
+    }
+}
+
+/* serviceClients
+    collects each waiting client's request line a little at a time and answers it once it's complete
+*/
+void BusyService::serviceClients()
+{
+    int i;
+
+    for (i = 0; i < MAX_WAITING_CLIENTS; ++i) {
+        WaitingClient *waiting = &m_waiting[i];
+        if (!waiting->client)
+            continue;
+        while (waiting->client.available() > 0) {
+            if (waiting->request.parse(waiting->client.read()) != hpRequestLine) {
+                answer(waiting);
+                break;
+            }
+        }
+        if (waiting->client && millis() - waiting->start >= WAITING_CLIENT_TIMEOUT)
+            waiting->client.stop();
+    }
+}
+
+/* waitingCount
+    returns the number of clients still waiting for an answer
+*/
+int BusyService::waitingCount()
+{
+    int count = 0, i;
+    for (i = 0; i < MAX_WAITING_CLIENTS; ++i) {
+        if (m_waiting[i].client)
+            ++count;
+    }
+    return count;
+}
+
+void BusyService::answer(WaitingClient *waiting)
+{
+    HttpRequest &req = waiting->request;
+    if (m_sendStatus && req.method() == hmGet && strcmp(req.path(), "/status") == 0)
+        (*m_sendStatus)(waiting->client, false);
+    else
+        waiting->client.print("HTTP/1.1 503 Busy\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    waiting->client.stop();
+}
@@ -0,0 +1,43 @@
+#ifndef __BUSYSERVICE_H__
+#define __BUSYSERVICE_H__
+
+#include <ESP8266WiFi.h>
+#include "httprequest.h"
+
+// most clients that can wait for an answer while a request is being handled
+#define MAX_WAITING_CLIENTS     2
+
+// number of milliseconds a waiting client has to send its request line
+#define WAITING_CLIENT_TIMEOUT  1000
+
+// sends the module's status to a client
+typedef void (*StatusSender)(WiFiClient &client, bool keepOpen);
+
+// a client that connected while a request was being handled
+struct WaitingClient {
+    WiFiClient client;
+    unsigned long start;
+    HttpRequest request;
+};
+
+// answers the clients that connect to the HTTP server while a request is being handled:
+// GET /status gets the status and anything else gets 503 Busy, so a load never waits on them
+class BusyService
+{
+public:
+    BusyService(WiFiServer &server) : m_server(server), m_sendStatus(NULL) {}
+    ~BusyService() {}
+    void setStatusSender(StatusSender sender) { m_sendStatus = sender; }
+    void acceptClients();
+    void serviceClients();
+    int waitingCount();
+
+private:
+    void answer(WaitingClient *waiting);
+
+    WiFiServer &m_server;
+    StatusSender m_sendStatus;
+    WaitingClient m_waiting[MAX_WAITING_CLIENTS];
+};
+
+#endif
@@ -5,14 +5,46 @@
 #include <WiFiUDP.h>
 #include <FS.h>
 
+#include "serialconnection.h"
+#include "MySoftwareSerial.h"
 #include "proploader.h"
 #include "fastproploader.h"
+#include "targetpool.h"
+#include "imagecache.h"
+#include "httprequest.h"
+#include "busyservice.h"
+#include "responselog.h"
 
 #define AP_NAME_PREFIX  "ESP-PROP-PLUG"
 
+// reported in discovery replies so hosts can tell what this firmware supports
+#define FIRMWARE_VERSION  "1.1"
+
+// port for discovery requests and the first line of the reply; the rest of the reply is key=value lines
+#define DISCOVER_PORT     2000
+#define DISCOVER_REPLY    "ESP8266 here!\n"
+#define MAX_DISCOVER_REPLY_SIZE 1024
+
 // baud rate to use after a successful load
 #define PROGRAM_BAUD_RATE 115200
 
+// number of milliseconds to wait for the next request on a keep-alive connection
+#define KEEP_ALIVE_TIMEOUT  2000
+
+// number of milliseconds a client has to send the whole request header
+#define REQUEST_HEADER_TIMEOUT  2000
+
+// final-baud-rate=auto asks for the fastest rate that works; it is remembered per reset pin
+#define AUTO_BAUD_RATE      0
+#define BAUD_CACHE_FILE     "/baud-%d"
+
+// hash of the last image loaded through the cache for each reset pin, the base for the next delta load
+#define LAST_IMAGE_FILE     "/last-%d"
+
+// each changed packet in a delta load body follows a header long holding its offset
+// in the image in the low word and its size in the high word
+#define DELTA_HEADER_SIZE   4
+
 //////////////////////
 // WiFi Definitions //
 //////////////////////
@@ -30,32 +62,152 @@ WiFiServer telnetServer(23);
 WiFiClient telnetClient;
 WiFiUDP discoverServer;
 bool ffsMounted = false;
+char macString[3 * WL_MAC_ADDR_LENGTH];
+
+// Propellers the module can load, chosen with target=<index>; target 0 is on the hardware UART.
+// A test fixture can add more, each with its own transport and reset pin.  UART1 only transmits,
+// on GPIO2, so it is paired with MySoftwareSerial receiving on another pin, for example:
+//   MySoftwareSerial fixtureRx(14, SW_SERIAL_UNUSED_PIN);
+//   SerialPropellerConnection fixtureConnection(Serial1, fixtureRx);
+// with targets.add(fixtureConnection, 13) in setup().
+SerialPropellerConnection connection;
+TargetPool targets;
+PropellerTarget *target;    // target of the request being handled
+ImageCache imageCache(SPIFFS);
+
+// largest image the cache will accept
+#define MAX_CACHED_IMAGE_SIZE 32768
 
-PropellerConnection connection;
-PropellerLoader loader(connection);
-FastPropellerLoader fastLoader(connection);
+// largest image the ROM loader can put in hub RAM
+#define MAX_ROM_IMAGE_SIZE    32768
 
 // spin .binary image buffer also used as a general purpose buffer
-// this must be >= MAX_PACKET_SIZE defined in fastproploader.h
+// this must be >= 4 * MAX_PACKET_SIZE + 2 * RECORD_HEADER_SIZE defined in fastproploader.h and lzpack.h
 #define MAX_IMAGE_SIZE    8192
 
 uint8_t image[MAX_IMAGE_SIZE]; // don't want big arrays on the stack
 
+// state of the request currently being handled
+HttpRequest request;    // parsed request line and headers
+int contentLength;      // value of the Content-Length header or -1 if none was given
+int bodyRemaining;      // number of body bytes not yet read by the request handler
+bool keepAlive;         // true to keep the connection open after the response
+
+// longest request description kept for status reports
+#define MAX_REQUEST_LINE  128
+
+char currentRequest[MAX_REQUEST_LINE];  // request line being handled or empty if none
+
+// messages for the response, filtered by the verbosity= parameter and written in the format= one
+ResponseLog responseLog;
+ResponseLevel responseVerbosity = rlInfo;
+ResponseFormat responseFormat = rfText;
+
+// clients that connect while a request is being handled get a quick answer from ServiceWhileBusy
+BusyService busyService(server);
+
+// serial output is sent to the terminal when this many bytes are waiting or the line has been quiet this long
+#define TELNET_BUFFER_SIZE      512
+#define TELNET_FLUSH_DELAY      2
+
+uint8_t telnetBuffer[TELNET_BUFFER_SIZE];
+int telnetBufferCount;
+unsigned long telnetLastSerialByte;
+
+// bytes moved by the terminal bridge in each direction and the rates over the last full second
+struct TelnetStats {
+  unsigned long toSerial;
+  unsigned long toTelnet;
+  unsigned long toSerialRate;
+  unsigned long toTelnetRate;
+  unsigned long intervalStart;
+  unsigned long intervalToSerial;
+  unsigned long intervalToTelnet;
+};
+
+TelnetStats telnetStats;
+
 // HTTP GET request handlers
-int handleDirReq(WiFiClient &client, String &req);
+int handleDirReq(WiFiClient &client, HttpRequest &req);
+int handleStatusReq(WiFiClient &client, HttpRequest &req);
+int handleStatsReq(WiFiClient &client, HttpRequest &req);
+int handleCacheQueryReq(WiFiClient &client, HttpRequest &req);
+int handleLastImageReq(WiFiClient &client, HttpRequest &req);
 
 // HTTP POST request handlers
-int handleLoadReq(WiFiClient &client, String &req, LoadType loadType);
-int handlePacketReq(WiFiClient &client, String &req);
-int handleLoadBeginReq(WiFiClient &client, String &req);
-int handleLoadDataReq(WiFiClient &client, String &req);
-int handleLoadEndReq(WiFiClient &client, String &req);
-int handleFormatReq(WiFiClient &client, String &req);
+int handleRunReq(WiFiClient &client, HttpRequest &req);
+int handleProgramReq(WiFiClient &client, HttpRequest &req);
+int handleProgramAndRunReq(WiFiClient &client, HttpRequest &req);
+int handleLoadReq(WiFiClient &client, HttpRequest &req, LoadType loadType);
+int handlePacketReq(WiFiClient &client, HttpRequest &req);
+int handleLoadBeginReq(WiFiClient &client, HttpRequest &req);
+int handleLoadDataReq(WiFiClient &client, HttpRequest &req);
+int handleLoadEndReq(WiFiClient &client, HttpRequest &req);
+int handleLoadStreamReq(WiFiClient &client, HttpRequest &req);
+int handleLoadCachedReq(WiFiClient &client, HttpRequest &req);
+int handleLoadDeltaReq(WiFiClient &client, HttpRequest &req);
+int handleCacheStoreReq(WiFiClient &client, HttpRequest &req);
+int handleFormatReq(WiFiClient &client, HttpRequest &req);
+
+// requests are routed by exact method and path
+typedef int (*RequestHandler)(WiFiClient &client, HttpRequest &req);
+
+struct Route {
+  HttpMethod method;
+  const char *path;
+  RequestHandler handler;
+};
+
+const Route routes[] = {
+  { hmGet,  "/dir",               handleDirReq            },
+  { hmGet,  "/status",            handleStatusReq         },
+  { hmGet,  "/stats",             handleStatsReq          },
+  { hmGet,  "/cache",             handleCacheQueryReq     },
+  { hmGet,  "/last-image",        handleLastImageReq      },
+  { hmPost, "/run",               handleRunReq            },
+  { hmPost, "/program",           handleProgramReq        },
+  { hmPost, "/program-and-run",   handleProgramAndRunReq  },
+  { hmPost, "/load-begin",        handleLoadBeginReq      },
+  { hmPost, "/load-data",         handleLoadDataReq       },
+  { hmPost, "/load-end",          handleLoadEndReq        },
+  { hmPost, "/load-cached",       handleLoadCachedReq     },
+  { hmPost, "/load-delta",        handleLoadDeltaReq      },
+  { hmPost, "/load",              handleLoadStreamReq     },
+  { hmPost, "/packet",            handlePacketReq         },
+  { hmPost, "/cache",             handleCacheStoreReq     },
+  { hmPost, "/format",            handleFormatReq         }
+};
+
+#define ROUTE_COUNT (sizeof(routes) / sizeof(routes[0]))
 
 void handleHTTP(WiFiClient &client);
-const char *FindArg(String &req, const char *key);
-void InitResponse();
+bool handleRequest(WiFiClient &client);
+bool readRequestHeader(WiFiClient &client, HttpRequest &req, int timeout);
+void dispatchRequest(WiFiClient &client, HttpRequest &req);
+bool waitForRequest(WiFiClient &client, int timeout);
+int readBody(WiFiClient &client, uint8_t *buf, int size);
+int readBodyExact(WiFiClient &client, uint8_t *buf, int size);
+int readRecord(WiFiClient &client, uint8_t *record);
+int ReadImageBody(uint8_t *buf, int size, void *context);
+int ParseBaudRate(const char *arg);
+const char *FindHash(HttpRequest &req);
+bool SelectTarget(HttpRequest &req);
+LoadType FindLoadType(HttpRequest &req);
+void InitResponse(HttpRequest &req);
+ResponseLevel ParseVerbosity(const char *arg);
+void AppendAckStats();
+int StartFastLoader(int imageSize, int initialBaudRate, int finalBaudRate, int resetPin, int windowSize, int packetSize, int eepromClockRate);
+int GetCachedBaudRate(int resetPin);
+void SetCachedBaudRate(int resetPin, int baudRate);
+bool GetLastImage(int resetPin, char *hash);
+void SetLastImage(int resetPin, const char *hash);
 void SendResponse(WiFiClient &client, int code, const char *fmt, ...);
+int BuildDiscoverReply(char *buf, int size);
+int BuildStatus(char *buf, int size);
+void SendStatus(WiFiClient &client, bool keepOpen);
+void ServiceDiscovery();
+void ServiceTelnet();
+void ServiceWhileBusy();
 void setupSoftAP();
 void setupSTA();
 void setupMDNS();
@@ -67,7 +219,6 @@ void setup()
   uint8_t macAddr[WL_MAC_ADDR_LENGTH];
   WiFi.softAPmacAddress(macAddr);
 
-  char macString[3 * WL_MAC_ADDR_LENGTH];
   char *p = macString;
   char *end = &macString[sizeof(macString)];
   for (int i = 0; i < WL_MAC_ADDR_LENGTH; ++i) {
@@ -88,9 +239,13 @@ void setup()
   Serial.end();
 
   ffsMounted = SPIFFS.begin();
+  targets.add(connection, DEF_RESET_PIN);
+  targets.setIdleHandler(ServiceWhileBusy);
+  busyService.setStatusSender(SendStatus);
+  target = targets.target(0);
   server.begin();
   telnetServer.begin();
-  discoverServer.begin(2000);
+  discoverServer.begin(DISCOVER_PORT);
 
 }
 
@@ -101,119 +256,322 @@ void loop()
   if (client)
     handleHTTP(client);
 
-  // handle telnet connections
+  // handle telnet connections and traffic
+  ServiceTelnet();
+
+  // finish with clients that arrived during the last request
+  busyService.serviceClients();
+  
+  ServiceDiscovery();
+
+  // don't slow the terminal down while one is connected
+  if (telnetClient && telnetClient.connected())
+    yield();
+  else
+    delay(1);
+}
+
+// move terminal traffic between the telnet client and the Propeller's serial port in blocks
+void ServiceTelnet()
+{
+  uint8_t buf[TELNET_BUFFER_SIZE];
+  unsigned long now = millis();
+  int cnt;
+
+  // a new client replaces the current one
   if (telnetServer.hasClient()) {
     if (telnetClient && telnetClient.connected())
       telnetClient.stop();
     telnetClient = telnetServer.available();
+    // the bridge collects serial output itself so Nagle's algorithm would only add delay
+    telnetClient.setNoDelay(true);
+    telnetBufferCount = 0;
+    memset(&telnetStats, 0, sizeof(telnetStats));
+    telnetStats.intervalStart = now;
   }
 
-  // handle telnet traffic
-  if (telnetClient && telnetClient.connected()) {
-    while (Serial.available())
-      telnetClient.write(Serial.read());
-    while (telnetClient.available())
-      Serial.write(telnetClient.read());
+  if (!telnetClient || !telnetClient.connected())
+    return;
+
+  // telnet to serial: only take what the UART can accept without blocking
+  while ((cnt = telnetClient.available()) > 0) {
+    int room = Serial.availableForWrite();
+    if (cnt > room)
+      cnt = room;
+    if (cnt > (int)sizeof(buf))
+      cnt = sizeof(buf);
+    if (cnt <= 0 || (cnt = telnetClient.read(buf, cnt)) <= 0)
+      break;
+    Serial.write(buf, cnt);
+    telnetStats.toSerial += cnt;
+    telnetStats.intervalToSerial += cnt;
   }
 
-  // discovery experiments
-#define DISCOVER_REPLY  "ESP8266 here!\n"
-int cnt;
-  if ((cnt = discoverServer.parsePacket()) > 0) {
+  // serial to telnet: collect bytes until the buffer fills or the line goes quiet
+  while ((cnt = Serial.available()) > 0 && telnetBufferCount < TELNET_BUFFER_SIZE) {
+    if (cnt > TELNET_BUFFER_SIZE - telnetBufferCount)
+      cnt = TELNET_BUFFER_SIZE - telnetBufferCount;
+    telnetBufferCount += Serial.readBytes(&telnetBuffer[telnetBufferCount], cnt);
+    telnetLastSerialByte = now;
+  }
+  if (telnetBufferCount == TELNET_BUFFER_SIZE || (telnetBufferCount > 0 && now - telnetLastSerialByte >= TELNET_FLUSH_DELAY)) {
+    telnetClient.write(telnetBuffer, telnetBufferCount);
+    telnetStats.toTelnet += telnetBufferCount;
+    telnetStats.intervalToTelnet += telnetBufferCount;
+    telnetBufferCount = 0;
+  }
+
+  // update the rates once a second
+  if (now - telnetStats.intervalStart >= 1000) {
+    unsigned long elapsed = now - telnetStats.intervalStart;
+    telnetStats.toSerialRate = telnetStats.intervalToSerial * 1000 / elapsed;
+    telnetStats.toTelnetRate = telnetStats.intervalToTelnet * 1000 / elapsed;
+    telnetStats.intervalToSerial = telnetStats.intervalToTelnet = 0;
+    telnetStats.intervalStart = now;
+  }
+}
+
+// answer a discovery request if one has arrived
+void ServiceDiscovery()
+{
+  if (discoverServer.parsePacket() > 0) {
+    char reply[MAX_DISCOVER_REPLY_SIZE];
+    int cnt = BuildDiscoverReply(reply, sizeof(reply));
     discoverServer.beginPacket(discoverServer.remoteIP(), discoverServer.remotePort());
-    discoverServer.write(DISCOVER_REPLY, strlen(DISCOVER_REPLY));
+    discoverServer.write(reply, cnt);
     discoverServer.endPacket();
   }
+}
 
-  delay(1);
+// called by the connection while a request handler waits on the Propeller, but not while it sends
+// it answers discovery and status requests but mustn't touch the serial port or the response being built
+void ServiceWhileBusy()
+{
+  ServiceDiscovery();
+  busyService.acceptClients();
+  busyService.serviceClients();
 }
 
 void handleHTTP(WiFiClient &client)
 {
-  // Read the first line of the request
-  String req = client.readStringUntil('\r');
-  if (client.peek() == '\n')
-    client.read();
- 
-  // skip the rest of the header
-  while (client.available() > 0) {
-    String hdr = client.readStringUntil('\r');
-    if (client.peek() == '\n')
-      client.read();
-    if (hdr.length() == 0)
-      break;
+  // handle requests until the client closes the connection or goes idle
+  while (handleRequest(client) && waitForRequest(client, KEEP_ALIVE_TIMEOUT))
+    ;
+}
+
+bool handleRequest(WiFiClient &client)
+{
+  // a client that stops partway through the header gets no more requests
+  if (!readRequestHeader(client, request, REQUEST_HEADER_TIMEOUT)) {
+    keepAlive = false;
+    InitResponse(request);
+    if (request.state() == hpError)
+      SendResponse(client, request.errorCode(), request.errorCode() == 414 ? "URI Too Long" : "Bad Request");
+    else if (request.state() == hpHeaders)
+      SendResponse(client, 408, "Request Timeout");
+    return false;
   }
 
-  InitResponse();
+  // without a Content-Length the body ends when the client stops sending
+  contentLength = request.contentLength();
+  keepAlive = request.keepAlive() && contentLength >= 0;
+  bodyRemaining = contentLength;
+
+  InitResponse(request);
+  snprintf(currentRequest, sizeof(currentRequest), "%s %s", request.methodName(), request.path());
   
-  if (req.indexOf("GET") == 0) {
-    if (req.indexOf("/dir") != -1)
-      handleDirReq(client, req);
-    else
-      SendResponse(client, 404, "Not Found");
-  }
-  
-  else if (req.indexOf("POST") == 0) {
-    if (req.indexOf("/program-and-run") != -1)
-      handleLoadReq(client, req, ltDownloadAndProgramAndRun);
-    else if (req.indexOf("/program") != -1)
-      handleLoadReq(client, req, ltDownloadAndProgram);
-    else if (req.indexOf("/run") != -1)
-      handleLoadReq(client, req, ltDownloadAndRun);
-    else if (req.indexOf("/load-begin") != -1)
-      handleLoadBeginReq(client, req);
-    else if (req.indexOf("/load-data") != -1)
-      handleLoadDataReq(client, req);
-    else if (req.indexOf("/load-end") != -1)
-      handleLoadEndReq(client, req);
-    else if (req.indexOf("/packet") != -1)
-      handlePacketReq(client, req);
-    else if (req.indexOf("/format") != -1)
-      handleFormatReq(client, req);
-    else
-      SendResponse(client, 404, "Not Found");
+  if (SelectTarget(request))
+    dispatchRequest(client, request);
+  else
+    SendResponse(client, 404, "No such target");
+  
+  // a failed load leaves its last phase running
+  target->connection().endPhase();
+
+  // discard any part of the body the handler didn't use
+  while (bodyRemaining > 0 && readBody(client, image, sizeof(image)) > 0)
+    ;
+  currentRequest[0] = '\0';
+
+  return keepAlive && bodyRemaining == 0;
+}
+
+// read the request line and headers, stopping at the blank line so the body is left for the handler
+bool readRequestHeader(WiFiClient &client, HttpRequest &req, int timeout)
+{
+  unsigned long start = millis();
+  
+  req.reset();
+  for (;;) {
+    while (client.available() > 0) {
+      HttpParseState state = req.parse(client.read());
+      if (state == hpComplete)
+        return true;
+      if (state == hpError)
+        return false;
+    }
+    if (!client.connected() || millis() - start >= (unsigned long)timeout)
+      return false;
+    yield();
+  }
+}
+
+void dispatchRequest(WiFiClient &client, HttpRequest &req)
+{
+  bool pathFound = false;
+  unsigned int i;
+  
+  for (i = 0; i < ROUTE_COUNT; ++i) {
+    if (strcmp(routes[i].path, req.path()) == 0) {
+      if (routes[i].method == req.method())
+        break;
+      pathFound = true;
+    }
+  }
+  
+  if (i < ROUTE_COUNT) {
+    // a client waiting to be told to send the body would otherwise stall for a while first
+    if (req.expectContinue() && contentLength > 0)
+      client.print("HTTP/1.1 100 Continue\r\n\r\n");
+    routes[i].handler(client, req);
+  }
+  else if (req.method() == hmUnknown)
+    SendResponse(client, 400, "Bad Request");
+  else if (pathFound)
+    SendResponse(client, 405, "Method Not Allowed");
+  else
+    SendResponse(client, 404, "Not Found");
+}
+
+bool waitForRequest(WiFiClient &client, int timeout)
+{
+  unsigned long start = millis();
+  while (client.connected() && !client.available()) {
+    // give up the connection if another client is waiting
+    if (millis() - start >= (unsigned long)timeout || server.hasClient())
+      return false;
+    ServiceDiscovery();
+    delay(1);
+  }
+  return client.available() > 0;
+}
+
+// read the next part of the request body
+int readBody(WiFiClient &client, uint8_t *buf, int size)
+{
+  int cnt;
+  
+  // without a Content-Length read whatever has arrived
+  if (bodyRemaining < 0) {
+    cnt = 0;
+    while (cnt < size && client.available() > 0)
+      buf[cnt++] = client.read();
+    return cnt;
   }
+  
+  if (size > bodyRemaining)
+    size = bodyRemaining;
+  if ((cnt = client.readBytes(buf, size)) > 0)
+    bodyRemaining -= cnt;
+  return cnt;
+}
+
+// fill a buffer from the request body unless the body ends first
+int readBodyExact(WiFiClient &client, uint8_t *buf, int size)
+{
+  int total = 0, cnt;
+  while (total < size && (cnt = readBody(client, &buf[total], size - total)) > 0)
+    total += cnt;
+  return total;
+}
+
+// ImageReader that gives the ROM loader the next part of the request body
+int ReadImageBody(uint8_t *buf, int size, void *context)
+{
+  int cnt = readBody(*(WiFiClient *)context, buf, size);
+  return cnt > 0 ? cnt : -1;
+}
+
+// receive a packet record (see lzpack.h) from the request body and return its size
+int readRecord(WiFiClient &client, uint8_t *record)
+{
+  int size;
+  if (readBodyExact(client, record, RECORD_HEADER_SIZE) != RECORD_HEADER_SIZE
+  ||  (size = RecordPackedSize(record)) > MAX_PACKET_SIZE
+  ||  readBodyExact(client, &record[RECORD_HEADER_SIZE], size) != size)
+    return -1;
+  return RECORD_HEADER_SIZE + size;
 }
 
-int handleLoadReq(WiFiClient &client, String &req, LoadType loadType)
+int handleRunReq(WiFiClient &client, HttpRequest &req)
+{
+  return handleLoadReq(client, req, ltDownloadAndRun);
+}
+
+int handleProgramReq(WiFiClient &client, HttpRequest &req)
+{
+  return handleLoadReq(client, req, ltDownloadAndProgram);
+}
+
+int handleProgramAndRunReq(WiFiClient &client, HttpRequest &req)
+{
+  return handleLoadReq(client, req, ltDownloadAndProgramAndRun);
+}
+
+int handleLoadReq(WiFiClient &client, HttpRequest &req, LoadType loadType)
 {
   int baudRate = INITIAL_BAUD_RATE;
-  int resetPin = DEF_RESET_PIN;
-  int imageSize = 0;
+  int resetPin = target->resetPin();
   const char *arg;
   
-  if ((arg = FindArg(req, "baud-rate=")) != NULL)
+  if ((arg = req.arg("baud-rate")) != NULL)
     baudRate = atoi(arg);
-  if ((arg = FindArg(req, "reset-pin=")) != NULL)
+  if ((arg = req.arg("reset-pin")) != NULL)
     resetPin = atoi(arg);
     
-  while (client.available() > 0 && imageSize < sizeof(image))
-    image[imageSize++] = client.read();
+  // the ROM is told the image size before the image is read from the body as it is encoded
+  if (contentLength <= 0) {
+    SendResponse(client, 403, "Content-Length missing");
+    return -1;
+  }
+  if (contentLength > MAX_ROM_IMAGE_SIZE) {
+    SendResponse(client, 413, "Image too large");
+    return -1;
+  }
     
-  connection.setBaudRate(baudRate);
-  connection.setResetPin(resetPin);
-  if (loader.load(image, imageSize, loadType) == 0)
-    SendResponse(client, 200, "OK");
-  else
+  if (target->connection().setBaudRate(baudRate) != 0) {
+    SendResponse(client, 403, "Baud rate %d not supported", baudRate);
+    return -1;
+  }
+  target->connection().setResetPin(resetPin);
+  target->connection().resetStats();
+  if (target->loader().load(ReadImageBody, &client, contentLength, loadType) != 0) {
     SendResponse(client, 403, "Load failed");
+    return -1;
+  }
+  
+  AppendAckStats();
+  SendResponse(client, 200, "OK");
+  return 0;
 }
       
-int handlePacketReq(WiFiClient &client, String &req)
+int handlePacketReq(WiFiClient &client, HttpRequest &req)
 {
   bool handled = false;
   int cnt;
   
-  while (client.available()) {
-    if ((cnt = client.read(image, MAX_PACKET_SIZE)) > 0) {
-      if (connection.sendData(image, cnt) != cnt) {
-        client.print("HTTP/1.1 403 sendData failed\r\n");
-        handled = true;
-      }
+  // the raw response below can't be delimited so close the connection after it
+  keepAlive = false;
+
+  while ((cnt = readBody(client, image, MAX_PACKET_SIZE)) > 0) {
+    if (target->connection().sendData(image, cnt) != cnt) {
+      client.print("HTTP/1.1 403 sendData failed\r\n");
+      handled = true;
     }
   }
   
   if (!handled) {
-    if ((cnt = connection.receiveDataExactTimeout(image, 8, 2000)) == 8) {
+    if ((cnt = target->connection().receiveDataExactTimeout(image, 8, 2000)) == 8) {
       client.print("HTTP/1.1 200 OK\r\n");
       client.write((char *)image, cnt);
     }
@@ -222,100 +580,674 @@ int handlePacketReq(WiFiClient &client, String &req)
   }
 }
       
-int handleLoadBeginReq(WiFiClient &client, String &req)
+int handleLoadBeginReq(WiFiClient &client, HttpRequest &req)
 {
   int initialBaudRate = INITIAL_BAUD_RATE;
   int finalBaudRate = FINAL_BAUD_RATE;
-  int resetPin = DEF_RESET_PIN;
+  int resetPin = target->resetPin();
+  int windowSize = MAX_WINDOW_SIZE;
+  int packetSize = DEFAULT_PACKET_SIZE;
+  int eepromClockRate = EEPROM_CLOCK_RATE;
   int imageSize = -1;
   const char *arg;
   
-  if ((arg = FindArg(req, "size=")) != NULL)
+  if ((arg = req.arg("size")) != NULL)
     imageSize = atoi(arg);
-  if ((arg = FindArg(req, "initial-baud-rate=")) != NULL)
+  if ((arg = req.arg("initial-baud-rate")) != NULL)
     initialBaudRate = atoi(arg);
-  if ((arg = FindArg(req, "final-baud-rate=")) != NULL)
-    finalBaudRate = atoi(arg);
-  if ((arg = FindArg(req, "reset-pin=")) != NULL)
+  if ((arg = req.arg("final-baud-rate")) != NULL)
+    finalBaudRate = ParseBaudRate(arg);
+  if ((arg = req.arg("reset-pin")) != NULL)
     resetPin = atoi(arg);
+  if ((arg = req.arg("window-size")) != NULL)
+    windowSize = atoi(arg);
+  if ((arg = req.arg("packet-size")) != NULL)
+    packetSize = atoi(arg);
+  if ((arg = req.arg("eeprom-clock")) != NULL)
+    eepromClockRate = atoi(arg);
     
   if (imageSize == -1)
     SendResponse(client, 403, "image size missing");
   else {
-    connection.setBaudRate(initialBaudRate);
-    connection.setResetPin(resetPin);
-    if (fastLoader.loadBegin(imageSize, initialBaudRate, finalBaudRate) == 0)
+    if (StartFastLoader(imageSize, initialBaudRate, finalBaudRate, resetPin, windowSize, packetSize, eepromClockRate) == 0)
       SendResponse(client, 200, "OK");
     else
       SendResponse(client, 403, "loadBegin failed");
   }
 }
       
-int handleLoadDataReq(WiFiClient &client, String &req)
+int handleLoadDataReq(WiFiClient &client, HttpRequest &req)
 {
+  // the loader numbered its packets at load-begin so only the end of the image may be a partial packet
+  int size = sizeof(image) / target->fastLoader().packetSize() * target->fastLoader().packetSize();
   int cnt = 0;
-  while ((cnt = client.available()) > 0) {
-    AppendResponseText("Data available: %d", cnt);
-    if ((cnt = client.readBytes(image, sizeof(image))) > 0) {
-      AppendResponseText("Loading %d bytes", cnt);
-      if (fastLoader.loadData(image, cnt) != 0) {
-        SendResponse(client, 403, "loadData failed");
-        cnt = -1;
-        break;
-      }
+  while ((cnt = readBodyExact(client, image, size)) > 0) {
+    AppendResponseText(rlDebug, "Loading %d bytes", cnt);
+    if (target->fastLoader().loadData(image, cnt) != 0) {
+      SendResponse(client, 403, "loadData failed");
+      cnt = -1;
+      break;
     }
   }
   
-  if (cnt >= 0 && !client.available())
+  if (cnt >= 0)
     SendResponse(client, 200, "OK");
 }
       
-int handleLoadEndReq(WiFiClient &client, String &req)
+int handleLoadEndReq(WiFiClient &client, HttpRequest &req)
 {
-  LoadType loadType = ltDownloadAndRun;
-  
-  if (req.indexOf("command=run") != -1)
-    loadType = ltDownloadAndRun;
-  else if (req.indexOf("command=program-and-run") != -1)
-    loadType = ltDownloadAndProgramAndRun;
-  else if (req.indexOf("command=program") != -1)
-    loadType = ltDownloadAndProgram;
+  LoadType loadType = FindLoadType(req);
     
-  if (fastLoader.loadEnd(loadType) == 0) {
+  if (target->fastLoader().loadEnd(loadType) == 0) {
+    AppendAckStats();
     SendResponse(client, 200, "OK");
-    connection.setBaudRate(PROGRAM_BAUD_RATE);
+    target->connection().setBaudRate(PROGRAM_BAUD_RATE);
   }
   else
     SendResponse(client, 403, "loadEnd failed");
 }
 
-int handleDirReq(WiFiClient &client, String &req)
+// load an image sent as the body of a single request
+// each packet is received from WiFi while the previous one is being acknowledged by the Propeller
+// with compressed=1 the body is a packet record for each packet and size= gives the size of the image
+int handleLoadStreamReq(WiFiClient &client, HttpRequest &req)
 {
+  int initialBaudRate = INITIAL_BAUD_RATE;
+  int finalBaudRate = FINAL_BAUD_RATE;
+  int resetPin = target->resetPin();
+  int windowSize = MAX_WINDOW_SIZE;
+  int packetSize = DEFAULT_PACKET_SIZE;
+  int eepromClockRate = EEPROM_CLOCK_RATE;
+  LoadType loadType = FindLoadType(req);
+  uint8_t *buffers[2] = { image, image + MAX_PACKET_SIZE };
+  uint8_t *records[2] = { image + 2 * MAX_PACKET_SIZE, image + 3 * MAX_PACKET_SIZE + RECORD_HEADER_SIZE };
+  bool compressed = false, pending = false;
+  int imageSize = contentLength;
+  int current = 0, loaded = 0;
+  const char *arg;
+  
+  if ((arg = req.arg("initial-baud-rate")) != NULL)
+    initialBaudRate = atoi(arg);
+  if ((arg = req.arg("final-baud-rate")) != NULL)
+    finalBaudRate = ParseBaudRate(arg);
+  if ((arg = req.arg("reset-pin")) != NULL)
+    resetPin = atoi(arg);
+  if ((arg = req.arg("window-size")) != NULL)
+    windowSize = atoi(arg);
+  if ((arg = req.arg("packet-size")) != NULL)
+    packetSize = atoi(arg);
+  if ((arg = req.arg("eeprom-clock")) != NULL)
+    eepromClockRate = atoi(arg);
+  if ((arg = req.arg("compressed")) != NULL)
+    compressed = atoi(arg) != 0;
+    
+  if (contentLength <= 0) {
+    SendResponse(client, 403, "Content-Length missing");
+    return -1;
+  }
+  
+  if (compressed && ((arg = req.arg("size")) == NULL || (imageSize = atoi(arg)) <= 0)) {
+    SendResponse(client, 403, "image size missing");
+    return -1;
+  }
+  
+  if (StartFastLoader(imageSize, initialBaudRate, finalBaudRate, resetPin, windowSize, packetSize, eepromClockRate) != 0) {
+    SendResponse(client, 403, "loadBegin failed");
+    return -1;
+  }
+  
+  while (bodyRemaining > 0) {
+    int cnt, result;
+    
+    // receive the next record, which is unpacked into the buffer beside it as it's sent
+    if (compressed) {
+      if ((cnt = readRecord(client, records[current])) <= 0) {
+        SendResponse(client, 403, "Timeout receiving image");
+        return -1;
+      }
+      
+      // like the packets of an uncompressed body, only the last record may hold less than a full packet
+      int size = RecordUnpackedSize(records[current]);
+      if (loaded + size > imageSize || (loaded + size < imageSize && size != target->fastLoader().packetSize())) {
+        SendResponse(client, 403, "Bad packet record size");
+        return -1;
+      }
+    }
+    
+    // receive the next packet into the buffer that isn't in flight
+    else if ((cnt = readBodyExact(client, buffers[current], target->fastLoader().packetSize())) <= 0
+         ||  (bodyRemaining > 0 && cnt < target->fastLoader().packetSize())) {
+      SendResponse(client, 403, "Timeout receiving image");
+      return -1;
+    }
+    
+    // wait for the previous packet to be acknowledged then send this one
+    if (pending && target->fastLoader().loadPacketFinish() != 0)
+      result = -1;
+    else if (compressed)
+      result = target->fastLoader().loadRecordStart(records[current], cnt, buffers[current]);
+    else
+      result = target->fastLoader().loadPacketStart(buffers[current], cnt);
+    if (result != 0) {
+      SendResponse(client, 403, "loadData failed");
+      return -1;
+    }
+    loaded += compressed ? RecordUnpackedSize(records[current]) : cnt;
+    pending = true;
+    current ^= 1;
+  }
+  
+  if (pending && target->fastLoader().loadPacketFinish() != 0) {
+    SendResponse(client, 403, "loadData failed");
+    return -1;
+  }
+  
+  // the records have to add up to the size the loader was started with
+  if (loaded != imageSize) {
+    SendResponse(client, 403, "Image size mismatch");
+    return -1;
+  }
+  
+  if (target->fastLoader().loadEnd(loadType) != 0) {
+    SendResponse(client, 403, "loadEnd failed");
+    return -1;
+  }
+  
+  AppendAckStats();
+  SendResponse(client, 200, "OK");
+  target->connection().setBaudRate(PROGRAM_BAUD_RATE);
+  return 0;
+}
+
+// load an image from the SPIFFS image cache
+// each packet is read from flash while the previous one is being acknowledged by the Propeller
+int handleLoadCachedReq(WiFiClient &client, HttpRequest &req)
+{
+  int initialBaudRate = INITIAL_BAUD_RATE;
+  int finalBaudRate = FINAL_BAUD_RATE;
+  int resetPin = target->resetPin();
+  int windowSize = MAX_WINDOW_SIZE;
+  int packetSize = DEFAULT_PACKET_SIZE;
+  int eepromClockRate = EEPROM_CLOCK_RATE;
+  LoadType loadType = FindLoadType(req);
+  uint8_t *buffers[2] = { image, image + MAX_PACKET_SIZE };
+  bool pending = false;
+  int current = 0, remaining;
+  const char *arg, *hash;
+  
+  if ((arg = req.arg("initial-baud-rate")) != NULL)
+    initialBaudRate = atoi(arg);
+  if ((arg = req.arg("final-baud-rate")) != NULL)
+    finalBaudRate = ParseBaudRate(arg);
+  if ((arg = req.arg("reset-pin")) != NULL)
+    resetPin = atoi(arg);
+  if ((arg = req.arg("window-size")) != NULL)
+    windowSize = atoi(arg);
+  if ((arg = req.arg("packet-size")) != NULL)
+    packetSize = atoi(arg);
+  if ((arg = req.arg("eeprom-clock")) != NULL)
+    eepromClockRate = atoi(arg);
+    
+  if ((hash = FindHash(req)) == NULL) {
+    SendResponse(client, 403, "hash missing");
+    return -1;
+  }
+  
+  File file = imageCache.open(hash);
+  if (!file) {
+    SendResponse(client, 404, "Not Cached");
+    return -1;
+  }
+  
+  remaining = file.size();
+  if (StartFastLoader(remaining, initialBaudRate, finalBaudRate, resetPin, windowSize, packetSize, eepromClockRate) != 0) {
+    file.close();
+    SendResponse(client, 403, "loadBegin failed");
+    return -1;
+  }
+  
+  while (remaining > 0) {
+    int cnt = remaining > target->fastLoader().packetSize() ? target->fastLoader().packetSize() : remaining;
+    
+    // read the next packet into the buffer that isn't in flight
+    if ((int)file.read(buffers[current], cnt) != cnt) {
+      file.close();
+      SendResponse(client, 403, "Reading cached image failed");
+      return -1;
+    }
+    
+    // wait for the previous packet to be acknowledged then send this one
+    if ((pending && target->fastLoader().loadPacketFinish() != 0)
+    ||  target->fastLoader().loadPacketStart(buffers[current], cnt) != 0) {
+      file.close();
+      SendResponse(client, 403, "loadData failed");
+      return -1;
+    }
+    pending = true;
+    current ^= 1;
+    remaining -= cnt;
+  }
+  file.close();
+  
+  if (pending && target->fastLoader().loadPacketFinish() != 0) {
+    SendResponse(client, 403, "loadData failed");
+    return -1;
+  }
+  
+  if (target->fastLoader().loadEnd(loadType) != 0) {
+    SendResponse(client, 403, "loadEnd failed");
+    return -1;
+  }
+  SetLastImage(resetPin, hash);
+  
+  AppendAckStats();
+  SendResponse(client, 200, "OK");
+  target->connection().setBaudRate(PROGRAM_BAUD_RATE);
+  return 0;
+}
+
+// load an image made from the cached image base= with the changed packets in the request body
+// the result must match hash= before it is run and is cached as the base for the next delta load
+int handleLoadDeltaReq(WiFiClient &client, HttpRequest &req)
+{
+  int initialBaudRate = INITIAL_BAUD_RATE;
+  int finalBaudRate = FINAL_BAUD_RATE;
+  int resetPin = target->resetPin();
+  int windowSize = MAX_WINDOW_SIZE;
+  int packetSize = DEFAULT_PACKET_SIZE;
+  int eepromClockRate = EEPROM_CLOCK_RATE;
+  LoadType loadType = FindLoadType(req);
+  uint8_t *buffers[2] = { image, image + MAX_PACKET_SIZE };
+  uint8_t header[DELTA_HEADER_SIZE];
+  uint64_t actual = IMAGE_HASH_INIT;
+  char actualText[IMAGE_HASH_LENGTH + 1];
+  int imageSize, offset, cnt, nextOffset = -1, nextSize = 0, changed = 0;
+  bool pending = false, storing;
+  const char *arg, *hash, *base, *error = NULL;
+  int current = 0;
+  
+  if ((arg = req.arg("initial-baud-rate")) != NULL)
+    initialBaudRate = atoi(arg);
+  if ((arg = req.arg("final-baud-rate")) != NULL)
+    finalBaudRate = ParseBaudRate(arg);
+  if ((arg = req.arg("reset-pin")) != NULL)
+    resetPin = atoi(arg);
+  if ((arg = req.arg("window-size")) != NULL)
+    windowSize = atoi(arg);
+  if ((arg = req.arg("packet-size")) != NULL)
+    packetSize = atoi(arg);
+  if ((arg = req.arg("eeprom-clock")) != NULL)
+    eepromClockRate = atoi(arg);
+    
+  if ((hash = FindHash(req)) == NULL || (base = req.arg("base")) == NULL || !ImageCache::validHash(base)) {
+    SendResponse(client, 403, "hash or base missing");
+    return -1;
+  }
+  
+  if ((arg = req.arg("size")) == NULL || (imageSize = atoi(arg)) <= 0 || imageSize > MAX_CACHED_IMAGE_SIZE) {
+    SendResponse(client, 403, "image size missing or too large");
+    return -1;
+  }
+  
+  File file = imageCache.open(base);
+  if (!file) {
+    SendResponse(client, 404, "Not Cached");
+    return -1;
+  }
+  
+  // the new image is cached as it goes by; the load still works if there's no room for it
+  if (!(storing = imageCache.beginStore(imageSize, base) == 0))
+    AppendResponseText(rlInfo, "no room to cache the image");
+  
+  if (StartFastLoader(imageSize, initialBaudRate, finalBaudRate, resetPin, windowSize, packetSize, eepromClockRate) != 0) {
+    file.close();
+    imageCache.abortStore();
+    SendResponse(client, 403, "loadBegin failed");
+    return -1;
+  }
+  
+  for (offset = 0; offset < imageSize; offset += cnt) {
+    cnt = imageSize - offset > target->fastLoader().packetSize() ? target->fastLoader().packetSize() : imageSize - offset;
+    
+    // find the next changed packet once the last one has been used
+    if (nextOffset < offset && bodyRemaining > 0) {
+      if (readBodyExact(client, header, DELTA_HEADER_SIZE) != DELTA_HEADER_SIZE) {
+        error = "Timeout receiving delta";
+        break;
+      }
+      nextOffset = header[0] | (header[1] << 8);
+      nextSize = header[2] | (header[3] << 8);
+      if (nextOffset < offset || nextOffset % target->fastLoader().packetSize() != 0) {
+        error = "Invalid delta";
+        break;
+      }
+    }
+    
+    // take the packet from the body if it changed and from the base image if it didn't
+    if (nextOffset == offset) {
+      if (nextSize != cnt || readBodyExact(client, buffers[current], cnt) != cnt) {
+        error = "Invalid delta";
+        break;
+      }
+      ++changed;
+    }
+    else if (!file.seek(offset, SeekSet) || (int)file.read(buffers[current], cnt) != cnt) {
+      error = "Delta doesn't cover the image";
+      break;
+    }
+    
+    actual = ImageCache::hash(buffers[current], cnt, actual);
+    if (storing && imageCache.write(buffers[current], cnt) != 0) {
+      imageCache.abortStore();
+      storing = false;
+    }
+    
+    // wait for the previous packet to be acknowledged then send this one
+    if ((pending && target->fastLoader().loadPacketFinish() != 0)
+    ||  target->fastLoader().loadPacketStart(buffers[current], cnt) != 0) {
+      error = "loadData failed";
+      break;
+    }
+    pending = true;
+    current ^= 1;
+  }
+  file.close();
+  
+  if (!error && (bodyRemaining > 0 || nextOffset >= imageSize))
+    error = "Invalid delta";
+  if (!error && pending && target->fastLoader().loadPacketFinish() != 0)
+    error = "loadData failed";
+    
+  // don't run an image that isn't the one the client meant to load
+  ImageCache::formatHash(actual, actualText);
+  if (!error && strncmp(actualText, hash, IMAGE_HASH_LENGTH) != 0)
+    error = "Hash mismatch";
+    
+  if (error) {
+    imageCache.abortStore();
+    SendResponse(client, 403, "%s", error);
+    return -1;
+  }
+  
+  if (target->fastLoader().loadEnd(loadType) != 0) {
+    imageCache.abortStore();
+    SendResponse(client, 403, "loadEnd failed");
+    return -1;
+  }
+  
+  if (storing && imageCache.endStore(hash) != 0)
+    storing = false;
+  SetLastImage(resetPin, storing ? hash : NULL);
+  AppendResponseText(rlInfo, "delta: %d of %d packets changed", changed, (imageSize + target->fastLoader().packetSize() - 1) / target->fastLoader().packetSize());
+  
+  AppendAckStats();
+  SendResponse(client, 200, "OK");
+  target->connection().setBaudRate(PROGRAM_BAUD_RATE);
+  return 0;
+}
+
+// start the second-stage loader, searching for the final baud rate if asked to
+int StartFastLoader(int imageSize, int initialBaudRate, int finalBaudRate, int resetPin, int windowSize, int packetSize, int eepromClockRate)
+{
+  int cachedBaudRate;
+  
+  if (target->fastLoader().setEepromClockRate(eepromClockRate) != 0)
+    return -1;
+  if (target->connection().setBaudRate(initialBaudRate) != 0) {
+    AppendResponseText(rlError, "error: initial baud rate %d not supported", initialBaudRate);
+    return -1;
+  }
+  target->connection().setResetPin(resetPin);
+  target->connection().resetStats();
+  
+  // a connection that limits the baud rate uses its fastest rate rather than searching
+  if (finalBaudRate == AUTO_BAUD_RATE && target->connection().maxBaudRate() > 0)
+    finalBaudRate = target->connection().maxBaudRate();
+    
+  if (finalBaudRate != AUTO_BAUD_RATE)
+    return target->fastLoader().loadBegin(imageSize, initialBaudRate, finalBaudRate, windowSize, packetSize);
+    
+  // try the rate that worked last time before searching again
+  if ((cachedBaudRate = GetCachedBaudRate(resetPin)) > 0) {
+    if (target->fastLoader().loadBeginVerified(imageSize, initialBaudRate, cachedBaudRate, windowSize, packetSize) == 0) {
+      AppendResponseText(rlInfo, "final baud rate: %d (cached)", cachedBaudRate);
+      return 0;
+    }
+    SetCachedBaudRate(resetPin, 0);
+  }
+  
+  if (target->fastLoader().loadBeginAuto(imageSize, initialBaudRate, &finalBaudRate, windowSize, packetSize) != 0)
+    return -1;
+  SetCachedBaudRate(resetPin, finalBaudRate);
+  AppendResponseText(rlInfo, "final baud rate: %d", finalBaudRate);
+  return 0;
+}
+
+int GetCachedBaudRate(int resetPin)
+{
+  char name[32];
+  int baudRate = 0;
+  
+  if (!ffsMounted)
+    return 0;
+  snprintf(name, sizeof(name), BAUD_CACHE_FILE, resetPin);
+  File file = SPIFFS.open(name, "r");
+  if (file) {
+    baudRate = file.parseInt();
+    file.close();
+  }
+  return baudRate;
+}
+
+// remember the final baud rate for a reset pin or forget it if baudRate is zero
+void SetCachedBaudRate(int resetPin, int baudRate)
+{
+  char name[32];
+  
+  if (!ffsMounted)
+    return;
+  snprintf(name, sizeof(name), BAUD_CACHE_FILE, resetPin);
+  if (baudRate <= 0)
+    SPIFFS.remove(name);
+  else {
+    File file = SPIFFS.open(name, "w");
+    if (file) {
+      file.print(baudRate);
+      file.close();
+    }
+  }
+}
+
+// get the hash of the last image loaded through the cache for a reset pin if it is still cached
+bool GetLastImage(int resetPin, char *hash)
+{
+  char name[32];
+  bool found = false;
+  
+  if (!ffsMounted)
+    return false;
+  snprintf(name, sizeof(name), LAST_IMAGE_FILE, resetPin);
+  File file = SPIFFS.open(name, "r");
+  if (file) {
+    found = (int)file.read((uint8_t *)hash, IMAGE_HASH_LENGTH) == IMAGE_HASH_LENGTH;
+    file.close();
+  }
+  hash[found ? IMAGE_HASH_LENGTH : 0] = '\0';
+  return found && ImageCache::validHash(hash) && imageCache.contains(hash);
+}
+
+// remember the last image loaded for a reset pin or forget it if hash is NULL
+void SetLastImage(int resetPin, const char *hash)
+{
+  char name[32];
+  
   if (!ffsMounted)
-    AppendResponseText("FFS not mounted");
+    return;
+  snprintf(name, sizeof(name), LAST_IMAGE_FILE, resetPin);
+  if (!hash)
+    SPIFFS.remove(name);
+  else {
+    File file = SPIFFS.open(name, "w");
+    if (file) {
+      file.write((const uint8_t *)hash, IMAGE_HASH_LENGTH);
+      file.close();
+    }
+  }
+}
+
+int handleDirReq(WiFiClient &client, HttpRequest &req)
+{
+  if (!ffsMounted)
+    AppendResponseText(rlError, "FFS not mounted");
   else{
     FSInfo info;
     if (!SPIFFS.info(info))
-      AppendResponseText("Failed to get FFS info");
+      AppendResponseText(rlError, "Failed to get FFS info");
     else {
-      AppendResponseText("totalBytes: %ld", info.totalBytes);
-      AppendResponseText("usedBytes: %ld", info.usedBytes);
-      AppendResponseText("blockSize: %ld", info.blockSize);
-      AppendResponseText("pageSize: %ld", info.pageSize);
-      AppendResponseText("maxOpenFiles: %ld", info.maxOpenFiles);
-      AppendResponseText("maxPathLength: %ld", info.maxPathLength);
+      AppendResponseText(rlInfo, "totalBytes: %ld", info.totalBytes);
+      AppendResponseText(rlInfo, "usedBytes: %ld", info.usedBytes);
+      AppendResponseText(rlInfo, "blockSize: %ld", info.blockSize);
+      AppendResponseText(rlInfo, "pageSize: %ld", info.pageSize);
+      AppendResponseText(rlInfo, "maxOpenFiles: %ld", info.maxOpenFiles);
+      AppendResponseText(rlInfo, "maxPathLength: %ld", info.maxPathLength);
       Dir dir = SPIFFS.openDir("/");
       while (dir.next())
-          AppendResponseText("%s %d", dir.fileName().c_str(), dir.openFile("r").size());
+          AppendResponseText(rlInfo, "%s %d", dir.fileName().c_str(), dir.openFile("r").size());
     }
   }
   SendResponse(client, 200, "OK");
 }
       
-int handleFormatReq(WiFiClient &client, String &req)
+// report whether an image is in the cache so the client can skip uploading it
+int handleCacheQueryReq(WiFiClient &client, HttpRequest &req)
 {
+  const char *hash;
+  
+  if ((hash = FindHash(req)) == NULL)
+    SendResponse(client, 403, "hash missing");
+  else if (!imageCache.contains(hash))
+    SendResponse(client, 404, "Not Cached");
+  else
+    SendResponse(client, 200, "OK");
+}
+
+// describe the last image loaded for a reset pin so a client can send just the packets that changed
+// the body is its hash, its size and then the packet hash of each packet-size= piece of it
+int handleLastImageReq(WiFiClient &client, HttpRequest &req)
+{
+  int resetPin = target->resetPin();
+  int packetSize = DEFAULT_PACKET_SIZE;
+  char *body = (char *)image + MAX_PACKET_SIZE, hdr[128], hash[IMAGE_HASH_LENGTH + 1];
+  int bodyMax = MAX_IMAGE_SIZE - MAX_PACKET_SIZE, remaining, cnt;
+  const char *arg;
+  
+  if ((arg = req.arg("reset-pin")) != NULL)
+    resetPin = atoi(arg);
+  if ((arg = req.arg("packet-size")) != NULL)
+    packetSize = atoi(arg);
+    
+  if (packetSize < MIN_PACKET_SIZE || packetSize > MAX_PACKET_SIZE || (packetSize & 3) != 0) {
+    SendResponse(client, 403, "Invalid packet size");
+    return -1;
+  }
+  
+  if (!GetLastImage(resetPin, hash)) {
+    SendResponse(client, 404, "No Last Image");
+    return -1;
+  }
+  
+  File file = imageCache.open(hash);
+  if (!file) {
+    SendResponse(client, 404, "No Last Image");
+    return -1;
+  }
+  
+  remaining = file.size();
+  cnt = snprintf(body, bodyMax, "hash=%s\nsize=%d\n", hash, remaining);
+  while (remaining > 0) {
+    int size = remaining > packetSize ? packetSize : remaining;
+    if ((int)file.read(image, size) != size || cnt + 10 > bodyMax) {
+      file.close();
+      SendResponse(client, 403, "Reading cached image failed");
+      return -1;
+    }
+    cnt += snprintf(&body[cnt], bodyMax - cnt, "%08lx\n", (unsigned long)ImageCache::packetHash(image, size));
+    remaining -= size;
+  }
+  file.close();
+  
+  snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+           cnt, keepAlive ? "keep-alive" : "close");
+  client.print(hdr);
+  client.write((const uint8_t *)body, cnt);
+  return 0;
+}
+
+// store the image in the request body in the cache under the hash of its contents
+int handleCacheStoreReq(WiFiClient &client, HttpRequest &req)
+{
+  const char *hash;
+  int cnt;
+  
+  if ((hash = FindHash(req)) == NULL) {
+    SendResponse(client, 403, "hash missing");
+    return -1;
+  }
+  
+  if (contentLength <= 0 || contentLength > MAX_CACHED_IMAGE_SIZE) {
+    SendResponse(client, 403, "Content-Length missing or too large");
+    return -1;
+  }
+  
+  if (imageCache.beginStore(contentLength) != 0) {
+    SendResponse(client, 403, "No room in cache");
+    return -1;
+  }
+  
+  while (bodyRemaining > 0) {
+    if ((cnt = readBody(client, image, sizeof(image))) <= 0) {
+      imageCache.abortStore();
+      SendResponse(client, 403, "Timeout receiving image");
+      return -1;
+    }
+    if (imageCache.write(image, cnt) != 0) {
+      imageCache.abortStore();
+      SendResponse(client, 403, "Writing image failed");
+      return -1;
+    }
+  }
+  
+  if (imageCache.endStore(hash) != 0) {
+    SendResponse(client, 403, "Hash mismatch");
+    return -1;
+  }
+  
+  SendResponse(client, 200, "OK");
+  return 0;
+}
+
+int handleStatusReq(WiFiClient &client, HttpRequest &req)
+{
+  SendStatus(client, keepAlive);
+}
+
+// report where the time of the last load went
+int handleStatsReq(WiFiClient &client, HttpRequest &req)
+{
+  char body[768], hdr[128];
+  int cnt = target->connection().formatStats(body, sizeof(body));
+  snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+           cnt, keepAlive ? "keep-alive" : "close");
+  client.print(hdr);
+  client.print(body);
+  return 0;
+}
+
+int handleFormatReq(WiFiClient &client, HttpRequest &req)
+{
+  imageCache.reset();
   if (!SPIFFS.format())
-    AppendResponseText("Format failed");
+    AppendResponseText(rlError, "Format failed");
   else {
     if (!ffsMounted)
       ffsMounted = SPIFFS.begin();
@@ -324,62 +1256,180 @@ int handleFormatReq(WiFiClient &client, String &req)
 }
       
 #ifdef SUPPORT_STAMP
-int handleStampReq(WiFiClient &client, String &req)
+int handleStampReq(WiFiClient &client, HttpRequest &req)
 {
   if (isBS2())
-    AppendResponseText("Found a BS2");
+    AppendResponseText(rlInfo, "Found a BS2");
   else
-    AppendResponseText("Unknown type of stamp");
+    AppendResponseText(rlInfo, "Unknown type of stamp");
   SendResponse(client, 200, "OK");
 }
 #endif
 
-const char *FindArg(String &req, const char *key)
+int ParseBaudRate(const char *arg)
 {
-  int i;
-  if ((i = req.indexOf(key)) == -1)
+  if (strncmp(arg, "auto", 4) == 0)
+    return AUTO_BAUD_RATE;
+  return atoi(arg);
+}
+
+// find the image hash argument of a cache request and check that it can be used
+const char *FindHash(HttpRequest &req)
+{
+  const char *hash;
+  if (!ffsMounted || (hash = req.arg("hash")) == NULL || !ImageCache::validHash(hash))
     return NULL;
-  return req.c_str() + i + strlen(key);
+  return hash;
+}
+
+// point target at the Propeller the request names with target=, the first one if it names none
+bool SelectTarget(HttpRequest &req)
+{
+  const char *arg;
+  PropellerTarget *selected;
+  
+  if ((selected = targets.target((arg = req.arg("target")) != NULL ? atoi(arg) : 0)) == NULL)
+    return false;
+  target = selected;
+  return true;
+}
+
+LoadType FindLoadType(HttpRequest &req)
+{
+  LoadType loadType = ltDownloadAndRun;
+  const char *command;
+  
+  if ((command = req.arg("command")) == NULL || strcmp(command, "run") == 0)
+    loadType = ltDownloadAndRun;
+  else if (strcmp(command, "program-and-run") == 0)
+    loadType = ltDownloadAndProgramAndRun;
+  else if (strcmp(command, "program") == 0)
+    loadType = ltDownloadAndProgram;
+    
+  return loadType;
 }
 
-String errorText;
+// start an empty response with the verbosity and format the client asked for
+void InitResponse(HttpRequest &req)
+{
+  const char *arg;
+  
+  responseLog.reset();
+  responseVerbosity = rlInfo;
+  responseFormat = rfText;
+  if ((arg = req.arg("verbosity")) != NULL)
+    responseVerbosity = ParseVerbosity(arg);
+  if ((arg = req.arg("format")) != NULL && strcmp(arg, "json") == 0)
+    responseFormat = rfJson;
+    
+  AppendResponseText(rlDebug, "FFS is%s mounted.", ffsMounted ? "" : " not");
+}
 
-void InitResponse()
+ResponseLevel ParseVerbosity(const char *arg)
 {
-  errorText.remove(0);
-  AppendResponseText("FFS is%s mounted.", ffsMounted ? "" : " not");
+  if (strcmp(arg, "error") == 0 || strcmp(arg, "0") == 0)
+    return rlError;
+  if (strcmp(arg, "debug") == 0 || strcmp(arg, "2") == 0)
+    return rlDebug;
+  return rlInfo;
 }
 
-void AppendResponseText(const char *fmt, ...)
+// messages the client didn't ask for cost only this test
+void AppendResponseText(ResponseLevel level, const char *fmt, ...)
 {
-  char buf[1024];
+  char buf[RESPONSE_LINE_SIZE];
   va_list ap;
+  if (level > responseVerbosity)
+    return;
   va_start(ap, fmt);
   vsnprintf(buf, sizeof(buf), fmt, ap);
   va_end(ap);
-  errorText += "<p>";
-  errorText += buf;
-  errorText += "</p>\r\n";
+  responseLog.append(buf);
 }
 
+// report how long the last load spent waiting for the Propeller to acknowledge
+void AppendAckStats()
+{
+  const LoadStats &stats = target->connection().stats();
+  AppendResponseText(rlInfo, "ack wait: %lu ms in %d acks", target->connection().ackWaitTime() / 1000, target->connection().ackCount());
+  AppendResponseText(rlInfo, "packets: %d sent, %d retries, %d ack timeouts", stats.packetCount, stats.retryCount, stats.ackTimeouts);
+}
+
+// describe what the module is doing as key=value lines
+int BuildStatus(char *buf, int size)
+{
+  int cnt;
+  
+  cnt = snprintf(buf, size, "state=%s\n", currentRequest[0] ? "busy" : "idle");
+  if (currentRequest[0])
+    cnt += snprintf(&buf[cnt], size - cnt, "request=%s\n", currentRequest);
+  cnt += snprintf(&buf[cnt], size - cnt, "acks=%d\n", target->connection().ackCount());
+  cnt += snprintf(&buf[cnt], size - cnt, "ack-wait-ms=%lu\n", target->connection().ackWaitTime() / 1000);
+  cnt += snprintf(&buf[cnt], size - cnt, "uptime-ms=%lu\n", millis());
+  if (telnetClient && telnetClient.connected()) {
+    cnt += snprintf(&buf[cnt], size - cnt, "telnet-to-serial-bytes=%lu\n", telnetStats.toSerial);
+    cnt += snprintf(&buf[cnt], size - cnt, "telnet-to-serial-bytes-per-sec=%lu\n", telnetStats.toSerialRate);
+    cnt += snprintf(&buf[cnt], size - cnt, "serial-to-telnet-bytes=%lu\n", telnetStats.toTelnet);
+    cnt += snprintf(&buf[cnt], size - cnt, "serial-to-telnet-bytes-per-sec=%lu\n", telnetStats.toTelnetRate);
+  }
+  
+  return cnt < size ? cnt : size - 1;
+}
+
+// send the status without disturbing the response of a request that is still being handled
+void SendStatus(WiFiClient &client, bool keepOpen)
+{
+  char body[MAX_REQUEST_LINE + 256], hdr[128];
+  int cnt = BuildStatus(body, sizeof(body));
+  snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+           cnt, keepOpen ? "keep-alive" : "close");
+  client.print(hdr);
+  client.print(body);
+}
+
+// describe this module so a host can choose load parameters without further requests
+int BuildDiscoverReply(char *buf, int size)
+{
+  static const int baudRates[] = { AUTO_BAUD_RATES };
+  int cachedBaudRate = GetCachedBaudRate(DEF_RESET_PIN);
+  int cnt, i;
+  
+  cnt = snprintf(buf, size, DISCOVER_REPLY);
+  cnt += snprintf(&buf[cnt], size - cnt, "mac=%s\n", macString);
+  cnt += snprintf(&buf[cnt], size - cnt, "version=%s\n", FIRMWARE_VERSION);
+  cnt += snprintf(&buf[cnt], size - cnt, "reset-pin=%d\n", DEF_RESET_PIN);
+  cnt += snprintf(&buf[cnt], size - cnt, "targets=%d\n", targets.count());
+  cnt += snprintf(&buf[cnt], size - cnt, "max-packet-size=%d\n", MAX_PACKET_SIZE);
+  cnt += snprintf(&buf[cnt], size - cnt, "max-window-size=%d\n", MAX_WINDOW_SIZE);
+  cnt += snprintf(&buf[cnt], size - cnt, "baud-rates=%d", INITIAL_BAUD_RATE);
+  for (i = 0; i < (int)(sizeof(baudRates) / sizeof(baudRates[0])); ++i)
+    cnt += snprintf(&buf[cnt], size - cnt, ",%d", baudRates[i]);
+  cnt += snprintf(&buf[cnt], size - cnt, "\nfinal-baud-rate=%d\n", cachedBaudRate > 0 ? cachedBaudRate : FINAL_BAUD_RATE);
+  
+  // hashes of the cached images, most recently used first
+  cnt += snprintf(&buf[cnt], size - cnt, "images=");
+  for (i = 0; ffsMounted && i < imageCache.imageCount() && cnt < size - IMAGE_HASH_LENGTH - 16; ++i)
+    cnt += snprintf(&buf[cnt], size - cnt, "%s%s", i > 0 ? "," : "", imageCache.imageHash(i));
+    
+  // the Propeller's serial port is in use while a request is being handled or a terminal is connected
+  cnt += snprintf(&buf[cnt], size - cnt, "\nstate=%s\n", currentRequest[0] || (telnetClient && telnetClient.connected()) ? "busy" : "idle");
+  
+  return cnt < size ? cnt : size - 1;
+}
+
+// send the status line and the messages straight from the response log
 void SendResponse(WiFiClient &client, int code, const char *fmt, ...)
 {
-  char buf[1024];
+  char reason[64], hdr[256];
   va_list ap;
-  String s;
-  snprintf(buf, sizeof(buf), "HTTP/1.1 %d ", code);
-  s += buf;
   va_start(ap, fmt);
-  vsnprintf(buf, sizeof(buf), fmt, ap);
+  vsnprintf(reason, sizeof(reason), fmt, ap);
   va_end(ap);
-  s += buf;
-  s += "\r\nContent-Type: text/html\r\n\r\n";
-  s += "<!DOCTYPE HTML>\r\n<html>\r\n";
-  s += "<body>\r\n";
-  s += errorText;
-  s += "</body>\r\n";
-  s += "</html>\r\n";
-  client.print(s);
+  snprintf(hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",
+           code, reason, responseFormat == rfJson ? "application/json" : "text/plain",
+           responseLog.write(responseFormat, NULL), keepAlive ? "keep-alive" : "close");
+  client.print(hdr);
+  responseLog.write(responseFormat, &client);
 }
 
 void setupSoftAP()
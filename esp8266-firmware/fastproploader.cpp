@@ -8,13 +8,6 @@
 #define FAILSAFE_TIMEOUT        2.0         /* Number of seconds to wait for a packet from the host */
 #define MAX_RX_SENSE_ERROR      23          /* Maximum number of cycles by which the detection of a start bit could be off (as affected by the Loader code) */
 
-// Offset (in bytes) from end of Loader Image pointing to where most host-initialized values exist.
-// Host-Initialized values are: Initial Bit Time, Final Bit Time, 1.5x Bit Time, Failsafe timeout,
-// End of Packet timeout, and ExpectedID.  In addition, the image checksum at word 5 needs to be
-// updated.  All these values need to be updated before the download stream is generated.
-// NOTE: DAT block data is always placed before the first Spin method
-#define RAW_LOADER_INIT_OFFSET_FROM_END (-(10 * 4) - 8)
-
 // Raw loader image.  This is a memory image of a Propeller Application written in PASM that fits into our initial
 // download packet.  Once started, it assists with the remainder of the download (at a faster speed and with more
 // relaxed interstitial timing conducive of Internet Protocol delivery. This memory image isn't used as-is; before
@@ -25,76 +18,198 @@
 
 static uint8_t initCallFrame[] = {0xFF, 0xFF, 0xF9, 0xFF, 0xFF, 0xFF, 0xF9, 0xFF};
 
+// encoded loaders for recent load profiles; an entry with a NULL stream is unused
+struct LoaderCacheEntry {
+    int packetID;
+    int initialBaudRate;
+    int finalBaudRate;
+    int eepromClockRate;
+    uint8_t *stream;
+    int streamSize;
+    unsigned long lastUsed;
+};
+static LoaderCacheEntry loaderCache[LOADER_CACHE_ENTRIES];
+static unsigned long loaderCacheClock = 0;
+
 FastPropellerLoader::FastPropellerLoader(PropellerConnection &connection)
-    : m_connection(connection)
+    : m_connection(connection), m_pendingData(NULL), m_windowSize(1), m_windowCount(0), m_packetSize(DEFAULT_PACKET_SIZE), m_eepromClockRate(EEPROM_CLOCK_RATE), m_decompress(false), m_lastAckWait(0)
 {
+    resetAckTimeout();
 }
 
 FastPropellerLoader::~FastPropellerLoader()
 {
 }
 
-int FastPropellerLoader::loadBegin(int imageSize, int initialBaudRate, int finalBaudRate)
+int FastPropellerLoader::loadBegin(int imageSize, int initialBaudRate, int finalBaudRate, int maxWindowSize, int packetSize)
 {
-    PropellerImage loaderImage;
-    uint8_t response[8];
-    int result, cnt;
+    uint8_t response[8], *stream;
+    int result, cnt, streamSize;
 
     PropellerLoader slowLoader(m_connection);
 
+    /* the ROM protocol runs at the initial baud rate even if an earlier attempt switched it */
+    if (m_connection.setBaudRate(initialBaudRate) != 0) {
+        AppendResponseText(rlError, "error: setting initial baud rate failed");
+        return -1;
+    }
+
+    /* the loader copies whole longs and can only buffer MAX_PACKET_SIZE bytes */
+    if (packetSize < MIN_PACKET_SIZE || packetSize > MAX_PACKET_SIZE || (packetSize & 3) != 0) {
+        AppendResponseText(rlError, "error: packet size must be a multiple of 4 between %d and %d", MIN_PACKET_SIZE, MAX_PACKET_SIZE);
+        return -1;
+    }
+    m_packetSize = packetSize;
+
     /* compute the packet ID (number of packets to be sent) */
-    m_packetID = (imageSize + MAX_PACKET_SIZE - 1) / MAX_PACKET_SIZE;
+    m_packetID = (imageSize + m_packetSize - 1) / m_packetSize;
 
-    /* generate a loader packet */
-    if (generateInitialLoaderImage(loaderImage, m_packetID, initialBaudRate, finalBaudRate) != 0) {
-        AppendResponseText("error: generateInitialLoaderImage failed");
+    /* get the encoded loader packet */
+    if (!(stream = loaderStream(m_packetID, initialBaudRate, finalBaudRate, &streamSize))) {
+        AppendResponseText(rlError, "error: generating the second-stage loader failed");
         return -1;
     }
  
     /* load the second-stage loader using the propeller ROM protocol */
-    if (slowLoader.load(loaderImage.imageData(), loaderImage.imageSize(), ltDownloadAndRun) != 0) {
-        AppendResponseText("error: failed to load second-stage loader");
+    if (slowLoader.loadEncoded(stream, streamSize, sizeof(rawLoaderImage), ltDownloadAndRun) != 0) {
+        AppendResponseText(rlError, "error: failed to load second-stage loader");
         return -1;
     }
 
     /* wait for the second-stage loader to start */
-    cnt = m_connection.receiveDataExactTimeout(response, sizeof(response), 2000);
-    AppendResponseText("response: %02x %02x %02x %02x %02x %02x %02x %02x", response[0], response[1], response[2], response[3], response[4], response[5], response[6], response[7]); 
+    m_connection.beginPhase(lpLoaderStart);
+    cnt = m_connection.waitForAck(response, sizeof(response), 2000);
+    AppendResponseText(rlDebug, "response: %02x %02x %02x %02x %02x %02x %02x %02x", response[0], response[1], response[2], response[3], response[4], response[5], response[6], response[7]); 
     result = getLong(&response[0]);
     if (cnt != 8 || result != m_packetID) {
-        AppendResponseText("error: second-stage loader failed to start - cnt %d, packetID %d, result %d", cnt, m_packetID, result);
+        AppendResponseText(rlError, "error: second-stage loader failed to start - cnt %d, packetID %d, result %d", cnt, m_packetID, result);
         return -1;
     }
 
+    /* use as large a window as both we and the loader can handle */
+    m_windowSize = 1;
+    m_windowCount = 0;
+    m_decompress = ((uint32_t)getLong(&response[4]) & WINDOW_MAGIC_MASK) == COMPRESS_MAGIC;
+    if (((uint32_t)getLong(&response[4]) & WINDOW_MAGIC_MASK) == WINDOW_MAGIC || m_decompress) {
+        m_windowSize = getLong(&response[4]) & ~WINDOW_MAGIC_MASK;
+        if (m_windowSize > maxWindowSize)
+            m_windowSize = maxWindowSize;
+        if (m_windowSize > MAX_WINDOW_SIZE)
+            m_windowSize = MAX_WINDOW_SIZE;
+        if (m_windowSize < 1)
+            m_windowSize = 1;
+    }
+    AppendResponseText(rlDebug, "window size: %d, packet size: %d%s", m_windowSize, m_packetSize, m_decompress ? ", compressed packets" : "");
+
     /* switch to the final baud rate */
     if (m_connection.setBaudRate(finalBaudRate) != 0) {
-        AppendResponseText("error: setting final baud rate failed");
+        AppendResponseText(rlError, "error: setting final baud rate failed");
         return -1;
     }
 
     /* initialize the checksum */
     m_checksum = 0;
+    m_pendingData = NULL;
+
+    /* the ack latency at a new baud rate has to be measured again */
+    resetAckTimeout();
+    m_connection.endPhase();
     
     /* return successfully */
     return 0;
 }
 
+/* loadBeginVerified
+    like loadBegin but also checks that a packet and its ack survive the trip at the final baud rate
+*/
+int FastPropellerLoader::loadBeginVerified(int imageSize, int initialBaudRate, int finalBaudRate, int maxWindowSize, int packetSize)
+{
+    if (loadBegin(imageSize, initialBaudRate, finalBaudRate, maxWindowSize, packetSize) != 0)
+        return -1;
+    return verifyFinalBaudRate();
+}
+
+/* loadBeginAuto
+    starts the second-stage loader at each of AUTO_BAUD_RATES in turn until one fails verification
+    and leaves it running at the fastest one that passed
+*/
+int FastPropellerLoader::loadBeginAuto(int imageSize, int initialBaudRate, int *pFinalBaudRate, int maxWindowSize, int packetSize)
+{
+    static const int baudRates[] = { AUTO_BAUD_RATES };
+    int count = sizeof(baudRates) / sizeof(baudRates[0]);
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        AppendResponseText(rlDebug, "trying final baud rate %d", baudRates[i]);
+        if (loadBeginVerified(imageSize, initialBaudRate, baudRates[i], maxWindowSize, packetSize) != 0)
+            break;
+    }
+
+    if (i == 0) {
+        AppendResponseText(rlError, "error: no final baud rate works");
+        return -1;
+    }
+
+    /* the loader was left at a rate that failed so start it again at the last one that worked */
+    if (i < count && loadBeginVerified(imageSize, initialBaudRate, baudRates[i - 1], maxWindowSize, packetSize) != 0)
+        return -1;
+
+    *pFinalBaudRate = baudRates[i - 1];
+    return 0;
+}
+
+/* verifyFinalBaudRate
+    sends a packet numbered above the one the loader expects; the loader discards it and acks with
+    the ID it still expects, so a correct ack shows a full packet got through without changing the load
+*/
+int FastPropellerLoader::verifyFinalBaudRate()
+{
+    uint8_t payload[VERIFY_PACKET_SIZE];
+    int32_t tag;
+    int result, i;
+
+    /* mix long runs of ones and zeros with alternating bits */
+    for (i = 0; i < (int)sizeof(payload); ++i)
+        payload[i] = (i & 4) ? 0x55 : (i & 1) ? 0xff : 0x00;
+
+    m_connection.beginPhase(lpBaudVerify);
+    if (sendPacket(m_packetID + 1, payload, sizeof(payload), &tag) != 0
+    ||  receiveAck(m_packetID + 1, tag, &result, VERIFY_TIMEOUT) != 0
+    ||  result != m_packetID) {
+        AppendResponseText(rlError, "error: final baud rate %d failed verification", m_connection.baudRate());
+        return -1;
+    }
+    m_connection.endPhase();
+
+    return 0;
+}
+
+/* loadData
+    sends the next 'size' bytes of the image; packets are numbered when loadBegin is called so the
+    size must be a multiple of packetSize() except for the last part of the image
+*/
 int FastPropellerLoader::loadData(uint8_t *data, int size)
 {
+    m_connection.beginPhase(lpData);
+
+    /* keep several packets in flight if the loader supports it */
+    if (m_windowSize > 1)
+        return loadDataWindowed(data, size);
+
     /* transmit the image */
     uint8_t *p = data;
     int remaining = size;
     while (remaining > 0) {
         int cnt, result;
-        if ((cnt = remaining) > MAX_PACKET_SIZE)
-            cnt = MAX_PACKET_SIZE;
-        AppendResponseText("Sending %d byte packet", cnt);
+        if ((cnt = remaining) > m_packetSize)
+            cnt = m_packetSize;
+        AppendResponseText(rlDebug, "Sending %d byte packet", cnt);
         if (transmitPacket(m_packetID, p, cnt, &result) != 0) {
-            AppendResponseText("error: transmitPacket failed");
+            AppendResponseText(rlError, "error: transmitPacket failed");
             return -1;
         }
         if (result != m_packetID - 1) {
-            AppendResponseText("error: unexpected result: expected %d, received %d", m_packetID - 1, result);
+            AppendResponseText(rlError, "error: unexpected result: expected %d, received %d", m_packetID - 1, result);
             return -1;
         }
         remaining -= cnt;
@@ -105,11 +220,234 @@ int FastPropellerLoader::loadData(uint8_t *data, int size)
     /* update the checksum */
     for (int i = 0; i < size; ++i)
         m_checksum += data[i];
+    m_connection.endPhase();
 
     /* return successfully */
     return 0;
 }
 
+/* loadDataWindowed
+    sends packets without waiting for each to be acknowledged, keeping up to m_windowSize
+    of them unacknowledged; on a timeout only the unacknowledged packets are retransmitted
+*/
+int FastPropellerLoader::loadDataWindowed(uint8_t *data, int size)
+{
+    uint8_t *p = data;
+    int remaining = size;
+
+    /* transmit the image */
+    while (remaining > 0) {
+        WindowSlot *slot;
+        int cnt;
+        if ((cnt = remaining) > m_packetSize)
+            cnt = m_packetSize;
+
+        /* wait for room in the window */
+        while (m_windowCount >= m_windowSize) {
+            if (receiveWindowAck() != 0)
+                return -1;
+        }
+
+        /* send the next packet */
+        slot = &m_window[m_windowCount++];
+        slot->id = m_packetID;
+        slot->payload = p;
+        slot->payloadSize = cnt;
+        slot->retries = 0;
+        if (sendPacket(slot->id, p, cnt, &slot->tag) != 0)
+            return -1;
+        remaining -= cnt;
+        p += cnt;
+        --m_packetID;
+    }
+
+    /* the caller owns the data buffer so all packets must be acknowledged before returning */
+    while (m_windowCount > 0) {
+        if (receiveWindowAck() != 0)
+            return -1;
+    }
+
+    /* update the checksum */
+    for (int i = 0; i < size; ++i)
+        m_checksum += data[i];
+    m_connection.endPhase();
+
+    /* return successfully */
+    return 0;
+}
+
+/* receiveWindowAck
+    retires the packets covered by the next acknowledgement or retransmits the unacknowledged
+    packets if none arrives in time
+    returns 0 on success or -1 if a packet has run out of retries
+*/
+int FastPropellerLoader::receiveWindowAck()
+{
+    uint8_t response[8];
+    unsigned long start = m_connection.microseconds();
+    bool retransmitted = false;
+    int i, j;
+
+    /* acks of retransmitted packets are ambiguous so they don't update the latency estimate */
+    for (i = 0; i < m_windowCount; ++i) {
+        if (m_window[i].retries > 0)
+            retransmitted = true;
+    }
+
+    /* retire the packet that prompted the ack and all packets numbered above the expected ID */
+    if (m_connection.waitForAck(response, sizeof(response), ackTimeout()) == sizeof(response)) {
+        int32_t expectedID = getLong(&response[0]);
+        int32_t tag = getLong(&response[4]);
+        m_lastAckWait = m_connection.microseconds() - start;
+        ackReceived(!retransmitted);
+        for (i = j = 0; i < m_windowCount; ++i) {
+            if (m_window[i].tag != tag && m_window[i].id <= expectedID)
+                m_window[j++] = m_window[i];
+        }
+        m_windowCount = j;
+        return 0;
+    }
+
+    /* selectively retransmit the packets that are still outstanding */
+    AppendResponseText(rlInfo, "timeout: retransmitting %d packets", m_windowCount);
+    ++m_backoff;
+    for (i = 0; i < m_windowCount; ++i) {
+        WindowSlot *slot = &m_window[i];
+        if (++slot->retries > MAX_PACKET_RETRIES) {
+            AppendResponseText(rlError, "error: packet %d not acknowledged", slot->id);
+            return -1;
+        }
+        m_connection.countRetry();
+        if (sendPacket(slot->id, slot->payload, slot->payloadSize, &slot->tag) != 0)
+            return -1;
+    }
+
+    /* return successfully */
+    return 0;
+}
+
+/* loadPacketStart
+    parameters:
+        data is a pointer to the payload of the next packet
+        size is the number of bytes in the packet (packetSize() except for the last packet)
+    returns 0 once the packet has been handed to the connection or -1 on failure
+    note: the caller must not touch the data until loadPacketFinish returns; this allows
+          the next packet to be received into another buffer while this one is acknowledged
+*/
+int FastPropellerLoader::loadPacketStart(uint8_t *data, int size)
+{
+    if (m_pendingData || size > m_packetSize) {
+        AppendResponseText(rlError, "error: loadPacketStart called out of sequence");
+        return -1;
+    }
+    if (m_packetID <= 0) {
+        AppendResponseText(rlError, "error: more data than loadBegin was told about");
+        return -1;
+    }
+
+    /* the data phase stays open between packets so it includes the time the caller takes to get the next one */
+    m_connection.beginPhase(lpData);
+    if (sendPacket(m_packetID, data, size, &m_pendingTag) != 0)
+        return -1;
+    m_pendingData = data;
+    m_pendingSize = size;
+    m_pendingRecord = false;
+    m_pendingChecksum = 0;
+    for (int i = 0; i < size; ++i)
+        m_pendingChecksum += data[i];
+    return 0;
+}
+
+/* loadRecordStart
+    like loadPacketStart but takes the packet's data as a record (see lzpack.h)
+    data receives the uncompressed data and must have room for packetSize() bytes
+    a loader that doesn't decompress is sent the uncompressed data instead of the record
+    note: neither buffer may be touched until loadPacketFinish returns
+*/
+int FastPropellerLoader::loadRecordStart(uint8_t *record, int recordSize, uint8_t *data)
+{
+    int size;
+
+    if (m_pendingData) {
+        AppendResponseText(rlError, "error: loadRecordStart called out of sequence");
+        return -1;
+    }
+    if (m_packetID <= 0) {
+        AppendResponseText(rlError, "error: more data than loadBegin was told about");
+        return -1;
+    }
+    if ((size = UnpackRecord(record, recordSize, data, m_packetSize)) < 0) {
+        AppendResponseText(rlError, "error: invalid packet record");
+        return -1;
+    }
+    if (!m_decompress)
+        return loadPacketStart(data, size);
+
+    m_connection.beginPhase(lpData);
+    if (sendPacket(m_packetID, record, recordSize, &m_pendingTag, true) != 0)
+        return -1;
+    m_pendingData = record;
+    m_pendingSize = recordSize;
+    m_pendingRecord = true;
+    m_pendingChecksum = 0;
+    for (int i = 0; i < size; ++i)
+        m_pendingChecksum += data[i];
+    return 0;
+}
+
+/* loadPacketFinish
+    waits for the acknowledgement of the packet sent by loadPacketStart, retransmitting it if necessary
+    returns 0 on success or -1 on failure
+*/
+int FastPropellerLoader::loadPacketFinish()
+{
+    uint8_t *data = m_pendingData;
+    int size = m_pendingSize;
+    int result;
+
+    if (!data) {
+        AppendResponseText(rlError, "error: loadPacketFinish called without a pending packet");
+        return -1;
+    }
+    m_pendingData = NULL;
+
+    /* fall back to stop-and-wait retransmission if the first ack doesn't arrive */
+    if (receiveAck(m_packetID, m_pendingTag, &result, ackTimeout(size)) == 0)
+        ackReceived(true);
+    else {
+        ++m_backoff;
+        m_connection.countRetry();
+        if (transmitPacket(m_packetID, data, size, &result, 0, m_pendingRecord) != 0) {
+            AppendResponseText(rlError, "error: transmitPacket failed");
+            return -1;
+        }
+    }
+    if (result != m_packetID - 1) {
+        AppendResponseText(rlError, "error: unexpected result: expected %d, received %d", m_packetID - 1, result);
+        return -1;
+    }
+    --m_packetID;
+
+    /* update the checksum */
+    m_checksum += m_pendingChecksum;
+
+    /* return successfully */
+    return 0;
+}
+
+/* setEepromClockRate
+    chooses the I2C clock rate the next loader image drives the EEPROM at
+*/
+int FastPropellerLoader::setEepromClockRate(int rate)
+{
+    if (rate <= 0 || rate > MAX_EEPROM_CLOCK_RATE) {
+        AppendResponseText(rlError, "error: EEPROM clock rate must be 1 to %d", MAX_EEPROM_CLOCK_RATE);
+        return -1;
+    }
+    m_eepromClockRate = rate;
+    return 0;
+}
+
 int FastPropellerLoader::loadEnd(LoadType loadType)
 {
     int result, i;
@@ -119,101 +457,250 @@ int FastPropellerLoader::loadEnd(LoadType loadType)
         m_checksum += initCallFrame[i];
 
     /* transmit the RAM verify packet and verify the checksum */
-    if (transmitPacket(m_packetID, verifyRAM, sizeof(verifyRAM), &result) != 0) {
-        AppendResponseText("error: transmitPacket failed");
+    m_connection.beginPhase(lpVerifyRam);
+    if (transmitPacket(m_packetID, verifyRAM, sizeof(verifyRAM), &result, VERIFY_RAM_TIME) != 0) {
+        AppendResponseText(rlError, "error: transmitPacket failed");
         return -1;
     }
     if (result != -m_checksum) {
-        AppendResponseText("error: bad checksum");
+        AppendResponseText(rlError, "error: bad checksum");
         return -1;
     }
     m_packetID = -m_checksum;
 
     /* program the eeprom if requested */
     if (loadType & ltDownloadAndProgram) {
-        if (transmitPacket(m_packetID, programVerifyEEPROM, sizeof(programVerifyEEPROM), &result, 8000) != 0) {
-            AppendResponseText("error: transmitPacket failed");
+        m_connection.beginPhase(lpProgramEeprom);
+        int programTime = m_eepromClockRate <= 100000 ? PROGRAM_EEPROM_SLOW_TIME : PROGRAM_EEPROM_TIME;
+        if (transmitPacket(m_packetID, programVerifyEEPROM, sizeof(programVerifyEEPROM), &result, programTime) != 0) {
+            AppendResponseText(rlError, "error: transmitPacket failed");
             return -1;
         }
         if (result != -m_checksum*2) {
-            AppendResponseText("error: bad checksum");
+            AppendResponseText(rlError, "error: bad checksum");
             return -1;
         }
         m_packetID = -m_checksum*2;
     }
 
     /* transmit the readyToLaunch packet */
+    m_connection.beginPhase(lpLaunch);
     if (transmitPacket(m_packetID, readyToLaunch, sizeof(readyToLaunch), &result) != 0) {
-        AppendResponseText("error: transmitPacket failed");
+        AppendResponseText(rlError, "error: transmitPacket failed");
         return -1;
     }
     if (result != m_packetID - 1) {
-        AppendResponseText("error: readyToLaunch failed");
+        AppendResponseText(rlError, "error: readyToLaunch failed");
         return -1;
     }
     --m_packetID;
 
     /* transmit the launchNow packet which actually starts the downloaded program */
-    if (transmitPacket(0, launchNow, sizeof(launchNow), NULL) != 0) {
-        AppendResponseText("error: transmitPacket failedp");
+    if (transmitPacket(m_packetID, launchNow, sizeof(launchNow), NULL) != 0) {
+        AppendResponseText(rlError, "error: transmitPacket failedp");
         return -1;
     }
+    m_connection.endPhase();
 
     /* return successfully */
     return 0;
 }
 
-int FastPropellerLoader::transmitPacket(int id, uint8_t *payload, int payloadSize, int *pResult, int timeout)
+/* transmitPacket
+    sends a packet and waits for its ack, retransmitting it if the ack doesn't arrive
+    processingTime is the number of milliseconds the loader needs to act on the packet before acking it
+*/
+int FastPropellerLoader::transmitPacket(int id, uint8_t *payload, int payloadSize, int *pResult, int processingTime, bool isRecord)
 {
-    uint8_t hdr[8], response[8];
-    int retries, result, cnt;
+    int retries;
     int32_t tag;
 
-    /* initialize the packet header */
-    setLong(&hdr[0], id);
-
     /* send the packet */
-    retries = 3;
-    while (--retries >= 0) {
-
-        /* setup the packet header */
-        tag = (int32_t)rand();
-        setLong(&hdr[4], tag);
-        if (m_connection.sendData(hdr, sizeof(hdr)) != sizeof(hdr)
-        ||  m_connection.sendData(payload, payloadSize) != payloadSize) {
-            AppendResponseText("error: sendData failed");
+    for (retries = 0; retries <= MAX_PACKET_RETRIES; ++retries) {
+        if (retries > 0)
+            m_connection.countRetry();
+        if (sendPacket(id, payload, payloadSize, &tag, isRecord) != 0)
             return -1;
-        }
         
+        /* don't wait for a result */
+        if (!pResult)
+            return 0;
+
         /* receive the response */
-        if (pResult) {
-            cnt = m_connection.receiveDataExactTimeout(response, sizeof(response), timeout);
-            AppendResponseText("response: %02x %02x %02x %02x %02x %02x %02x %02x", response[0], response[1], response[2], response[3], response[4], response[5], response[6], response[7]); 
-            result = getLong(&response[0]);
-            if (cnt == 8 && getLong(&response[4]) == tag && result != id) {
-                *pResult = result;
-                return 0;
-            }
-            AppendResponseText("error: transmitPacket failed - cnt %d, tag %d, result %d, id %d", cnt, tag, result, id);
+        if (receiveAck(id, tag, pResult, ackTimeout(payloadSize) + processingTime) == 0) {
+            ackReceived(retries == 0 && processingTime == 0);
+            return 0;
         }
+        ++m_backoff;
+    }
 
-        /* don't wait for a result */
-        else
-            return 0;
+    /* return timeout */
+    return -1;
+}
+
+/* ackTimeout
+    returns the number of milliseconds to wait for the ack of a data packet of 'payloadSize' bytes
+*/
+int FastPropellerLoader::ackTimeout(int payloadSize)
+{
+    int baudRate = m_connection.baudRate();
+    unsigned long transferTime, latency, timeout;
+
+    /* time to send the header and payload and receive the ack, in microseconds */
+    transferTime = baudRate >= 1000 ? (unsigned long)(8 + payloadSize + 8) * 10000 / (baudRate / 1000) : 0;
+
+    if (m_ackLatency < 0)
+        latency = INITIAL_ACK_LATENCY * 1000UL;
+    else
+        latency = m_ackLatency + 4 * m_ackVariation;
+
+    timeout = (transferTime + latency + 999) / 1000;
+    timeout <<= m_backoff < 8 ? m_backoff : 8;
+    if (timeout < MIN_ACK_TIMEOUT)
+        timeout = MIN_ACK_TIMEOUT;
+    if (timeout > MAX_ACK_TIMEOUT)
+        timeout = MAX_ACK_TIMEOUT;
+    return (int)timeout;
+}
+
+/* ackReceived
+    clears the backoff and, if the ack wasn't for a retransmitted packet, adds the time it took to
+    the smoothed latency and deviation (gains of 1/8 and 1/4 as in TCP)
+*/
+void FastPropellerLoader::ackReceived(bool timed)
+{
+    long sample = (long)m_lastAckWait;
+
+    m_backoff = 0;
+    if (!timed)
+        return;
+
+    if (m_ackLatency < 0) {
+        m_ackLatency = sample;
+        m_ackVariation = sample / 2;
+    }
+    else {
+        long error = sample - m_ackLatency;
+        m_ackVariation += ((error < 0 ? -error : error) - m_ackVariation) / 4;
+        m_ackLatency += error / 8;
+    }
+}
+
+int FastPropellerLoader::sendPacket(int id, uint8_t *payload, int payloadSize, int32_t *pTag, bool isRecord)
+{
+    uint8_t hdr[8 + RECORD_HEADER_SIZE];
+    int hdrSize = 8;
+
+    /* setup the packet header */
+    m_connection.countPacket();
+    setLong(&hdr[0], id);
+    *pTag = (int32_t)rand();
+    setLong(&hdr[4], *pTag);
+
+    /* a decompressing loader takes data packets as records so uncompressed data goes in one stored as-is */
+    if (m_decompress && id > 0 && !isRecord) {
+        setLong(&hdr[8], (payloadSize << 16) | payloadSize);
+        hdrSize += RECORD_HEADER_SIZE;
+    }
+
+    /* send the packet */
+    if (m_connection.sendData(hdr, hdrSize) != hdrSize
+    ||  m_connection.sendData(payload, payloadSize) != payloadSize) {
+        AppendResponseText(rlError, "error: sendData failed");
+        return -1;
+    }
+
+    /* return successfully */
+    return 0;
+}
+
+int FastPropellerLoader::receiveAck(int id, int32_t tag, int *pResult, int timeout)
+{
+    uint8_t response[8];
+    int result, cnt;
+
+    /* receive the response */
+    unsigned long start = m_connection.microseconds();
+    cnt = m_connection.waitForAck(response, sizeof(response), timeout);
+    m_lastAckWait = m_connection.microseconds() - start;
+    AppendResponseText(rlDebug, "response: %02x %02x %02x %02x %02x %02x %02x %02x", response[0], response[1], response[2], response[3], response[4], response[5], response[6], response[7]); 
+    result = getLong(&response[0]);
+    if (cnt == 8 && getLong(&response[4]) == tag && result != id) {
+        *pResult = result;
+        return 0;
     }
+    AppendResponseText(rlError, "error: transmitPacket failed - cnt %d, tag %d, result %d, id %d", cnt, tag, result, id);
 
     /* return timeout */
     return -1;
 }
 
+/* loaderStream
+    returns the encoded second-stage loader for a load profile, generating it if it isn't cached,
+    or NULL if there isn't enough memory
+*/
+uint8_t *FastPropellerLoader::loaderStream(int packetID, int initialBaudRate, int finalBaudRate, int *pStreamSize)
+{
+    LoaderCacheEntry *entry, *victim = &loaderCache[0];
+    uint8_t *image;
+    int i;
+
+    /* use the loader generated for the same profile */
+    for (i = 0; i < LOADER_CACHE_ENTRIES; ++i) {
+        entry = &loaderCache[i];
+        if (entry->stream
+        &&  entry->packetID == packetID
+        &&  entry->initialBaudRate == initialBaudRate
+        &&  entry->finalBaudRate == finalBaudRate
+        &&  entry->eepromClockRate == m_eepromClockRate) {
+            entry->lastUsed = ++loaderCacheClock;
+            *pStreamSize = entry->streamSize;
+            AppendResponseText(rlDebug, "loader: cached, %d bytes", entry->streamSize);
+            return entry->stream;
+        }
+        if (!entry->stream || (victim->stream && entry->lastUsed < victim->lastUsed))
+            victim = entry;
+    }
+
+    /* the least recently used entry makes room for this one */
+    free(victim->stream);
+    victim->stream = NULL;
+
+    /* patch a copy of the template so the template itself never changes */
+    if (!(image = (uint8_t *)malloc(sizeof(rawLoaderImage))))
+        return NULL;
+    memcpy(image, rawLoaderImage, sizeof(rawLoaderImage));
+    PropellerImage loaderImage(image, sizeof(rawLoaderImage));
+    if (generateInitialLoaderImage(loaderImage, packetID, initialBaudRate, finalBaudRate) != 0) {
+        free(image);
+        return NULL;
+    }
+
+    /* encode it once for every load with this profile */
+    victim->streamSize = PropellerLoader::encodeImage(image, sizeof(rawLoaderImage), NULL, 0);
+    if ((victim->stream = (uint8_t *)malloc(victim->streamSize)) != NULL)
+        PropellerLoader::encodeImage(image, sizeof(rawLoaderImage), victim->stream, victim->streamSize);
+    free(image);
+    if (!victim->stream)
+        return NULL;
+
+    victim->packetID = packetID;
+    victim->initialBaudRate = initialBaudRate;
+    victim->finalBaudRate = finalBaudRate;
+    victim->eepromClockRate = m_eepromClockRate;
+    victim->lastUsed = ++loaderCacheClock;
+    *pStreamSize = victim->streamSize;
+    AppendResponseText(rlDebug, "loader: generated, %d bytes", victim->streamSize);
+    return victim->stream;
+}
+
 double ClockSpeed = 80000000.0;
 
 int FastPropellerLoader::generateInitialLoaderImage(PropellerImage &image, int packetID, int initialBaudRate, int finalBaudRate)
 {
-    int initAreaOffset = sizeof(rawLoaderImage) + RAW_LOADER_INIT_OFFSET_FROM_END;
+    int initAreaOffset = image.imageSize() + RAW_LOADER_INIT_OFFSET_FROM_END;
  
-    // Make an image from the loader template
-    image.setImage(rawLoaderImage, sizeof(rawLoaderImage));
+    // The image is a copy of the loader template
  
     // Clock mode
     //image.setLong(initAreaOffset +  0, 0);
@@ -233,18 +720,35 @@ int FastPropellerLoader::generateInitialLoaderImage(PropellerImage &image, int p
     // EndOfPacket Timeout (2 bytes worth of Loader's Receive loop iterations).
     image.setLong(initAreaOffset + 20, (int)trunc((2.0 * ClockSpeed / finalBaudRate) * (10.0 / 12.0) + 0.5));
 
-    // PatchLoaderLongValue(RawSize*4+RawLoaderInitOffset + 24, Max(Round(ClockSpeed * SSSHTime), 14));
-    // PatchLoaderLongValue(RawSize*4+RawLoaderInitOffset + 28, Max(Round(ClockSpeed * SCLHighTime), 14));
-    // PatchLoaderLongValue(RawSize*4+RawLoaderInitOffset + 32, Max(Round(ClockSpeed * SCLLowTime), 26));
+    // I2C minimum times in seconds for the mode that covers the EEPROM clock rate
+    double sTime, sclHighTime, sclLowTime;
+    if (m_eepromClockRate <= 100000) {
+        sTime = 0.0000047;
+        sclHighTime = 0.000004;
+        sclLowTime = 0.0000047;
+    }
+    else if (m_eepromClockRate <= 400000) {
+        sTime = 0.0000006;
+        sclHighTime = 0.0000006;
+        sclLowTime = 0.0000013;
+    }
+    else {
+        sTime = 0.00000026;
+        sclHighTime = 0.00000026;
+        sclLowTime = 0.0000005;
+    }
 
     // Minimum EEPROM Start/Stop Condition setup/hold time (400 KHz = 1/0.6 µS); Minimum 14 cycles
-    //image.setLong(initAreaOffset + 24, 14);
+    int cycles = (int)trunc(ClockSpeed * sTime + 0.5);
+    image.setLong(initAreaOffset + 24, cycles > 14 ? cycles : 14);
 
     // Minimum EEPROM SCL high time (400 KHz = 1/0.6 µS); Minimum 14 cycles
-    //image.setLong(initAreaOffset + 28, 14);
+    cycles = (int)trunc(ClockSpeed * sclHighTime + 0.5);
+    image.setLong(initAreaOffset + 28, cycles > 14 ? cycles : 14);
 
     // Minimum EEPROM SCL low time (400 KHz = 1/1.3 µS); Minimum 26 cycles
-    //image.setLong(initAreaOffset + 32, 26);
+    cycles = (int)trunc(ClockSpeed * sclLowTime + 0.5);
+    image.setLong(initAreaOffset + 32, cycles > 26 ? cycles : 26);
 
     // First Expected Packet ID; total packet count.
     image.setLong(initAreaOffset + 36, packetID);
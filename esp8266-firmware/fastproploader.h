@@ -5,21 +5,118 @@
 
 #include "propimage.h"
 #include "proploader.h"
+#include "lzpack.h"
 
-// size of data buffer in the second-stage loader
-#define MAX_PACKET_SIZE     1024
+// largest packet payload the second-stage loader can buffer (MaxPayload in IP_Loader.spin less
+// the 8 byte header).  The loader ends a packet when the line goes quiet rather than by its length,
+// so the host can use any size up to this one.  Fewer, larger packets mean fewer ack round trips.
+#define MAX_PACKET_SIZE     1384
+
+// packet payload size used unless the caller chooses another; sizes must be a multiple of 4
+#define DEFAULT_PACKET_SIZE 1024
+#define MIN_PACKET_SIZE     64
+
+// Offset (in bytes) from end of Loader Image pointing to where most host-initialized values exist.
+// Host-Initialized values are: Initial Bit Time, Final Bit Time, 1.5x Bit Time, Failsafe timeout,
+// End of Packet timeout, and ExpectedID.  In addition, the image checksum at word 5 needs to be
+// updated.  All these values need to be updated before the download stream is generated.
+// NOTE: DAT block data is always placed before the first Spin method
+#define RAW_LOADER_INIT_OFFSET_FROM_END (-(10 * 4) - 8)
+
+// A second-stage loader that can accept packets while earlier ones are still being acknowledged
+// says so in its "ready" response: the transmission ID long is WINDOW_MAGIC with the number of
+// packets it can buffer in the low byte.  Its acknowledgements keep the usual format (the next
+// packet ID it is missing followed by the transmission ID of the packet that prompted the ack)
+// so the host can retire both the tagged packet and everything numbered above the expected ID.
+// Packets in a window follow each other without a gap, so such a loader must end a full-sized
+// packet by its length rather than by line silence.  A packet numbered above the expected ID is
+// already in place, so the loader acknowledges it without storing it, just as the stop-and-wait
+// loader does with any packet it isn't expecting.
+// Any other value in the ready response means the loader only supports stop-and-wait.
+#define WINDOW_MAGIC        0x57494e00      // 'WIN\0'
+#define WINDOW_MAGIC_MASK   0xffffff00
+#define MAX_WINDOW_SIZE     8
+
+// A second-stage loader that decompresses packets answers with COMPRESS_MAGIC in place of WINDOW_MAGIC,
+// again with the number of packets it can buffer in the low byte (1 for stop-and-wait).  It takes
+// every data packet as a record (see lzpack.h) and has room for MAX_PACKET_SIZE bytes plus the record
+// header; a windowed one ends a data packet by the length in its record header.  It writes the
+// uncompressed data to hub RAM so the RAM checksum still covers the image as loaded.
+#define COMPRESS_MAGIC      0x4c5a0000      // 'LZ\0\0'
+
+// final baud rates tried by loadBeginAuto, slowest first
+#define AUTO_BAUD_RATES     230400, 460800, 921600, 1500000, 2000000, 3000000
+
+// size of the packet used to check that the final baud rate works and how long to wait for its ack
+#define VERIFY_PACKET_SIZE  128
+#define VERIFY_TIMEOUT      250
+
+// Data packet ack timeouts adapt to the measured ack latency the way TCP's retransmission timeout
+// does: the time to send the packet plus the smoothed latency plus four times its variation, doubled
+// for each consecutive timeout.  Until an ack has been timed INITIAL_ACK_LATENCY is assumed.  The
+// timeout never exceeds MAX_ACK_TIMEOUT so a retransmission reaches the loader before its failsafe
+// timeout gives up on the host.  Packets the loader takes longer to act on get the time they need
+// added on top, and their acks don't update the latency estimate.
+#define INITIAL_ACK_LATENCY 500
+#define MIN_ACK_TIMEOUT     20
+#define MAX_ACK_TIMEOUT     1000
+#define MAX_PACKET_RETRIES  4
+
+// milliseconds the loader may take to checksum RAM and to program and verify the EEPROM,
+// which takes longer when the EEPROM is clocked at standard mode rates
+#define VERIFY_RAM_TIME             250
+#define PROGRAM_EEPROM_TIME         8000
+#define PROGRAM_EEPROM_SLOW_TIME    16000
+
+// I2C clock rate the loader drives the EEPROM at unless the caller chooses another.  The loader's
+// start/stop setup, SCL high and SCL low times are set from the minimums of the I2C mode that covers
+// the rate: standard mode up to 100 kHz, fast mode up to 400 kHz and fast mode plus up to 1 MHz.
+#define EEPROM_CLOCK_RATE       400000
+#define MAX_EEPROM_CLOCK_RATE   1000000
+
+// The encoded second-stage loader is kept for the most recently used load profiles (baud rates, packet
+// count and EEPROM clock rate) so loading the same image again skips patching and encoding it.  Each
+// loader is generated from a copy of the template and the entries are shared by every loader.
+#define LOADER_CACHE_ENTRIES    2
 
 class FastPropellerLoader
 {
 public:
     FastPropellerLoader(PropellerConnection &connection);
     ~FastPropellerLoader();
-    int loadBegin(int imageSize, int initialBaudRate = INITIAL_BAUD_RATE, int finalBaudRate = FINAL_BAUD_RATE);
+    int loadBegin(int imageSize, int initialBaudRate = INITIAL_BAUD_RATE, int finalBaudRate = FINAL_BAUD_RATE, int maxWindowSize = MAX_WINDOW_SIZE, int packetSize = DEFAULT_PACKET_SIZE);
+    int loadBeginVerified(int imageSize, int initialBaudRate, int finalBaudRate, int maxWindowSize = MAX_WINDOW_SIZE, int packetSize = DEFAULT_PACKET_SIZE);
+    int loadBeginAuto(int imageSize, int initialBaudRate, int *pFinalBaudRate, int maxWindowSize = MAX_WINDOW_SIZE, int packetSize = DEFAULT_PACKET_SIZE);
     int loadData(uint8_t *data, int size);
+    int loadPacketStart(uint8_t *data, int size);
+    int loadRecordStart(uint8_t *record, int recordSize, uint8_t *data);
+    int loadPacketFinish();
     int loadEnd(LoadType loadType);
+    int setEepromClockRate(int rate);
+    int windowSize() { return m_windowSize; }
+    int packetSize() { return m_packetSize; }
+    bool decompresses() { return m_decompress; }
+    int ackTimeout() { return ackTimeout(m_packetSize); }
+    int ackTimeout(int payloadSize);
 
 private:
-    int transmitPacket(int id, uint8_t *payload, int payloadSize, int *pResult, int timeout = 2000);
+    struct WindowSlot {
+        int32_t id;
+        int32_t tag;
+        uint8_t *payload;
+        int payloadSize;
+        int retries;
+    };
+
+    int verifyFinalBaudRate();
+    int loadDataWindowed(uint8_t *data, int size);
+    int receiveWindowAck();
+    int transmitPacket(int id, uint8_t *payload, int payloadSize, int *pResult, int processingTime = 0, bool isRecord = false);
+    int sendPacket(int id, uint8_t *payload, int payloadSize, int32_t *pTag, bool isRecord = false);
+    int receiveAck(int id, int32_t tag, int *pResult, int timeout);
+    void ackReceived(bool timed);
+    void resetAckTimeout() { m_ackLatency = -1; m_ackVariation = 0; m_backoff = 0; }
+    uint8_t *loaderStream(int packetID, int initialBaudRate, int finalBaudRate, int *pStreamSize);
     int generateInitialLoaderImage(PropellerImage &image, int packetID, int initialBaudRate, int finalBaudRate);
 
     static int32_t getLong(const uint8_t *buf);
@@ -28,6 +125,21 @@ private:
     PropellerConnection &m_connection;
     int32_t m_packetID;
     int32_t m_checksum;
+    uint8_t *m_pendingData;
+    int m_pendingSize;
+    int32_t m_pendingTag;
+    int32_t m_pendingChecksum;  // sum of the uncompressed bytes of the pending packet
+    bool m_pendingRecord;
+    WindowSlot m_window[MAX_WINDOW_SIZE];
+    int m_windowSize;
+    int m_windowCount;
+    int m_packetSize;           // payload size of every packet but the last
+    int m_eepromClockRate;      // I2C clock rate used to set the loader's EEPROM timing
+    bool m_decompress;          // the loader takes data packets as records
+    long m_ackLatency;          // smoothed ack latency in microseconds or -1 if no ack has been timed
+    long m_ackVariation;        // smoothed deviation of the ack latency
+    int m_backoff;              // consecutive ack timeouts, each of which doubles the timeout
+    unsigned long m_lastAckWait;
 };
 
 #endif // FASTPROPELLERLOADER_H
@@ -0,0 +1,195 @@
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <ctype.h>
+#include "httprequest.h"
+
+void HttpRequest::reset()
+{
+    m_state = hpRequestLine;
+    m_errorCode = 0;
+    m_line[0] = '\0';
+    m_lineLength = 0;
+    m_headerLength = 0;
+    m_method = hmUnknown;
+    m_path = "";
+    m_argCount = 0;
+    m_contentLength = -1;
+    m_keepAlive = false;
+    m_expectContinue = false;
+}
+
+/* parse
+    takes the next byte of the request and returns the state of the parse
+    the state is hpComplete after the blank line that ends the header
+*/
+HttpParseState HttpRequest::parse(int ch)
+{
+    switch (m_state) {
+    case hpRequestLine:
+        if (ch == '\n') {
+            // ignore blank lines before the request line
+            if (m_lineLength > 0) {
+                m_line[m_lineLength] = '\0';
+                parseRequestLine();
+            }
+        }
+        else if (ch != '\r') {
+            if (m_lineLength >= HTTP_MAX_REQUEST_LINE - 1)
+                fail(414);
+            else
+                m_line[m_lineLength++] = ch;
+        }
+        break;
+    case hpHeaders:
+        if (ch == '\n') {
+            if (m_headerLength == 0)
+                m_state = hpComplete;
+            else {
+                m_header[m_headerLength] = '\0';
+                parseHeaderLine();
+                m_headerLength = 0;
+            }
+        }
+        else if (ch != '\r' && m_headerLength < HTTP_MAX_HEADER_LINE - 1)
+            m_header[m_headerLength++] = ch;
+        break;
+    default:
+        break;
+    }
+    return m_state;
+}
+
+/* arg
+    returns the value of a query parameter, an empty string if it has no value or NULL if it is missing
+*/
+const char *HttpRequest::arg(const char *key)
+{
+    int i;
+    for (i = 0; i < m_argCount; ++i) {
+        if (strcmp(m_argKeys[i], key) == 0)
+            return m_argValues[i];
+    }
+    return NULL;
+}
+
+/* parseRequestLine
+    splits "METHOD target HTTP/x.y" in place so the method, path and arguments point into m_line
+*/
+void HttpRequest::parseRequestLine()
+{
+    char *target, *version, *query;
+
+    if (!(target = strchr(m_line, ' ')) || !(version = strchr(target + 1, ' '))) {
+        fail(400);
+        return;
+    }
+    *target++ = '\0';
+    *version++ = '\0';
+
+    if (strcmp(m_line, "GET") == 0)
+        m_method = hmGet;
+    else if (strcmp(m_line, "POST") == 0)
+        m_method = hmPost;
+
+    // HTTP/1.1 connections are persistent unless the client asks otherwise
+    m_keepAlive = strcmp(version, "HTTP/1.1") == 0;
+
+    if ((query = strchr(target, '?')) != NULL) {
+        *query++ = '\0';
+        parseQuery(query);
+    }
+    decode(target, false);
+    m_path = target;
+
+    m_state = hpHeaders;
+}
+
+void HttpRequest::parseQuery(char *query)
+{
+    char *next, *value;
+
+    for (; query && m_argCount < HTTP_MAX_ARGS; query = next) {
+        if ((next = strchr(query, '&')) != NULL)
+            *next++ = '\0';
+        if (*query == '\0')
+            continue;
+        if ((value = strchr(query, '=')) != NULL)
+            *value++ = '\0';
+        else
+            value = query + strlen(query);
+        decode(query, true);
+        decode(value, true);
+        m_argKeys[m_argCount] = query;
+        m_argValues[m_argCount] = value;
+        ++m_argCount;
+    }
+}
+
+/* parseHeaderLine
+    picks out the headers that change how the request is handled and ignores the rest
+*/
+void HttpRequest::parseHeaderLine()
+{
+    char *value, *p;
+    long length;
+
+    if (!(value = strchr(m_header, ':')))
+        return;
+    *value++ = '\0';
+    while (*value == ' ' || *value == '\t')
+        ++value;
+    for (p = value; *p; ++p)
+        *p = tolower((unsigned char)*p);
+
+    // a length too big for an int is treated as a missing one
+    if (strcasecmp(m_header, "Content-Length") == 0) {
+        length = isdigit((unsigned char)*value) ? strtol(value, NULL, 10) : -1;
+        m_contentLength = length >= 0 && length < INT_MAX ? (int)length : -1;
+    }
+    else if (strcasecmp(m_header, "Connection") == 0) {
+        if (strstr(value, "close") != NULL)
+            m_keepAlive = false;
+        else if (strstr(value, "keep-alive") != NULL)
+            m_keepAlive = true;
+    }
+    else if (strcasecmp(m_header, "Expect") == 0)
+        m_expectContinue = strcmp(value, "100-continue") == 0;
+}
+
+void HttpRequest::fail(int errorCode)
+{
+    m_state = hpError;
+    m_errorCode = errorCode;
+}
+
+// undo the %xx escapes of a URL in place and, in a query, the '+' that stands for a space
+void HttpRequest::decode(char *str, bool query)
+{
+    char *out = str;
+    int hi, lo;
+
+    for (; *str; ++str) {
+        if (*str == '%' && (hi = hexDigit(str[1])) >= 0 && (lo = hexDigit(str[2])) >= 0) {
+            *out++ = (hi << 4) | lo;
+            str += 2;
+        }
+        else if (*str == '+' && query)
+            *out++ = ' ';
+        else
+            *out++ = *str;
+    }
+    *out = '\0';
+}
+
+int HttpRequest::hexDigit(int ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
@@ -0,0 +1,68 @@
+#ifndef __HTTPREQUEST_H__
+#define __HTTPREQUEST_H__
+
+// longest request line accepted; a longer one is answered with 414
+#define HTTP_MAX_REQUEST_LINE   256
+
+// longest part of a header line that is examined; the rest of a longer line is ignored
+#define HTTP_MAX_HEADER_LINE    64
+
+// most query parameters kept from the request line
+#define HTTP_MAX_ARGS           8
+
+enum HttpMethod {
+    hmUnknown,
+    hmGet,
+    hmPost
+};
+
+enum HttpParseState {
+    hpRequestLine,
+    hpHeaders,
+    hpComplete,
+    hpError
+};
+
+// an HTTP request header parsed one byte at a time into fixed buffers
+class HttpRequest
+{
+public:
+    HttpRequest() { reset(); }
+    ~HttpRequest() {}
+    void reset();
+    HttpParseState parse(int ch);
+    HttpParseState state() { return m_state; }
+    int errorCode() { return m_errorCode; }
+    HttpMethod method() { return m_method; }
+    const char *methodName() { return m_line; }
+    const char *path() { return m_path; }
+    const char *arg(const char *key);
+    int contentLength() { return m_contentLength; }
+    bool keepAlive() { return m_keepAlive; }
+    bool expectContinue() { return m_expectContinue; }
+
+private:
+    void parseRequestLine();
+    void parseQuery(char *query);
+    void parseHeaderLine();
+    void fail(int errorCode);
+    static void decode(char *str, bool query);
+    static int hexDigit(int ch);
+
+    HttpParseState m_state;
+    int m_errorCode;
+    char m_line[HTTP_MAX_REQUEST_LINE];
+    int m_lineLength;
+    char m_header[HTTP_MAX_HEADER_LINE];
+    int m_headerLength;
+    HttpMethod m_method;
+    const char *m_path;
+    const char *m_argKeys[HTTP_MAX_ARGS];
+    const char *m_argValues[HTTP_MAX_ARGS];
+    int m_argCount;
+    int m_contentLength;
+    bool m_keepAlive;
+    bool m_expectContinue;
+};
+
+#endif
@@ -0,0 +1,232 @@
+#include <string.h>
+#include <stdio.h>
+#include "imagecache.h"
+
+ImageCache::ImageCache(FS &fs)
+    : m_fs(fs), m_loaded(false), m_count(0)
+{
+}
+
+uint64_t ImageCache::hash(const uint8_t *data, int size, uint64_t hash)
+{
+    while (--size >= 0) {
+        hash ^= *data++;
+        hash *= IMAGE_HASH_PRIME;
+    }
+    return hash;
+}
+
+/* packetHash
+    folds the image hash of one packet into 32 bits so a client can tell which packets changed
+*/
+uint32_t ImageCache::packetHash(const uint8_t *data, int size)
+{
+    uint64_t value = hash(data, size);
+    return (uint32_t)(value ^ (value >> 32));
+}
+
+/* formatHash
+    writes a hash as IMAGE_HASH_LENGTH hex digits; 'text' needs room for IMAGE_HASH_LENGTH + 1 bytes
+*/
+void ImageCache::formatHash(uint64_t hash, char *text)
+{
+    snprintf(text, IMAGE_HASH_LENGTH + 1, "%08lx%08lx", (unsigned long)(hash >> 32), (unsigned long)(hash & 0xffffffff));
+}
+
+/* validHash
+    checks that a hash from a request can safely be used as a file name
+*/
+bool ImageCache::validHash(const char *hash)
+{
+    int i;
+    for (i = 0; i < IMAGE_HASH_LENGTH; ++i) {
+        if (!((hash[i] >= '0' && hash[i] <= '9') || (hash[i] >= 'a' && hash[i] <= 'f')))
+            return false;
+    }
+    return true;
+}
+
+bool ImageCache::contains(const char *hash)
+{
+    loadIndex();
+    return find(hash) != -1;
+}
+
+/* open
+    opens a cached image for reading and makes it the most recently used one
+*/
+File ImageCache::open(const char *hash)
+{
+    char path[32];
+    loadIndex();
+    if (find(hash) == -1)
+        return File();
+    imagePath(path, hash);
+    File file = m_fs.open(path, "r");
+    if (file)
+        touch(hash);
+    return file;
+}
+
+/* beginStore
+    evicts the least recently used images until there is room for one of 'size' bytes
+    fails rather than evicting 'keep' if it is given, since it may be open
+*/
+int ImageCache::beginStore(int size, const char *keep)
+{
+    FSInfo info;
+
+    loadIndex();
+    abortStore();
+
+    if (m_count >= MAX_CACHED_IMAGES) {
+        if (keep && find(keep) == m_count - 1)
+            return -1;
+        evictOldest();
+    }
+    for (;;) {
+        if (!m_fs.info(info))
+            return -1;
+        if ((int)(info.totalBytes - info.usedBytes) >= size + IMAGE_CACHE_RESERVE)
+            break;
+        if (m_count == 0 || (keep && find(keep) == m_count - 1))
+            return -1;
+        evictOldest();
+    }
+
+    if (!(m_file = m_fs.open(IMAGE_CACHE_TEMP, "w")))
+        return -1;
+    m_hash = IMAGE_HASH_INIT;
+    return 0;
+}
+
+int ImageCache::write(const uint8_t *data, int size)
+{
+    if (!m_file || (int)m_file.write(data, size) != size)
+        return -1;
+    m_hash = hash(data, size, m_hash);
+    return 0;
+}
+
+/* endStore
+    moves the stored image into the cache if its contents match the hash it was sent with
+*/
+int ImageCache::endStore(const char *hash)
+{
+    char actual[IMAGE_HASH_LENGTH + 1], path[32];
+
+    if (!m_file)
+        return -1;
+    m_file.close();
+    m_file = File();
+
+    formatHash(m_hash, actual);
+    if (strncmp(actual, hash, IMAGE_HASH_LENGTH) != 0) {
+        m_fs.remove(IMAGE_CACHE_TEMP);
+        return -1;
+    }
+
+    imagePath(path, actual);
+    m_fs.remove(path);
+    if (!m_fs.rename(IMAGE_CACHE_TEMP, path)) {
+        m_fs.remove(IMAGE_CACHE_TEMP);
+        return -1;
+    }
+    touch(actual);
+
+    return 0;
+}
+
+void ImageCache::abortStore()
+{
+    if (m_file) {
+        m_file.close();
+        m_file = File();
+        m_fs.remove(IMAGE_CACHE_TEMP);
+    }
+}
+
+/* loadIndex
+    reads the LRU order saved by the last change and drops entries whose images have gone
+*/
+void ImageCache::loadIndex()
+{
+    char hash[IMAGE_HASH_LENGTH + 1], path[32];
+
+    if (m_loaded)
+        return;
+    m_loaded = true;
+    m_count = 0;
+
+    File file = m_fs.open(IMAGE_CACHE_INDEX, "r");
+    if (file) {
+        while (m_count < MAX_CACHED_IMAGES && file.read((uint8_t *)hash, IMAGE_HASH_LENGTH + 1) == IMAGE_HASH_LENGTH + 1) {
+            hash[IMAGE_HASH_LENGTH] = '\0';
+            imagePath(path, hash);
+            if (validHash(hash) && m_fs.exists(path))
+                strcpy(m_index[m_count++], hash);
+        }
+        file.close();
+    }
+
+    /* images missing from the index could never be evicted so remove them */
+    Dir dir = m_fs.openDir(IMAGE_CACHE_DIR);
+    while (dir.next()) {
+        String name = dir.fileName();
+        if (find(name.c_str() + strlen(IMAGE_CACHE_DIR)) == -1)
+            m_fs.remove(name.c_str());
+    }
+}
+
+void ImageCache::saveIndex()
+{
+    int i;
+    File file = m_fs.open(IMAGE_CACHE_INDEX, "w");
+    if (!file)
+        return;
+    for (i = 0; i < m_count; ++i) {
+        file.write((const uint8_t *)m_index[i], IMAGE_HASH_LENGTH);
+        file.write('\n');
+    }
+    file.close();
+}
+
+int ImageCache::find(const char *hash)
+{
+    int i;
+    for (i = 0; i < m_count; ++i) {
+        if (strncmp(m_index[i], hash, IMAGE_HASH_LENGTH) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* touch
+    moves an image to the front of the index, adding it if it isn't there already
+*/
+void ImageCache::touch(const char *hash)
+{
+    int i;
+    if ((i = find(hash)) == -1)
+        i = m_count < MAX_CACHED_IMAGES ? m_count++ : MAX_CACHED_IMAGES - 1;
+    for (; i > 0; --i)
+        strcpy(m_index[i], m_index[i - 1]);
+    strncpy(m_index[0], hash, IMAGE_HASH_LENGTH);
+    m_index[0][IMAGE_HASH_LENGTH] = '\0';
+    saveIndex();
+}
+
+void ImageCache::evictOldest()
+{
+    char path[32];
+    if (m_count == 0)
+        return;
+    imagePath(path, m_index[--m_count]);
+    m_fs.remove(path);
+    saveIndex();
+}
+
+void ImageCache::imagePath(char *path, const char *hash)
+{
+    snprintf(path, 32, "%s%.*s", IMAGE_CACHE_DIR, IMAGE_HASH_LENGTH, hash);
+}
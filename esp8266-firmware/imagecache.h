@@ -0,0 +1,63 @@
+#ifndef __IMAGECACHE_H__
+#define __IMAGECACHE_H__
+
+#include <stdint.h>
+#include <FS.h>
+
+// cached images are stored in this directory named by the hash of their contents
+#define IMAGE_CACHE_DIR         "/img/"
+
+// file listing the hashes of the cached images, most recently used first
+#define IMAGE_CACHE_INDEX       "/img-lru"
+
+// file an image is written to until its hash has been checked
+#define IMAGE_CACHE_TEMP        "/img-tmp"
+
+// flash space to leave free for SPIFFS overhead and the other files
+#define IMAGE_CACHE_RESERVE     16384
+
+// maximum number of images to keep
+#define MAX_CACHED_IMAGES       16
+
+// an image hash is a 64 bit FNV-1a hash of the image written as 16 lower case hex digits
+#define IMAGE_HASH_LENGTH       16
+#define IMAGE_HASH_INIT         0xcbf29ce484222325ULL
+#define IMAGE_HASH_PRIME        0x100000001b3ULL
+
+// a least recently used cache of Propeller images in SPIFFS
+class ImageCache
+{
+public:
+    ImageCache(FS &fs);
+    ~ImageCache() {}
+    static uint64_t hash(const uint8_t *data, int size, uint64_t hash = IMAGE_HASH_INIT);
+    static uint32_t packetHash(const uint8_t *data, int size);
+    static void formatHash(uint64_t hash, char *text);
+    static bool validHash(const char *hash);
+    void reset() { m_loaded = false; }
+    bool contains(const char *hash);
+    File open(const char *hash);
+    int beginStore(int size, const char *keep = NULL);
+    int write(const uint8_t *data, int size);
+    int endStore(const char *hash);
+    void abortStore();
+    int imageCount() { loadIndex(); return m_count; }
+    const char *imageHash(int i) { return m_index[i]; }
+
+private:
+    void loadIndex();
+    void saveIndex();
+    int find(const char *hash);
+    void touch(const char *hash);
+    void evictOldest();
+    static void imagePath(char *path, const char *hash);
+
+    FS &m_fs;
+    bool m_loaded;
+    char m_index[MAX_CACHED_IMAGES][IMAGE_HASH_LENGTH + 1];
+    int m_count;
+    File m_file;
+    uint64_t m_hash;
+};
+
+#endif
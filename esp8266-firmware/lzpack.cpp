@@ -0,0 +1,166 @@
+#include <string.h>
+#include "lzpack.h"
+
+static int emitLiterals(const uint8_t *literals, int count, uint8_t *out, int cnt, int outMax);
+
+/* LzPack
+    compresses 'in' into 'out' and returns the compressed size or -1 if it doesn't fit in 'outMax' bytes
+    the search for each match covers the whole window so this is meant for the host rather than the module
+*/
+int LzPack(const uint8_t *in, int inSize, uint8_t *out, int outMax)
+{
+    int pos = 0, literalStart = 0, cnt = 0;
+
+    while (pos < inSize) {
+        int maxLength = inSize - pos < LZ_MAX_MATCH ? inSize - pos : LZ_MAX_MATCH;
+        int bestLength = 0, bestOffset = 0, offset, length;
+
+        /* find the longest match, preferring the nearest one */
+        for (offset = 1; offset <= LZ_MAX_OFFSET && offset <= pos; ++offset) {
+            const uint8_t *candidate = &in[pos - offset];
+            for (length = 0; length < maxLength && candidate[length] == in[pos + length]; ++length)
+                ;
+            if (length > bestLength) {
+                bestLength = length;
+                bestOffset = offset;
+                if (length == maxLength)
+                    break;
+            }
+        }
+
+        if (bestLength < LZ_MIN_MATCH) {
+            ++pos;
+            continue;
+        }
+
+        /* send the literals before the match followed by the match itself */
+        if ((cnt = emitLiterals(&in[literalStart], pos - literalStart, out, cnt, outMax)) < 0)
+            return -1;
+        length = bestLength - LZ_MIN_MATCH;
+        if (cnt + (length >= 15 ? 3 : 2) > outMax)
+            return -1;
+        out[cnt++] = 0x80 | ((length >= 15 ? 15 : length) << 3) | ((bestOffset - 1) >> 8);
+        out[cnt++] = (bestOffset - 1) & 0xff;
+        if (length >= 15)
+            out[cnt++] = length - 15;
+        pos += bestLength;
+        literalStart = pos;
+    }
+
+    return emitLiterals(&in[literalStart], pos - literalStart, out, cnt, outMax);
+}
+
+/* LzUnpack
+    decompresses 'in' into 'out' and returns the decompressed size or -1 if the input is invalid
+    or the output doesn't fit in 'outMax' bytes
+*/
+int LzUnpack(const uint8_t *in, int inSize, uint8_t *out, int outMax)
+{
+    int i = 0, cnt = 0;
+
+    while (i < inSize) {
+        int token = in[i++];
+        if (token < 0x80) {
+            int length = token + 1;
+            if (i + length > inSize || cnt + length > outMax)
+                return -1;
+            memcpy(&out[cnt], &in[i], length);
+            i += length;
+            cnt += length;
+        }
+        else {
+            int length = ((token >> 3) & 0x0f) + LZ_MIN_MATCH;
+            int offset;
+            if (i >= inSize)
+                return -1;
+            offset = (((token & 7) << 8) | in[i++]) + 1;
+            if (length == 15 + LZ_MIN_MATCH) {
+                if (i >= inSize)
+                    return -1;
+                length += in[i++];
+            }
+            if (offset > cnt || cnt + length > outMax)
+                return -1;
+
+            /* copy a byte at a time since the source may overlap the bytes being produced */
+            while (--length >= 0) {
+                out[cnt] = out[cnt - offset];
+                ++cnt;
+            }
+        }
+    }
+
+    return cnt;
+}
+
+/* PackRecord
+    builds a record for 'size' bytes of data in 'record', which must have room for size + RECORD_HEADER_SIZE bytes
+    returns the size of the record; the data is stored as-is unless compressing it makes it smaller
+*/
+int PackRecord(const uint8_t *data, int size, uint8_t *record)
+{
+    int dataSize;
+
+    if ((dataSize = LzPack(data, size, &record[RECORD_HEADER_SIZE], size - 1)) < 0) {
+        memcpy(&record[RECORD_HEADER_SIZE], data, size);
+        dataSize = size;
+    }
+    record[0] = size;
+    record[1] = size >> 8;
+    record[2] = dataSize;
+    record[3] = dataSize >> 8;
+    return RECORD_HEADER_SIZE + dataSize;
+}
+
+/* UnpackRecord
+    extracts the data from a record into 'out' and returns its size or -1 if the record is invalid
+    or the data doesn't fit in 'outMax' bytes
+*/
+int UnpackRecord(const uint8_t *record, int recordSize, uint8_t *out, int outMax)
+{
+    int size, dataSize;
+
+    if (recordSize < RECORD_HEADER_SIZE)
+        return -1;
+    size = RecordUnpackedSize(record);
+    dataSize = RecordPackedSize(record);
+    if (dataSize != recordSize - RECORD_HEADER_SIZE || size > outMax)
+        return -1;
+
+    if (dataSize == size) {
+        memcpy(out, &record[RECORD_HEADER_SIZE], size);
+        return size;
+    }
+    return LzUnpack(&record[RECORD_HEADER_SIZE], dataSize, out, size) == size ? size : -1;
+}
+
+/* RecordPackedSize
+    returns the number of bytes that follow a record header
+*/
+int RecordPackedSize(const uint8_t *header)
+{
+    return header[2] | (header[3] << 8);
+}
+
+/* RecordUnpackedSize
+    returns the size of the data in a record
+*/
+int RecordUnpackedSize(const uint8_t *header)
+{
+    return header[0] | (header[1] << 8);
+}
+
+static int emitLiterals(const uint8_t *literals, int count, uint8_t *out, int cnt, int outMax)
+{
+    while (count > 0) {
+        int length = count < 128 ? count : 128;
+        if (cnt + 1 + length > outMax)
+            return -1;
+        out[cnt++] = length - 1;
+        memcpy(&out[cnt], literals, length);
+        cnt += length;
+        literals += length;
+        count -= length;
+    }
+    return cnt;
+}
@@ -0,0 +1,27 @@
+#ifndef __LZPACK_H__
+#define __LZPACK_H__
+
+#include <stdint.h>
+
+// A data packet for a second-stage loader that decompresses is sent as a record.  The record starts
+// with a header long holding the size of the uncompressed data in the low word and the number of bytes
+// that follow the header in the high word.  When the two are equal the data follows as-is, otherwise
+// it follows as a sequence of tokens:
+//   0LLLLLLL                       L+1 literal bytes follow
+//   1LLLLOOO OOOOOOOO [E]          copy L+3 bytes starting O+1 bytes back in the output, where an L of
+//                                  15 is followed by a byte E of extra length
+// A copy may overlap the bytes it produces so a run of one byte value is a copy with an offset of 1.
+// Each packet is compressed on its own so it can be retransmitted or arrive out of order.
+#define RECORD_HEADER_SIZE  4
+#define LZ_MIN_MATCH        3
+#define LZ_MAX_MATCH        (LZ_MIN_MATCH + 15 + 255)
+#define LZ_MAX_OFFSET       2048
+
+int LzPack(const uint8_t *in, int inSize, uint8_t *out, int outMax);
+int LzUnpack(const uint8_t *in, int inSize, uint8_t *out, int outMax);
+int PackRecord(const uint8_t *data, int size, uint8_t *record);
+int UnpackRecord(const uint8_t *record, int recordSize, uint8_t *out, int outMax);
+int RecordPackedSize(const uint8_t *header);
+int RecordUnpackedSize(const uint8_t *header);
+
+#endif
@@ -1,94 +1,170 @@
-#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
 #include "propconnection.h"
 
-// number of milliseconds between attempts to read the checksum ack
-#define CALIBRATE_PAUSE     10
+// number of milliseconds to wait for the checksum ack beyond the time it takes to send the
+// calibration byte and receive the response
+#define CALIBRATE_MARGIN    2
 
-PropellerConnection::PropellerConnection()
-    : m_baudRate(-1), m_resetPin(-1)
-{
-}
+// names used for the phases in formatStats
+const char *LoadPhaseNames[lpCount] = {
+    "reset",
+    "rom",
+    "loader-start",
+    "baud-verify",
+    "data",
+    "verify-ram",
+    "program-eeprom",
+    "launch"
+};
 
-int PropellerConnection::generateResetSignal()
-{
-    if (m_resetPin == -1)
-        return -1;
-    Serial.flush();
-    delay(10);
-    digitalWrite(m_resetPin, LOW);
-    delay(10);
-    digitalWrite(m_resetPin, HIGH);
-    delay(100);
-    while (Serial.available())
-        Serial.read();
-    return 0;
-}
-
-int PropellerConnection::sendData(uint8_t *buf, int len)
+PropellerConnection::PropellerConnection()
+    : m_baudRate(-1), m_resetPin(-1), m_idleHandler(0)
 {
-    return Serial.write(buf, len) == len ? len : -1;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_phase = lpNone;
+    m_phaseStart = 0;
 }
 
-int PropellerConnection::receiveDataExactTimeout(uint8_t *buf, int len, int timeout)
+/* waitForAck
+    receives an acknowledgement like receiveDataExactTimeout and adds the time spent waiting to the ack statistics
+*/
+int PropellerConnection::waitForAck(uint8_t *buffer, int size, int timeout)
 {
-    int remaining = len;
-
-    /* return only when the buffer contains the exact amount of data requested */
-    while (remaining > 0) {
-        int cnt;
-
-        /* read the next bit of data */
-        Serial.setTimeout(timeout);
-        if ((cnt = (int)Serial.readBytes(buf, remaining)) <= 0)
-            return -1;
-
-        /* update the buffer pointer */
-        remaining -= cnt;
-        buf += cnt;
-    }
-
-    /* return the full size of the buffer */
-    return len;
+    unsigned long start = microseconds();
+    int cnt = receiveDataExactTimeout(buffer, size, timeout);
+    recordAck(microseconds() - start, cnt == size);
+    return cnt;
 }
 
+/* receiveChecksumAck
+    polls the ROM booter with a calibration byte until it reports the result of the previous step; the
+    booter answers a calibration byte as it arrives once it is ready so each poll only waits for one
+    round trip rather than a fixed pause
+*/
 int PropellerConnection::receiveChecksumAck(int byteCount, int delay)
 {
     static uint8_t calibrate[1] = { 0xF9 };
-    int msSendTime = (byteCount * 10 * 1000) / m_baudRate;
-    int retries = (msSendTime / CALIBRATE_PAUSE) + (delay / CALIBRATE_PAUSE);
+    unsigned long timeout = ((unsigned long)byteCount * 10 * 1000) / m_baudRate + delay;
+    int pollTime = (2 * 10 * 1000 + m_baudRate - 1) / m_baudRate + CALIBRATE_MARGIN;
+    unsigned long start = microseconds();
     uint8_t buf[1];
 
     do {
-        Serial.write(calibrate, sizeof(calibrate));
-        if (receiveDataExactTimeout(buf, 1, CALIBRATE_PAUSE) == 1)
+        sendData(calibrate, sizeof(calibrate));
+        if (receiveDataExactTimeout(buf, 1, pollTime) == 1) {
+            recordAck(microseconds() - start, true);
             return buf[0] == 0xFE ? 0 : -1;
-    } while (--retries > 0);
+        }
+    } while (microseconds() - start < timeout * 1000);
+    recordAck(microseconds() - start, false);
 
-    AppendResponseText("error: timeout waiting for checksum ack");
+    AppendResponseText(rlError, "error: timeout waiting for checksum ack");
     return -1;
 }
 
 int PropellerConnection::setBaudRate(int baudRate)
 {
-    if (baudRate != m_baudRate) {
-        if (m_baudRate != -1)
-          Serial.end();
-        if ((m_baudRate = baudRate) != -1)
-          Serial.begin(m_baudRate);
-    }
+    m_baudRate = baudRate;
     return 0;
 }
 
 int PropellerConnection::setResetPin(int resetPin)
 {
-    if (resetPin != m_resetPin) {
-        if (m_resetPin != -1)
-            pinMode(m_resetPin, INPUT);
-        if ((m_resetPin = resetPin) != -1) {
-            pinMode(m_resetPin, OUTPUT);
-            digitalWrite(m_resetPin, HIGH);
-        }
-    }
+    m_resetPin = resetPin;
     return 0;
 }
 
+void PropellerConnection::resetStats()
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_stats.start = m_stats.end = microseconds();
+    m_phase = lpNone;
+}
+
+/* beginPhase
+    charges the time since the last phase began to that phase and starts timing 'phase'
+*/
+void PropellerConnection::beginPhase(LoadPhase phase)
+{
+    endPhase();
+    m_phase = phase;
+    m_phaseStart = microseconds();
+}
+
+void PropellerConnection::endPhase()
+{
+    if (m_phase != lpNone) {
+        m_stats.end = microseconds();
+        m_stats.phaseTime[m_phase] += m_stats.end - m_phaseStart;
+        m_phase = lpNone;
+    }
+}
+
+void PropellerConnection::recordAck(unsigned long waitTime, bool received)
+{
+    int i;
+
+    if (m_stats.ackCount == 0 || waitTime < m_stats.ackMinTime)
+        m_stats.ackMinTime = waitTime;
+    if (waitTime > m_stats.ackMaxTime)
+        m_stats.ackMaxTime = waitTime;
+    m_stats.ackWaitTime += waitTime;
+    ++m_stats.ackCount;
+    if (!received)
+        ++m_stats.ackTimeouts;
+
+    for (i = 0; i < ACK_HISTOGRAM_BUCKETS - 1 && waitTime >= ((unsigned long)ACK_HISTOGRAM_BASE << i); ++i)
+        ;
+    if (m_stats.ackHistogram[i] < 0xffff)
+        ++m_stats.ackHistogram[i];
+}
+
+/* ackPercentileTime
+    returns the upper limit of the histogram bucket holding the given percentile of ack times
+*/
+unsigned long PropellerConnection::ackPercentileTime(int percent)
+{
+    unsigned long limit;
+    int total = 0, i;
+
+    for (i = 0; i < ACK_HISTOGRAM_BUCKETS; ++i) {
+        total += m_stats.ackHistogram[i];
+        if (total > 0 && total * 100 >= m_stats.ackCount * percent)
+            break;
+    }
+    if (i >= ACK_HISTOGRAM_BUCKETS)
+        return 0;
+
+    /* the last bucket has no upper limit */
+    limit = (unsigned long)ACK_HISTOGRAM_BASE << i;
+    return i < ACK_HISTOGRAM_BUCKETS - 1 && limit < m_stats.ackMaxTime ? limit : m_stats.ackMaxTime;
+}
+
+/* formatStats
+    writes the stats as key=value lines and returns the number of characters written
+*/
+int PropellerConnection::formatStats(char *buf, int size)
+{
+    int cnt = 0, i;
+
+    cnt += snprintf(&buf[cnt], size - cnt, "total-us=%lu\n", m_stats.end - m_stats.start);
+    for (i = 0; i < lpCount && cnt < size; ++i)
+        cnt += snprintf(&buf[cnt], size - cnt, "%s-us=%lu\n", LoadPhaseNames[i], m_stats.phaseTime[i]);
+
+    if (cnt < size)
+        cnt += snprintf(&buf[cnt], size - cnt, "packets=%d\nretries=%d\nacks=%d\nack-timeouts=%d\n",
+                        m_stats.packetCount, m_stats.retryCount, m_stats.ackCount, m_stats.ackTimeouts);
+    if (cnt < size)
+        cnt += snprintf(&buf[cnt], size - cnt, "ack-min-us=%lu\nack-avg-us=%lu\nack-max-us=%lu\nack-p99-us=%lu\n",
+                        m_stats.ackMinTime, m_stats.ackCount > 0 ? m_stats.ackWaitTime / m_stats.ackCount : 0,
+                        m_stats.ackMaxTime, ackPercentileTime(99));
+    if (cnt < size)
+        cnt += snprintf(&buf[cnt], size - cnt, "ack-histogram-base-us=%d\nack-histogram=", ACK_HISTOGRAM_BASE);
+    for (i = 0; i < ACK_HISTOGRAM_BUCKETS && cnt < size; ++i)
+        cnt += snprintf(&buf[cnt], size - cnt, "%s%u", i > 0 ? "," : "", m_stats.ackHistogram[i]);
+    if (cnt < size)
+        cnt += snprintf(&buf[cnt], size - cnt, "\n");
+
+    return cnt < size ? cnt : size - 1;
+}
@@ -1,29 +1,98 @@
 #ifndef __PROPCONNECTION_H__
-#define __PROPCONNECITON_H__
+#define __PROPCONNECTION_H__
 
 #include <stdint.h>
 
 #define DEF_BAUD_RATE 115200
 #define DEF_RESET_PIN 12
 
+// called over and over while a connection waits on the Propeller so other work can go on
+typedef void (*IdleHandler)();
+
+// phases of a load timed by the loaders; a phase lasts until the next one begins or endPhase is called
+enum LoadPhase {
+    lpNone = -1,
+    lpReset,            // reset pulse and the wait for the ROM to start
+    lpRom,              // ROM handshake, image and checksum ack
+    lpLoaderStart,      // waiting for the second-stage loader to say it's ready
+    lpBaudVerify,       // checking that the final baud rate works
+    lpData,             // image packets and their acks
+    lpVerifyRam,        // second-stage RAM checksum
+    lpProgramEeprom,    // programming and verifying the EEPROM
+    lpLaunch,           // starting the loaded program
+    lpCount
+};
+
+extern const char *LoadPhaseNames[lpCount];
+
+// ack latency histogram bucket i counts acks that took less than ACK_HISTOGRAM_BASE << i microseconds
+#define ACK_HISTOGRAM_BASE      64
+#define ACK_HISTOGRAM_BUCKETS   16
+
+// where the time of the last load went, kept in a fixed-size struct so it can be reported after the load
+struct LoadStats {
+    unsigned long start;                    // microseconds() when the stats were reset
+    unsigned long end;                      // microseconds() when the last phase ended
+    unsigned long phaseTime[lpCount];       // microseconds spent in each phase
+    int packetCount;                        // packets sent by the second-stage protocol including retries
+    int retryCount;                         // packets sent again because their ack didn't arrive
+    int ackCount;
+    int ackTimeouts;                        // acks that didn't arrive in time
+    unsigned long ackWaitTime;              // microseconds spent waiting for acks
+    unsigned long ackMinTime;
+    unsigned long ackMaxTime;
+    unsigned short ackHistogram[ACK_HISTOGRAM_BUCKETS];
+};
+
+// transport used by the loaders to talk to the Propeller
 class PropellerConnection
 {
 public:
     PropellerConnection();
-    ~PropellerConnection() {}
-    int generateResetSignal();
-    int sendData(uint8_t *buffer, int size);
-    int receiveDataExactTimeout(uint8_t *buffer, int size, int timeout);
+    virtual ~PropellerConnection() {}
+    virtual int generateResetSignal() = 0;
+    virtual int sendData(uint8_t *buffer, int size) = 0;
+    virtual int receiveDataExactTimeout(uint8_t *buffer, int size, int timeout) = 0;
+    virtual unsigned long microseconds() = 0;
+    int waitForAck(uint8_t *buffer, int size, int timeout);
     int receiveChecksumAck(int byteCount, int delay);
+    void resetStats();
+    void beginPhase(LoadPhase phase);
+    void endPhase();
+    void countPacket() { ++m_stats.packetCount; }
+    void countRetry() { ++m_stats.retryCount; }
+    const LoadStats &stats() { return m_stats; }
+    unsigned long ackPercentileTime(int percent);
+    int formatStats(char *buf, int size);
+    unsigned long ackWaitTime() { return m_stats.ackWaitTime; }
+    int ackCount() { return m_stats.ackCount; }
     int baudRate() { return m_baudRate; }
-    int setBaudRate(int baudRate);
+    virtual int setBaudRate(int baudRate);
+    virtual int maxBaudRate() { return 0; }     // 0 if the connection doesn't limit the baud rate
     int resetPin() { return m_resetPin; }
-    int setResetPin(int pin);
-private:
+    virtual int setResetPin(int pin);
+    void setIdleHandler(IdleHandler handler) { m_idleHandler = handler; }
+    void idle() { if (m_idleHandler) (*m_idleHandler)(); }
+protected:
+    void recordAck(unsigned long waitTime, bool received);
     int m_baudRate;
     int m_resetPin;
+    LoadStats m_stats;
+    LoadPhase m_phase;
+    unsigned long m_phaseStart;
+    IdleHandler m_idleHandler;
 };
 
-void AppendResponseText(const char *fmt, ...);
+// importance of a message added to the response
+enum ResponseLevel {
+    rlError,    // why a request failed
+    rlInfo,     // results worth reporting
+    rlDebug     // progress of each packet
+};
+
+// messages above this level are dropped before they are formatted
+extern ResponseLevel responseVerbosity;
+
+void AppendResponseText(ResponseLevel level, const char *fmt, ...);
 
 #endif
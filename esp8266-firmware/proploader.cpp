@@ -1,28 +1,40 @@
-#include "Arduino.h"
+#include <stdlib.h>
+#include <string.h>
 #include "proploader.h"
 
-class ByteArray {
+// encoder that translates an image into the Propeller download stream a buffer at a time
+// the image can also be supplied a part at a time, in which case inBytes is NULL and more is
+// needed once the supplied part is used up and the bit buffer can't fill the next output byte
+class StreamEncoder {
 public:
-    ByteArray(int maxSize = DEF_BYTEARRAY_SIZE);
-    ~ByteArray();
-    void clear() { m_size = 0; }
-    bool append(uint8_t *data, int size);
-    bool append(int data);
-    uint8_t *data() { return m_data; }
-    int maxSize() { return m_maxSize; }
-    int size() { return m_size; }
-    void setSize(int size) { m_size = size; }
+    StreamEncoder(const uint8_t *inBytes, int inCount);
+    void supply(const uint8_t *inBytes, int inCount) { m_inBytes = inBytes; m_inEnd = inBytes + inCount; }
+    int encode(uint8_t *outBytes, int outMax);
+    bool needsInput() { return m_inBytes == m_inEnd && m_bitCount < m_bitsRemaining && m_bitCount < 10; }
+    bool done() { return m_bitsRemaining == 0; }
 private:
-    uint8_t *m_data;
-    int m_maxSize;
-    int m_size;
+    const uint8_t *m_inBytes;
+    const uint8_t *m_inEnd;     // end of the input supplied so far
+    int m_bitsRemaining;
+    uint32_t m_bitBuffer;
+    int m_bitCount;
 };
 
 /////////////////////
 // PropellerLoader //
 /////////////////////
 
+#define COMMAND_SIZE            11          /* number of bytes in an encoded command */
 #define LENGTH_FIELD_SIZE       11          /* number of bytes in the length field */
+#define HANDSHAKE_BITS          250         /* number of LFSR bits sent by each side of the handshake */
+#define VERSION_BITS            8           /* number of bits in the Propeller's version */
+#define TX_HANDSHAKE_SIZE       198         /* number of bytes in the encoded tx handshake and timing templates */
+#define RX_HANDSHAKE_SIZE       125         /* number of bytes in the expected rx handshake */
+
+// ROM loader commands, sent as an encoded long
+#define CMD_LOAD_RUN            1           /* load RAM and run */
+#define CMD_PROGRAM_SHUTDOWN    2           /* load RAM, program EEPROM and shut down */
+#define CMD_PROGRAM_RUN         3           /* load RAM, program EEPROM and run */
 
 // Propeller Download Stream Translator array.  Index into this array using the "Binary Value" (usually 5 bits) to translate,
 // the incoming bit size (again, usually 5), and the desired data element to retrieve (encoding = translation, bitCount = bit count
@@ -71,6 +83,15 @@ static struct {
   {            {0,    0},             {0,    0},             {0,    0},             {0,    0},  /*%11111*/ {0x55, 5} }
  };
 
+// Ten bit Propeller Download Stream Translator array.  Index into this array using the next ten bits of the stream to get
+// the two bytes that the PDSTx 5-bit translation would output for them.  Each translation step consumes at most five bits
+// so the first ten bits always determine the first two encoded bytes.  This array is built from PDSTx on first use.
+static struct {
+    uint8_t encoding[2];    // encoded bytes to output
+    uint8_t bitCount;       // number of bits encoded by the two output bytes
+} PDSTx10[1024];
+static bool PDSTx10Ready = false;
+
 // After reset, the Propeller's exact clock rate is not known by either the host or the Propeller itself, so communication
 // with the Propeller takes place based on a host-transmitted timing template that the Propeller uses to read the stream
 // and generate the responses.  The host first transmits the 2-bit timing template, then transmits a 250-bit Tx handshake,
@@ -100,57 +121,17 @@ static struct {
 // received (Propeller generated) stream that follows begins with those remaining 5 bits and ends with the leading 245 bits
 // of the host-transmitted stream.
 //
-// For speed and compression reasons, this handshake stream has been encoded as tightly as possible into the pattern
-// described below.
-//
-// The TxHandshake array consists of 209 bytes that are encoded to represent the required '1' and '0' timing template bits,
-// 250 bits representing the lowest bit values of 250 iterations of the Propeller LFSR (seeded with ASCII 'P'), 250 more
-// timing template bits to receive the Propeller's handshake response, and more to receive the version.
-static uint8_t txHandshake[] = {
-    // First timing template ('1' and '0') plus first two bits of handshake ('0' and '1').
-    0x49,
-    // Remaining 248 bits of handshake...
-    0xAA,0x52,0xA5,0xAA,0x25,0xAA,0xD2,0xCA,0x52,0x25,0xD2,0xD2,0xD2,0xAA,0x49,0x92,
-    0xC9,0x2A,0xA5,0x25,0x4A,0x49,0x49,0x2A,0x25,0x49,0xA5,0x4A,0xAA,0x2A,0xA9,0xCA,
-    0xAA,0x55,0x52,0xAA,0xA9,0x29,0x92,0x92,0x29,0x25,0x2A,0xAA,0x92,0x92,0x55,0xCA,
-    0x4A,0xCA,0xCA,0x92,0xCA,0x92,0x95,0x55,0xA9,0x92,0x2A,0xD2,0x52,0x92,0x52,0xCA,
-    0xD2,0xCA,0x2A,0xFF,
-    // 250 timing templates ('1' and '0') to receive 250-bit handshake from Propeller.
-    // This is encoded as two pairs per byte; 125 bytes.
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,0x29,
-    // 8 timing templates ('1' and '0') to receive 8-bit Propeller version; two pairs per byte; 4 bytes.
-    0x29,0x29,0x29,0x29};
-
-// Shutdown command (0); 11 bytes.
-static uint8_t shutdownCmd[] = {0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xf2};
-
-// Load RAM and Run command (1); 11 bytes.
-static uint8_t loadRunCmd[] = {0xc9, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xf2};
-
-// Load RAM, Program EEPROM, and Shutdown command (2); 11 bytes.
-static uint8_t programShutdownCmd[] = {0xca, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xf2};
-
-// Load RAM, Program EEPROM, and Run command (3); 11 bytes.
-static uint8_t programRunCmd[] = {0x25, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0x92, 0xfe};
-
-// The RxHandshake array consists of 125 bytes encoded to represent the expected 250-bit (125-byte @ 2 bits/byte) response
-// of continuing-LFSR stream bits from the Propeller, prompted by the timing templates following the TxHandshake stream.
-static uint8_t rxHandshake[] = {
-    0xEE,0xCE,0xCE,0xCF,0xEF,0xCF,0xEE,0xEF,0xCF,0xCF,0xEF,0xEF,0xCF,0xCE,0xEF,0xCF,
-    0xEE,0xEE,0xCE,0xEE,0xEF,0xCF,0xCE,0xEE,0xCE,0xCF,0xEE,0xEE,0xEF,0xCF,0xEE,0xCE,
-    0xEE,0xCE,0xEE,0xCF,0xEF,0xEE,0xEF,0xCE,0xEE,0xEE,0xCF,0xEE,0xCF,0xEE,0xEE,0xCF,
-    0xEF,0xCE,0xCF,0xEE,0xEF,0xEE,0xEE,0xEE,0xEE,0xEF,0xEE,0xCF,0xCF,0xEF,0xEE,0xCE,
-    0xEF,0xEF,0xEF,0xEF,0xCE,0xEF,0xEE,0xEF,0xCF,0xEF,0xCF,0xCF,0xCE,0xCE,0xCE,0xCF,
-    0xCF,0xEF,0xCE,0xEE,0xCF,0xEE,0xEF,0xCE,0xCE,0xCE,0xEF,0xEF,0xCF,0xCF,0xEE,0xEE,
-    0xEE,0xCE,0xCF,0xCE,0xCE,0xCF,0xCE,0xEE,0xEF,0xEE,0xEF,0xEF,0xCF,0xEF,0xCE,0xCE,
-    0xEF,0xCE,0xEE,0xCE,0xEF,0xCE,0xCE,0xEE,0xCF,0xCF,0xCE,0xCF,0xCF};
+// The handshake is generated from this LFSR the first time it's needed.  txHandshake holds the first timing template
+// ('1' and '0') and the 250 host-transmitted bits, followed by 250 timing templates to receive the Propeller's 250 bits and
+// 8 more to receive its version, each part encoded like the image.  rxHandshake holds the response expected from the
+// Propeller: the next 250 bits of the LFSR sequence, two bits per byte.
+static uint8_t txHandshake[TX_HANDSHAKE_SIZE];
+static uint8_t rxHandshake[RX_HANDSHAKE_SIZE];
+static bool handshakeReady = false;
+
+static int iterateLFSR(uint8_t *lfsr);
+static int encodeBits(const uint8_t *bits, int count, uint8_t *out, int outMax);
+static void buildHandshakes();
 
 PropellerLoader::PropellerLoader(PropellerConnection &connection)
     : m_connection(connection)
@@ -163,35 +144,81 @@ PropellerLoader::~PropellerLoader()
 
 int PropellerLoader::load(uint8_t *image, int imageSize, LoadType loadType)
 {
-    ByteArray packet;
+    return loadStream(image, NULL, NULL, NULL, 0, imageSize, loadType);
+}
 
-    /* generate a single packet containing the tx handshake and the image to load */
-    if (generateLoaderPacket(packet, image, imageSize, loadType) != 0)
-        return -1;
+/* load
+    like load but gets the image a part at a time from 'reader' as it is encoded, so an image
+    of any size is loaded without being held in memory
+*/
+int PropellerLoader::load(ImageReader reader, void *context, int imageSize, LoadType loadType)
+{
+    return loadStream(NULL, reader, context, NULL, 0, imageSize, loadType);
+}
+
+/* loadEncoded
+    like load but sends an image already encoded by encodeImage
+*/
+int PropellerLoader::loadEncoded(uint8_t *stream, int streamSize, int imageSize, LoadType loadType)
+{
+    return loadStream(NULL, NULL, NULL, stream, streamSize, imageSize, loadType);
+}
+
+/* encodeImage
+    encodes an image for the ROM loader into 'stream' and returns the encoded size or -1 if it
+    doesn't fit in 'streamMax' bytes; with 'stream' NULL it only returns the encoded size
+*/
+int PropellerLoader::encodeImage(const uint8_t *image, int imageSize, uint8_t *stream, int streamMax)
+{
+    StreamEncoder encoder(image, imageSize);
+    uint8_t buf[ENCODE_BUFFER_SIZE];
+    int byteCount = 0, cnt;
+
+    while (!encoder.done()) {
+        if (!stream)
+            cnt = encoder.encode(buf, ENCODE_BUFFER_SIZE);
+        else if ((cnt = encoder.encode(&stream[byteCount], streamMax - byteCount)) == 0)
+            return -1;
+        byteCount += cnt;
+    }
+
+    return byteCount;
+}
+
+/* loadStream
+    loads 'image' or the image from 'reader', encoding it as it is sent, or sends 'stream' if there is neither
+*/
+int PropellerLoader::loadStream(const uint8_t *image, ImageReader reader, void *context, uint8_t *stream, int streamSize, int imageSize, LoadType loadType)
+{
+    uint8_t buf[ENCODE_BUFFER_SIZE];
+    int byteCount, cnt;
+
+    /* generate the handshake the first time through */
+    if (!handshakeReady)
+        buildHandshakes();
 
     /* reset the Propeller */
+    m_connection.beginPhase(lpReset);
     if (m_connection.generateResetSignal() != 0) {
-        AppendResponseText("error: generateResetSignal failed");
+        AppendResponseText(rlError, "error: generateResetSignal failed");
         return -1;
     }
 
-    /* send the packet */
-    if (m_connection.sendData(packet.data(), packet.size()) != packet.size()) {
-        AppendResponseText("error: sendData failed");
+    /* send the tx handshake, the command and the image, encoding the image as it is sent */
+    m_connection.beginPhase(lpRom);
+    if ((byteCount = sendLoaderStream(buf, image, reader, context, stream, streamSize, imageSize, loadType)) < 0)
         return -1;
-    }
 
     /* receive the handshake response and the hardware version */
-    int cnt = sizeof(rxHandshake) + 4;
-    if (m_connection.receiveDataExactTimeout(packet.data(), cnt, 2000) != cnt) {
-        AppendResponseText("error: receiveDataExactTimeout failed");
+    cnt = sizeof(rxHandshake) + 4;
+    if (m_connection.receiveDataExactTimeout(buf, cnt, 2000) != cnt) {
+        AppendResponseText(rlError, "error: receiveDataExactTimeout failed");
         return -1;
     }
 
     /* verify the rx handshake */
-    uint8_t *buf = packet.data();
     if (memcmp(buf, rxHandshake, sizeof(rxHandshake)) != 0) {
-        AppendResponseText("error: handshake failed");
+        AppendResponseText(rlError, "error: handshake failed");
         return -1;
     }
 
@@ -200,155 +227,291 @@ int PropellerLoader::load(uint8_t *image, int imageSize, LoadType loadType)
     for (int i = sizeof(rxHandshake); i < cnt; ++i)
         version = ((version >> 2) & 0x3F) | ((buf[i] & 0x01) << 6) | ((buf[i] & 0x20) << 2);
     if (version != 1) {
-        AppendResponseText("error: wrong propeller version");
+        AppendResponseText(rlError, "error: wrong propeller version");
         return -1;
     }
 
     /* receive and verify the checksum */
-    if (m_connection.receiveChecksumAck(packet.size(), 250) != 0) {
-        AppendResponseText("error: checksum verification failed");
+    if (m_connection.receiveChecksumAck(byteCount, 250) != 0) {
+        AppendResponseText(rlError, "error: checksum verification failed");
         return -1;
     }
 
     /* wait for eeprom programming and verification */
     if (loadType == ltDownloadAndProgram || loadType == ltDownloadAndProgramAndRun) {
+        m_connection.beginPhase(lpProgramEeprom);
 
         /* wait for an ACK indicating a successful EEPROM programming */
         if (m_connection.receiveChecksumAck(0, 5000) != 0) {
-            AppendResponseText("error: EEPROM programming failed");
+            AppendResponseText(rlError, "error: EEPROM programming failed");
             return -1;
         }
 
         /* wait for an ACK indicating a successful EEPROM verification */
         if (m_connection.receiveChecksumAck(0, 2000) != 0) {
-            AppendResponseText("error: EEPROM verification failed");
+            AppendResponseText(rlError, "error: EEPROM verification failed");
             return -1;
         }
     }
+    m_connection.endPhase();
 
     /* return successfully */
     return 0;
 }
 
-void PropellerLoader::generateIdentifyPacket(ByteArray &packet)
-{
-    /* initialize the packet */
-    packet.clear();
-
-    /* copy the handshake image and the shutdown command to the packet */
-    packet.append(txHandshake, sizeof(txHandshake));
-    packet.append(shutdownCmd, sizeof(shutdownCmd));
-}
-
-int PropellerLoader::generateLoaderPacket(ByteArray &packet, const uint8_t *image, int imageSize, LoadType loadType)
+/* sendLoaderStream
+    parameters:
+        buf is a buffer of ENCODE_BUFFER_SIZE bytes to use for encoding
+        image is a pointer to the image to load or NULL to use 'reader' or 'stream' instead
+        reader is called with 'context' for each part of the image or NULL to send 'stream' instead
+        stream is a pointer to the image already encoded
+        streamSize is the size of the encoded image in bytes
+        imageSize is the size of the image in bytes
+        loadType is the load command to send
+    returns the number of bytes sent or -1 on failure
+*/
+int PropellerLoader::sendLoaderStream(uint8_t *buf, const uint8_t *image, ImageReader reader, void *context, uint8_t *stream, int streamSize, int imageSize, LoadType loadType)
 {
     int imageSizeInLongs = (imageSize + 3) / 4;
-    int tmp, i;
-
-    /* initialize the packet */
-    packet.clear();
-
-    /* copy the handshake image and the command to the packet */
-    packet.append(txHandshake, sizeof(txHandshake));
+    StreamEncoder encoder(image, imageSize);
+    uint8_t readBuf[READ_BUFFER_SIZE];
+    uint8_t cmd[4] = { 0, 0, 0, 0 };
+    int byteCount, cnt, tmp, i;
 
-    /* append the loader command */
+    /* select the loader command */
     switch (loadType) {
     case ltDownloadAndRun:
-        packet.append(loadRunCmd, sizeof(loadRunCmd));
+        cmd[0] = CMD_LOAD_RUN;
         break;
     case ltDownloadAndProgram:
-        packet.append(programShutdownCmd, sizeof(loadRunCmd));
+        cmd[0] = CMD_PROGRAM_SHUTDOWN;
         break;
     case ltDownloadAndProgramAndRun:
-        packet.append(programRunCmd, sizeof(loadRunCmd));
+        cmd[0] = CMD_PROGRAM_RUN;
         break;
     default:
         return -1;
     }
 
-    /* add the image size in longs */
+    /* encode the command followed by the image size in longs */
+    StreamEncoder cmdEncoder(cmd, sizeof(cmd));
+    if (cmdEncoder.encode(buf, ENCODE_BUFFER_SIZE) != COMMAND_SIZE)
+        return -1;
     tmp = imageSizeInLongs;
     for (i = 0; i < LENGTH_FIELD_SIZE; ++i) {
-        packet.append(0x92 | (i == 10 ? 0x60 : 0x00) | (tmp & 1) | ((tmp & 2) << 2) | ((tmp & 4) << 4));
+        buf[COMMAND_SIZE + i] = 0x92 | (i == 10 ? 0x60 : 0x00) | (tmp & 1) | ((tmp & 2) << 2) | ((tmp & 4) << 4);
         tmp >>= 3;
     }
 
-    /* encode the image and insert it into the packet */
-    encodeBytes(packet, image, imageSize);
+    /* send the handshake straight from its table, then the command and the image size */
+    if (m_connection.sendData(txHandshake, sizeof(txHandshake)) != sizeof(txHandshake)
+    ||  m_connection.sendData(buf, COMMAND_SIZE + LENGTH_FIELD_SIZE) != COMMAND_SIZE + LENGTH_FIELD_SIZE) {
+        AppendResponseText(rlError, "error: sendData failed");
+        return -1;
+    }
+    byteCount = sizeof(txHandshake) + COMMAND_SIZE + LENGTH_FIELD_SIZE;
+
+    /* send an image that is already encoded as it is, a buffer at a time */
+    if (!image && !reader) {
+        for (i = 0; i < streamSize; i += cnt) {
+            cnt = streamSize - i > ENCODE_BUFFER_SIZE ? ENCODE_BUFFER_SIZE : streamSize - i;
+            if (m_connection.sendData(&stream[i], cnt) != cnt) {
+                AppendResponseText(rlError, "error: sendData failed");
+                return -1;
+            }
+            m_connection.idle();
+        }
+        return byteCount + streamSize;
+    }
 
-    /* return successfully */
-    return 0;
+    /* encode the image and send it a buffer at a time, reading each part of it as it's needed;
+       the idle handler runs between buffers while the UART's FIFO is still draining the last one,
+       so clients are served during a load at the ROM's slow baud rate without a gap in the stream */
+    while (!encoder.done()) {
+        if (encoder.needsInput()) {
+            if (!reader || (cnt = (*reader)(readBuf, READ_BUFFER_SIZE, context)) <= 0) {
+                AppendResponseText(rlError, "error: image ended early");
+                return -1;
+            }
+            encoder.supply(readBuf, cnt);
+        }
+        cnt = encoder.encode(buf, ENCODE_BUFFER_SIZE);
+        if (m_connection.sendData(buf, cnt) != cnt) {
+            AppendResponseText(rlError, "error: sendData failed");
+            return -1;
+        }
+        byteCount += cnt;
+        m_connection.idle();
+    }
+
+    /* return the number of bytes sent */
+    return byteCount;
 }
 
-/* encodeBytes
-    parameters:
-        packet is a packet to receive the encoded bytes
-        inBytes is a pointer to a buffer of bytes to be encoded
-        inCount is the number of bytes in inBytes
-    returns the number of bytes written to the outBytes buffer or -1 if the encoded data does not fit
+/* iterateLFSR
+    advances the handshake LFSR and returns its previous bit 0
 */
-void PropellerLoader::encodeBytes(ByteArray &packet, const uint8_t *inBytes, int inCount)
+static int iterateLFSR(uint8_t *lfsr)
 {
-    static uint8_t masks[] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f };
-    int bitCount = inCount * 8;
-    int nextBit = 0;
+    int result = *lfsr & 0x01;
+    *lfsr = ((*lfsr << 1) & 0xfe) | (((*lfsr >> 7) ^ (*lfsr >> 5) ^ (*lfsr >> 4) ^ (*lfsr >> 1)) & 0x01);
+    return result;
+}
 
-    /* encode all bits in the input buffer */
-    while (nextBit < bitCount) {
-        int bits, bitsIn;
+/* encodeBits
+    encodes 'count' bits, one to a byte of 'bits', the way StreamEncoder encodes an image
+    returns the number of bytes stored in 'out' or -1 if they don't fit in 'outMax' bytes
+*/
+static int encodeBits(const uint8_t *bits, int count, uint8_t *out, int outMax)
+{
+    int cnt = 0;
 
-        /* encode 5 bits or whatever remains in inBytes, whichever is smaller */
-        bitsIn = bitCount - nextBit;
-        if (bitsIn > 5)
-            bitsIn = 5;
+    while (count > 0) {
+        int bitsIn = count > 5 ? 5 : count, value = 0, i;
+        if (cnt >= outMax)
+            return -1;
+        for (i = 0; i < bitsIn; ++i)
+            value |= bits[i] << i;
+        out[cnt++] = PDSTx[value][bitsIn - 1].encoding;
+        bits += PDSTx[value][bitsIn - 1].bitCount;
+        count -= PDSTx[value][bitsIn - 1].bitCount;
+    }
 
-        /* extract the next 'bitsIn' bits from the input buffer */
-        bits = ((inBytes[nextBit / 8] >> (nextBit % 8)) | (inBytes[nextBit / 8 + 1] << (8 - (nextBit % 8)))) & masks[bitsIn];
+    return cnt;
+}
 
-        /* store the encoded value */
-        packet.append(PDSTx[bits][bitsIn - 1].encoding);
+/* buildHandshakes
+    fills in txHandshake and rxHandshake from the LFSR sequence
+*/
+static void buildHandshakes()
+{
+    uint8_t bits[2 * (HANDSHAKE_BITS + VERSION_BITS)];
+    uint8_t lfsr = 'P';
+    int cnt, i;
+
+    /* the first timing template followed by the host's share of the sequence */
+    bits[0] = 1;
+    bits[1] = 0;
+    for (i = 0; i < HANDSHAKE_BITS; ++i)
+        bits[2 + i] = iterateLFSR(&lfsr);
+    cnt = encodeBits(bits, 2 + HANDSHAKE_BITS, txHandshake, TX_HANDSHAKE_SIZE);
+
+    /* a timing template for each bit of the Propeller's share of the sequence and of its version */
+    for (i = 0; i < 2 * (HANDSHAKE_BITS + VERSION_BITS); i += 2) {
+        bits[i] = 1;
+        bits[i + 1] = 0;
+    }
+    encodeBits(bits, 2 * (HANDSHAKE_BITS + VERSION_BITS), &txHandshake[cnt], TX_HANDSHAKE_SIZE - cnt);
 
-        /* advance to the next group of bits */
-        nextBit += PDSTx[bits][bitsIn - 1].bitCount;
+    /* the Propeller continues the sequence, sending two bits in each byte */
+    for (i = 0; i < RX_HANDSHAKE_SIZE; ++i) {
+        int first = iterateLFSR(&lfsr);
+        rxHandshake[i] = 0xce | first | (iterateLFSR(&lfsr) << 5);
     }
+
+    handshakeReady = true;
 }
 
-///////////////
-// ByteArray //
-///////////////
+///////////////////
+// StreamEncoder //
+///////////////////
 
-ByteArray::ByteArray(int maxSize)
-  : m_size(0), m_maxSize(maxSize)
+/* buildPDSTx10
+    fills in PDSTx10 using the five bit translations in PDSTx
+*/
+static void buildPDSTx10()
 {
-    m_data = (uint8_t *)malloc(maxSize);
-    if (!m_data) {
-        Serial.println("error: out of memory");
-        for (;;)
-            ;
+    for (int bits = 0; bits < 1024; ++bits) {
+        int first = bits & 0x1f;
+        int second = (bits >> PDSTx[first][4].bitCount) & 0x1f;
+        PDSTx10[bits].encoding[0] = PDSTx[first][4].encoding;
+        PDSTx10[bits].encoding[1] = PDSTx[second][4].encoding;
+        PDSTx10[bits].bitCount = PDSTx[first][4].bitCount + PDSTx[second][4].bitCount;
     }
+    PDSTx10Ready = true;
 }
 
-ByteArray::~ByteArray()
+StreamEncoder::StreamEncoder(const uint8_t *inBytes, int inCount)
+    : m_inBytes(inBytes), m_inEnd(inBytes ? inBytes + inCount : NULL), m_bitsRemaining(inCount * 8), m_bitBuffer(0), m_bitCount(0)
 {
-    if (m_data)
-        free(m_data);
+    /* build the ten bit translation table the first time through */
+    if (!PDSTx10Ready)
+        buildPDSTx10();
 }
 
-bool ByteArray::append(uint8_t *data, int size)
+/* encode
+    parameters:
+        outBytes is a buffer to receive the encoded bytes
+        outMax is the size of outBytes
+    returns the number of bytes stored in outBytes; encoding continues where it left off on the next call
+*/
+int StreamEncoder::encode(uint8_t *outBytes, int outMax)
 {
-    if (!m_data || m_size + size > m_maxSize)
-        return false;
-    memcpy(&m_data[m_size], data, size);
-    m_size += size;
-    return true;
-}
+    static uint8_t masks[] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f };
+    const uint8_t *inBytes = m_inBytes;
+    const uint8_t *inEnd = m_inEnd;
+    int bitsRemaining = m_bitsRemaining;
+    uint32_t bitBuffer = m_bitBuffer;
+    int bitCount = m_bitCount;
+    uint8_t *out = outBytes;
+    uint8_t *end = outBytes + outMax;
+
+    /* encode two bytes at a time while there are at least ten bits left */
+    while (bitsRemaining >= 10 && end - out >= 2) {
+        int bits;
+
+        /* make sure there are at least ten bits in the bit buffer or wait for more input */
+        while (bitCount < 10 && inBytes < inEnd) {
+            bitBuffer |= (uint32_t)*inBytes++ << bitCount;
+            bitCount += 8;
+        }
+        if (bitCount < 10)
+            break;
 
-bool ByteArray::append(int data)
-{
-    if (!m_data || m_size + 1 > m_maxSize)
-        return false;
-    m_data[m_size++] = data;
-    return true;
-}
+        /* store the encoded values */
+        bits = bitBuffer & 0x3ff;
+        *out++ = PDSTx10[bits].encoding[0];
+        *out++ = PDSTx10[bits].encoding[1];
+
+        /* advance to the next group of bits */
+        bitBuffer >>= PDSTx10[bits].bitCount;
+        bitCount -= PDSTx10[bits].bitCount;
+        bitsRemaining -= PDSTx10[bits].bitCount;
+    }
+
+    /* encode the last few bits one byte at a time */
+    while (bitsRemaining > 0 && bitsRemaining < 10 && out < end) {
+        int bits, bitsIn;
+
+        /* encode 5 bits or whatever remains in inBytes, whichever is smaller */
+        bitsIn = bitsRemaining;
+        if (bitsIn > 5)
+            bitsIn = 5;
 
+        /* extract the next 'bitsIn' bits from the input buffer or wait for more input */
+        while (bitCount < bitsIn && inBytes < inEnd) {
+            bitBuffer |= (uint32_t)*inBytes++ << bitCount;
+            bitCount += 8;
+        }
+        if (bitCount < bitsIn)
+            break;
+        bits = bitBuffer & masks[bitsIn];
+
+        /* store the encoded value */
+        *out++ = PDSTx[bits][bitsIn - 1].encoding;
 
+        /* advance to the next group of bits */
+        bitBuffer >>= PDSTx[bits][bitsIn - 1].bitCount;
+        bitCount -= PDSTx[bits][bitsIn - 1].bitCount;
+        bitsRemaining -= PDSTx[bits][bitsIn - 1].bitCount;
+    }
+
+    /* save the state for the next call */
+    m_inBytes = inBytes;
+    m_bitsRemaining = bitsRemaining;
+    m_bitBuffer = bitBuffer;
+    m_bitCount = bitCount;
+
+    /* return the number of bytes stored */
+    return out - outBytes;
+}
@@ -7,9 +7,15 @@
 #define INITIAL_BAUD_RATE   115200
 #define FINAL_BAUD_RATE     921600
 
-#define DEF_BYTEARRAY_SIZE  8192
+// size of the buffer used to encode the image as it is sent
+#define ENCODE_BUFFER_SIZE  256
 
-class ByteArray;
+// size of the buffer an ImageReader fills with the next part of the image
+#define READ_BUFFER_SIZE    128
+
+// supplies the next part of an image being loaded as it is encoded
+// returns the number of bytes stored in 'buf' or -1 if the image ended early
+typedef int (*ImageReader)(uint8_t *buf, int size, void *context);
 
 enum LoadType {
     ltNone = 0,
@@ -24,11 +30,13 @@ public:
     PropellerLoader(PropellerConnection &connection);
     ~PropellerLoader();
     int load(uint8_t *image, int imageSize, LoadType loadType = ltDownloadAndRun);
+    int load(ImageReader reader, void *context, int imageSize, LoadType loadType = ltDownloadAndRun);
+    int loadEncoded(uint8_t *stream, int streamSize, int imageSize, LoadType loadType = ltDownloadAndRun);
+    static int encodeImage(const uint8_t *image, int imageSize, uint8_t *stream, int streamMax);
 
 private:
-    static void generateIdentifyPacket(ByteArray &packet);
-    static int generateLoaderPacket(ByteArray &packet, const uint8_t *image, int imageSize, LoadType loadType);
-    static void encodeBytes(ByteArray &packet, const uint8_t *inBytes, int inCount);
+    int loadStream(const uint8_t *image, ImageReader reader, void *context, uint8_t *stream, int streamSize, int imageSize, LoadType loadType);
+    int sendLoaderStream(uint8_t *buf, const uint8_t *image, ImageReader reader, void *context, uint8_t *stream, int streamSize, int imageSize, LoadType loadType);
 
     PropellerConnection &m_connection;
 };
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include "responselog.h"
+
+// collects output into small blocks so the client isn't written a byte at a time
+class BlockWriter
+{
+public:
+    BlockWriter(Print *out) : m_out(out), m_count(0), m_total(0) {}
+    ~BlockWriter() { flush(); }
+    void put(char ch) {
+        if (m_out) {
+            if (m_count >= (int)sizeof(m_block))
+                flush();
+            m_block[m_count++] = ch;
+        }
+        ++m_total;
+    }
+    void put(const char *str) { while (*str) put(*str++); }
+    void flush() {
+        if (m_out && m_count > 0)
+            m_out->write((const uint8_t *)m_block, m_count);
+        m_count = 0;
+    }
+    int total() { return m_total; }
+
+private:
+    Print *m_out;
+    char m_block[64];
+    int m_count;
+    int m_total;
+};
+
+/* append
+    adds a line, dropping the oldest ones if the buffer is full
+*/
+void ResponseLog::append(const char *text)
+{
+    int length = strlen(text), i;
+
+    if (length > RESPONSE_LOG_SIZE - 1)
+        length = RESPONSE_LOG_SIZE - 1;
+    while (m_length + length + 1 > RESPONSE_LOG_SIZE)
+        dropOldest();
+
+    for (i = 0; i <= length; ++i) {
+        char ch = i < length ? text[i] : '\n';
+        if (ch == '\n' && i < length)
+            ch = ' ';
+        m_buffer[(m_start + m_length++) % RESPONSE_LOG_SIZE] = ch;
+    }
+}
+
+/* write
+    writes the lines to 'out' in the given format and returns the number of bytes
+    with 'out' NULL nothing is written so the result can be used as the Content-Length
+*/
+int ResponseLog::write(ResponseFormat format, Print *out)
+{
+    BlockWriter writer(out);
+    bool lineStart = true;
+    int i;
+
+    if (format == rfJson)
+        writer.put("{\"messages\":[");
+
+    for (i = 0; i < m_length; ++i) {
+        char ch = m_buffer[(m_start + i) % RESPONSE_LOG_SIZE];
+        if (format == rfText)
+            writer.put(ch);
+        else {
+            if (lineStart)
+                writer.put(i == 0 ? "\"" : ",\"");
+            lineStart = ch == '\n';
+            if (ch == '\n')
+                writer.put('"');
+            else if (ch == '"' || ch == '\\') {
+                writer.put('\\');
+                writer.put(ch);
+            }
+            else if ((uint8_t)ch < ' ') {
+                char escape[8];
+                snprintf(escape, sizeof(escape), "\\u%04x", (uint8_t)ch);
+                writer.put(escape);
+            }
+            else
+                writer.put(ch);
+        }
+    }
+
+    if (format == rfJson) {
+        char tail[32];
+        snprintf(tail, sizeof(tail), "],\"dropped\":%d}\n", m_dropped);
+        writer.put(tail);
+    }
+
+    writer.flush();
+    return writer.total();
+}
+
+void ResponseLog::dropOldest()
+{
+    while (m_length > 0) {
+        char ch = m_buffer[m_start];
+        m_start = (m_start + 1) % RESPONSE_LOG_SIZE;
+        --m_length;
+        if (ch == '\n')
+            break;
+    }
+    ++m_dropped;
+}
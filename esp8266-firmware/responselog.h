@@ -0,0 +1,37 @@
+#ifndef __RESPONSELOG_H__
+#define __RESPONSELOG_H__
+
+#include <Print.h>
+
+// bytes of messages kept for a response; the oldest lines are dropped to make room
+#define RESPONSE_LOG_SIZE       1024
+
+// longest single message
+#define RESPONSE_LINE_SIZE      128
+
+enum ResponseFormat {
+    rfText,     // one message per line
+    rfJson      // {"messages":[...],"dropped":n}
+};
+
+// the messages for the response to the current request kept in a fixed ring buffer
+class ResponseLog
+{
+public:
+    ResponseLog() { reset(); }
+    ~ResponseLog() {}
+    void reset() { m_start = m_length = m_dropped = 0; }
+    void append(const char *text);
+    int dropped() { return m_dropped; }
+    int write(ResponseFormat format, Print *out);
+
+private:
+    void dropOldest();
+
+    char m_buffer[RESPONSE_LOG_SIZE];
+    int m_start;        // offset of the oldest line
+    int m_length;       // bytes in use including the '\n' after each line
+    int m_dropped;      // lines dropped to make room for newer ones
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include <Arduino.h>
+#include "serialconnection.h"
+#include "MySoftwareSerial.h"
+
+SerialPropellerConnection::SerialPropellerConnection()
+    : m_txSerial(&Serial), m_rxSoftSerial(NULL), m_rxStream(&Serial)
+{
+}
+
+SerialPropellerConnection::SerialPropellerConnection(HardwareSerial &serial)
+    : m_txSerial(&serial), m_rxSoftSerial(NULL), m_rxStream(&serial)
+{
+}
+
+SerialPropellerConnection::SerialPropellerConnection(HardwareSerial &txSerial, MySoftwareSerial &rxSerial)
+    : m_txSerial(&txSerial), m_rxSoftSerial(&rxSerial), m_rxStream(&rxSerial)
+{
+}
+
+int SerialPropellerConnection::generateResetSignal()
+{
+    if (m_resetPin == -1)
+        return -1;
+    m_txSerial->flush();
+    pause(10);
+    digitalWrite(m_resetPin, LOW);
+    pause(10);
+    digitalWrite(m_resetPin, HIGH);
+    pause(100);
+    while (m_rxStream->available())
+        m_rxStream->read();
+    return 0;
+}
+
+/* sendData
+    blocks until the last byte is in the transmit FIFO; the idle handler isn't called here because
+    a pause in the middle of a packet ends it early for the second-stage loader
+*/
+int SerialPropellerConnection::sendData(uint8_t *buf, int len)
+{
+    return (int)m_txSerial->write(buf, len) == len ? len : -1;
+}
+
+int SerialPropellerConnection::receiveDataExactTimeout(uint8_t *buf, int len, int timeout)
+{
+    int remaining = len;
+
+    /* return only when the buffer contains the exact amount of data requested */
+    while (remaining > 0) {
+        int cnt;
+
+        /* wait for the next bit of data; like Stream::readBytes the timeout applies to each byte */
+        unsigned long start = millis();
+        while ((cnt = m_rxStream->available()) <= 0) {
+            if (millis() - start >= (unsigned long)timeout)
+                return -1;
+            idle();
+            yield();
+        }
+
+        /* read what has arrived */
+        if (cnt > remaining)
+            cnt = remaining;
+        if ((cnt = (int)m_rxStream->readBytes(buf, cnt)) <= 0)
+            return -1;
+
+        /* update the buffer pointer */
+        remaining -= cnt;
+        buf += cnt;
+    }
+
+    /* return the full size of the buffer */
+    return len;
+}
+
+/* pause
+    like delay but lets the idle handler run
+*/
+void SerialPropellerConnection::pause(int ms)
+{
+    unsigned long start = millis();
+    while (millis() - start < (unsigned long)ms) {
+        idle();
+        yield();
+    }
+}
+
+unsigned long SerialPropellerConnection::microseconds()
+{
+    return micros();
+}
+
+int SerialPropellerConnection::setBaudRate(int baudRate)
+{
+    if (maxBaudRate() > 0 && baudRate > maxBaudRate())
+        return -1;
+    if (baudRate != m_baudRate) {
+        if (m_baudRate != -1)
+          m_txSerial->end();
+        if ((m_baudRate = baudRate) != -1) {
+          m_txSerial->begin(m_baudRate);
+          if (m_rxSoftSerial)
+            m_rxSoftSerial->begin(m_baudRate);
+        }
+    }
+    return 0;
+}
+
+/* maxBaudRate
+    a connection that receives in software is limited to what MySoftwareSerial can keep up with
+*/
+int SerialPropellerConnection::maxBaudRate()
+{
+    return m_rxSoftSerial ? SOFT_SERIAL_MAX_BAUD_RATE : 0;
+}
+
+int SerialPropellerConnection::setResetPin(int resetPin)
+{
+    if (resetPin != m_resetPin) {
+        if (m_resetPin != -1)
+            pinMode(m_resetPin, INPUT);
+        if ((m_resetPin = resetPin) != -1) {
+            pinMode(m_resetPin, OUTPUT);
+            digitalWrite(m_resetPin, HIGH);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __SERIALCONNECTION_H__
+#define __SERIALCONNECTION_H__
+
+#include "propconnection.h"
+
+class HardwareSerial;
+class MySoftwareSerial;
+class Stream;
+
+// fastest rate MySoftwareSerial receives reliably
+#define SOFT_SERIAL_MAX_BAUD_RATE   115200
+
+// connection to a Propeller through a hardware UART, or through a UART that can only transmit
+// (UART1) with MySoftwareSerial receiving the replies on another pin
+class SerialPropellerConnection : public PropellerConnection
+{
+public:
+    SerialPropellerConnection();
+    SerialPropellerConnection(HardwareSerial &serial);
+    SerialPropellerConnection(HardwareSerial &txSerial, MySoftwareSerial &rxSerial);
+    ~SerialPropellerConnection() {}
+    int generateResetSignal();
+    int sendData(uint8_t *buffer, int size);
+    int receiveDataExactTimeout(uint8_t *buffer, int size, int timeout);
+    unsigned long microseconds();
+    int setBaudRate(int baudRate);
+    int maxBaudRate();
+    int setResetPin(int pin);
+private:
+    void pause(int ms);
+
+    HardwareSerial *m_txSerial;
+    MySoftwareSerial *m_rxSoftSerial;   // NULL if the UART receives as well
+    Stream *m_rxStream;
+};
+
+#endif
@@ -9,12 +9,12 @@ MySoftwareSerial softSerial(3, 1, true); // RX, TX, Invert
 void resetStamp();
 bool isBS2();
 
-int handleStampReq(WiFiClient &client, String &req)
+int handleStampReq(WiFiClient &client, HttpRequest &req)
 {
   if (isBS2())
-    AppendResponseText("Found a BS2");
+    AppendResponseText(rlInfo, "Found a BS2");
   else
-    AppendResponseText("Unknown type of stamp");
+    AppendResponseText(rlInfo, "Unknown type of stamp");
   SendResponse(client, 200, "OK");
 }
 
@@ -57,40 +57,40 @@ bool isBS2()
   
   softSerial.write('B');
 //  if ((byte = nextByte()) != 'B') {
-//    AppendResponseText("No echo of 'B' %02x", byte);
+//    AppendResponseText(rlInfo, "No echo of 'B' %02x", byte);
 //    return false;
 //  }
   if ((byte = nextByte()) != (-'B' & 0xff)) {
-    AppendResponseText("No complement of 'B' %02x", byte);
+    AppendResponseText(rlError, "No complement of 'B' %02x", byte);
     return false;
   }
   
   softSerial.write('S');
 //  if ((byte = nextByte()) != 'S') {
-//    AppendResponseText("No echo of 'S' %02x", byte);
+//    AppendResponseText(rlInfo, "No echo of 'S' %02x", byte);
 //    return false;
 //  }
   if ((byte = nextByte()) != (-'S' & 0xff)) {
-    AppendResponseText("No complement of 'S' %02x", byte);
+    AppendResponseText(rlError, "No complement of 'S' %02x", byte);
     return false;
   }
   
   softSerial.write('2');
 //  if ((byte = nextByte()) != '2') {
-//    AppendResponseText("No echo of '2' %02x", byte);
+//    AppendResponseText(rlInfo, "No echo of '2' %02x", byte);
 //    return false;
 //  }
   if ((byte = nextByte()) != (-'2' & 0xff)) {
-    AppendResponseText("No complement of '2' %02x", byte);
+    AppendResponseText(rlError, "No complement of '2' %02x", byte);
     return false;
   }
   
   softSerial.write((uint8_t)0x00);
 //  if ((byte = nextByte()) != '0') {
-//    AppendResponseText("No echo of 0x00 %02x", byte);
+//    AppendResponseText(rlInfo, "No echo of 0x00 %02x", byte);
 //    return false;
 //  }
-  AppendResponseText("BS2 version is %02x", nextByte());
+  AppendResponseText(rlInfo, "BS2 version is %02x", nextByte());
   
   return true;
 }
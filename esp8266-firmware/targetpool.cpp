@@ -0,0 +1,29 @@
+#include <stddef.h>
+#include "targetpool.h"
+
+TargetPool::~TargetPool()
+{
+    while (m_count > 0)
+        delete m_targets[--m_count];
+}
+
+/* add
+    adds a Propeller on 'connection' and returns its index or -1 if the pool is full
+*/
+int TargetPool::add(PropellerConnection &connection, int resetPin)
+{
+    if (m_count >= MAX_TARGETS)
+        return -1;
+    m_targets[m_count] = new PropellerTarget(connection, resetPin);
+    return m_count++;
+}
+
+/* setIdleHandler
+    sets the handler each connection calls while it waits on its Propeller
+*/
+void TargetPool::setIdleHandler(IdleHandler handler)
+{
+    int i;
+    for (i = 0; i < m_count; ++i)
+        m_targets[i]->connection().setIdleHandler(handler);
+}
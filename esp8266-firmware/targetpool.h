@@ -0,0 +1,47 @@
+#ifndef __TARGETPOOL_H__
+#define __TARGETPOOL_H__
+
+#include "propconnection.h"
+#include "proploader.h"
+#include "fastproploader.h"
+
+// largest number of Propellers one module can load
+#define MAX_TARGETS     4
+
+// a Propeller the module can load: the connection to it, the reset pin used unless a request
+// gives another and the loaders that talk to it, which keep their own state between requests
+class PropellerTarget
+{
+public:
+    PropellerTarget(PropellerConnection &connection, int resetPin)
+        : m_connection(connection), m_loader(connection), m_fastLoader(connection), m_resetPin(resetPin) {}
+    ~PropellerTarget() {}
+    PropellerConnection &connection() { return m_connection; }
+    PropellerLoader &loader() { return m_loader; }
+    FastPropellerLoader &fastLoader() { return m_fastLoader; }
+    int resetPin() { return m_resetPin; }
+
+private:
+    PropellerConnection &m_connection;
+    PropellerLoader m_loader;
+    FastPropellerLoader m_fastLoader;
+    int m_resetPin;
+};
+
+// the Propellers the module can load, numbered in the order they are added
+class TargetPool
+{
+public:
+    TargetPool() : m_count(0) {}
+    ~TargetPool();
+    int add(PropellerConnection &connection, int resetPin);
+    int count() { return m_count; }
+    PropellerTarget *target(int index) { return index >= 0 && index < m_count ? m_targets[index] : NULL; }
+    void setIdleHandler(IdleHandler handler);
+
+private:
+    PropellerTarget *m_targets[MAX_TARGETS];
+    int m_count;
+};
+
+#endif
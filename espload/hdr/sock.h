@@ -43,6 +43,9 @@ int GetInternetAddress(const char *hostName, short port, SOCKADDR_IN *addr);
 const char *AddressToString(SOCKADDR_IN *addr);
 int OpenBroadcastSocket(short port, SOCKET *pSocket);
 int ConnectSocket(SOCKADDR_IN *addr, SOCKET *pSocket);
+int ConnectSocketNonBlocking(SOCKADDR_IN *addr, SOCKET *pSocket);
+int SocketConnectResult(SOCKET sock);
+int SocketWouldBlock(void);
 int BindSocket(short port, SOCKET *pSocket);
 void CloseSocket(SOCKET sock);
 int SocketDataAvailableP(SOCKET sock, int timeout);
@@ -3,32 +3,130 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#ifndef __MINGW32__
+#include <sys/time.h>
+#endif
 #include "sock.h"
+#include "lzpack.h"
 
 #define DEF_DISCOVER_PORT   2000
+#define DISCOVER_TIMEOUT    2000    /* milliseconds to wait for modules to answer discovery */
+#define DISCOVER_QUIET_TIME 250     /* stop after this many milliseconds without a new answer */
+#define DISCOVER_MESSAGE    "Me here! Ignore this message.\n"
+#define MAX_REPLY_SIZE      1024
 #define DEF_RESET_PIN       12
 #define DEF_CHUNK_SIZE      8192
 #define MAX_CHUNK_SIZE      8192
+#define MAX_HDR_SIZE        256
+#define DEF_PACKET_SIZE     1024    /* bytes of the image in each compressed record or delta packet */
+#define DELTA_HEADER_SIZE   4       /* offset and size long before each changed packet of a delta load */
 
 #define MAX_IF_ADDRS        10
 
-typedef int XbeeAddrList;
+#define MAX_TARGETS         64
+#define DEF_WORKER_COUNT    8
+#define DEPLOY_TIMEOUT      30000   /* milliseconds allowed for each module to load */
+#define MAX_RESPONSE_SIZE   1024    /* enough of a response to find its status code */
+
+/* image hash used by the module's image cache (64 bit FNV-1a) */
+#define IMAGE_HASH_INIT     0xcbf29ce484222325ULL
+#define IMAGE_HASH_PRIME    0x100000001b3ULL
+
+/* a module that answered discovery along with what its reply says about it */
+typedef struct {
+    SOCKADDR_IN addr;
+    char reply[MAX_REPLY_SIZE];
+    char mac[32];
+    char version[16];
+    int resetPin;                   /* -1 for modules whose reply only says they're there */
+    int maxPacketSize;
+    int finalBaudRate;
+    char images[MAX_REPLY_SIZE];    /* comma separated hashes of the cached images */
+    int busy;
+} Module;
+
+typedef struct {
+    Module modules[MAX_TARGETS];
+    int count;
+} ModuleList;
+
+/* progress of one module in a parallel load */
+typedef enum {
+    tsWaiting,
+    tsConnecting,
+    tsSending,
+    tsReceiving,
+    tsDone,
+    tsFailed
+} TargetState;
+
+typedef struct {
+    char name[64];
+    SOCKADDR_IN addr;
+    TargetState state;
+    SOCKET sock;
+    char hdr[MAX_HDR_SIZE];
+    int hdrSize;
+    int resetPin;
+    int cached;                     /* nonzero if the module already has the image in its cache */
+    int bodySize;
+    int sent;                       /* bytes of the header and body sent so far */
+    uint8_t res[MAX_RESPONSE_SIZE];
+    int resCnt;
+    unsigned long start;
+    unsigned long elapsed;
+    const char *error;
+} Target;
 
 int chunkSize = DEF_CHUNK_SIZE;
+int keepAlive = 0;
+int streamImage = 0;
+int compressImage = 0;
+int deltaLoad = 0;
+const char *finalBaudRate = NULL;
+int useCache = 0;
+int showStats = 0;
+int verbose = 1;
 
 int load(const char *ipAddr, char *fileName, int resetPin);
-int sendRequest(SOCKADDR_IN *addr, uint8_t *req, int reqSize, uint8_t *res, int resMax);
+int deploy(Target *targets, int count, char *fileName, int workerCount);
+void startTarget(Target *target, int imageSize, int bodySize, const char *hashText, const char *baudArg);
+void stepTarget(Target *target, uint8_t *body);
+void finishTarget(Target *target);
+void failTarget(Target *target, const char *error);
+uint8_t *readFile(const char *fileName, int *pSize);
+uint8_t *packImage(const uint8_t *image, int imageSize, int *pPackedSize);
+int loadCached(SOCKADDR_IN *addr, uint8_t *image, int imageSize, int resetPin, const char *baudArg, int *pHit);
+int loadDelta(SOCKADDR_IN *addr, uint8_t *image, int imageSize, int resetPin, const char *baudArg);
+uint32_t packetHash(const uint8_t *data, int size);
+void imageHash(const uint8_t *image, int imageSize, char *hashText);
+int benchmark(const char *hostName, char *fileName, int resetPin, int count);
+int sendRequest(SOCKADDR_IN *addr, SOCKET *pSock, uint8_t *req, int reqSize, uint8_t *res, int resMax);
+int receiveResponse(SOCKET sock, uint8_t *res, int resMax, int *pKeepAlive);
+int responseCode(const uint8_t *res, int cnt);
+int printStats(SOCKADDR_IN *addr, const char *name);
+unsigned long msTimer();
 void dumpHdr(const uint8_t *buf, int size);
-int discover(XbeeAddrList &addrs, int timeout);
-int discover1(IFADDR *ifaddr, XbeeAddrList &addrs, int timeout);
+int discover(ModuleList &modules, int timeout, int maxCount);
+void parseDiscoverReply(Module *module);
+int moduleHasImage(Module *module, const char *hashText);
 void Usage();
 
 int main(int argc, char *argv[])
 {
-    XbeeAddrList addrs;
+    static ModuleList modules;
+    int discoverCount = MAX_TARGETS;
     char *infile = NULL;
-    char *ipaddr = NULL;
-    int resetPin = DEF_RESET_PIN;
+    char *ipaddrs[MAX_TARGETS];
+    int ipaddrCount = 0;
+    int loadAll = 0;
+    int workerCount = DEF_WORKER_COUNT;
+    int resetPin = -1;
+    int benchmarkCount = 0;
+    Target *targets;
+    char hashText[17];
+    uint8_t *image;
+    int imageSize;
     int ret, i;
 
     /* get the arguments */
@@ -37,6 +135,18 @@ int main(int argc, char *argv[])
         /* handle switches */
         if (argv[i][0] == '-') {
             switch(argv[i][1]) {
+            case 'b':
+                if (argv[i][2])
+                    benchmarkCount = atoi(&argv[i][2]);
+                else if (++i < argc)
+                    benchmarkCount = atoi(argv[i]);
+                else
+                    Usage();
+                if (benchmarkCount < 1) {
+                    printf("error: benchmark count must be at least 1\n");
+                    return 1;
+                }
+                break;
             case 'c':
                 if (argv[i][2])
                     chunkSize = atoi(&argv[i][2]);
@@ -49,14 +159,71 @@ int main(int argc, char *argv[])
                     return 1;
                 }
                 break;
+            case 'd':
+                deltaLoad = 1;
+                break;
+            case 'f':
+                if (argv[i][2])
+                    finalBaudRate = &argv[i][2];
+                else if (++i < argc)
+                    finalBaudRate = argv[i];
+                else
+                    Usage();
+                break;
+            case 'a':
+                loadAll = 1;
+                break;
             case 'i':
+                if (ipaddrCount >= MAX_TARGETS) {
+                    printf("error: too many modules, the limit is %d\n", MAX_TARGETS);
+                    return 1;
+                }
                 if (argv[i][2])
-                    ipaddr = &argv[i][2];
+                    ipaddrs[ipaddrCount++] = &argv[i][2];
                 else if (++i < argc)
-                    ipaddr = argv[i];
+                    ipaddrs[ipaddrCount++] = argv[i];
                 else
                     Usage();
                 break;
+            case 'k':
+                keepAlive = 1;
+                break;
+            case 'n':
+                if (argv[i][2])
+                    discoverCount = atoi(&argv[i][2]);
+                else if (++i < argc)
+                    discoverCount = atoi(argv[i]);
+                else
+                    Usage();
+                if (discoverCount < 1 || discoverCount > MAX_TARGETS) {
+                    printf("error: module count must be between 1 and %d\n", MAX_TARGETS);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (argv[i][2])
+                    workerCount = atoi(&argv[i][2]);
+                else if (++i < argc)
+                    workerCount = atoi(argv[i]);
+                else
+                    Usage();
+                if (workerCount < 1) {
+                    printf("error: worker count must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 's':
+                streamImage = 1;
+                break;
+            case 't':
+                showStats = 1;
+                break;
+            case 'x':
+                useCache = 1;
+                break;
+            case 'z':
+                compressImage = 1;
+                break;
             case 'r':
                 if (argv[i][2])
                     resetPin = atoi(&argv[i][2]);
@@ -81,20 +248,101 @@ int main(int argc, char *argv[])
         }
     }
     
-    if (infile) {
-        if (!ipaddr) {
+    /* load several modules at once */
+    if (infile && (loadAll || ipaddrCount > 1)) {
+        if (benchmarkCount > 0) {
+            printf("error: can't benchmark more than one module\n");
+            return 1;
+        }
+        if (deltaLoad) {
+            printf("error: can't send deltas to more than one module\n");
+            return 1;
+        }
+        if (loadAll && (ret = discover(modules, DISCOVER_TIMEOUT, discoverCount)) < 0) {
+            printf("error: discover failed: %d\n", ret);
+            return 1;
+        }
+        if (!(targets = (Target *)calloc(MAX_TARGETS, sizeof(Target)))) {
+            printf("error: insufficient memory\n");
+            return 1;
+        }
+        ret = 0;
+        for (i = 0; i < ipaddrCount; ++i) {
+            if (GetInternetAddress(ipaddrs[i], 80, &targets[ret].addr) != 0) {
+                printf("error: invalid host name or IP address '%s'\n", ipaddrs[i]);
+                free(targets);
+                return 1;
+            }
+            targets[ret].resetPin = resetPin >= 0 ? resetPin : DEF_RESET_PIN;
+            snprintf(targets[ret++].name, sizeof(targets[0].name), "%s", ipaddrs[i]);
+        }
+        
+        /* use what the discovery replies say to set up each load */
+        if (loadAll && useCache && !(image = readFile(infile, &imageSize))) {
+            free(targets);
+            return 1;
+        }
+        if (loadAll && useCache) {
+            imageHash(image, imageSize, hashText);
+            free(image);
+        }
+        for (i = 0; loadAll && i < modules.count && ret < MAX_TARGETS; ++i) {
+            Module *module = &modules.modules[i];
+            if (module->busy) {
+                printf("%s: skipped because it is busy\n", AddressToString(&module->addr));
+                continue;
+            }
+            targets[ret].addr = module->addr;
+            targets[ret].addr.sin_port = htons(80);
+            targets[ret].resetPin = resetPin >= 0 ? resetPin : module->resetPin >= 0 ? module->resetPin : DEF_RESET_PIN;
+            targets[ret].cached = useCache && moduleHasImage(module, hashText);
+            snprintf(targets[ret++].name, sizeof(targets[0].name), "%s", AddressToString(&module->addr));
+        }
+        if (ret == 0) {
+            printf("error: no modules found\n");
+            free(targets);
+            return 1;
+        }
+        ret = deploy(targets, ret, infile, workerCount);
+        free(targets);
+        if (ret < 0)
+            return 1;
+    }
+    
+    else if (infile) {
+        if (ipaddrCount == 0) {
             printf("error: must specify IP address or host name with -i\n");
             return 1;
         }
-        if (load(ipaddr, infile, resetPin) < 0)
+        if (resetPin < 0)
+            resetPin = DEF_RESET_PIN;
+        if (benchmarkCount > 0) {
+            if (benchmark(ipaddrs[0], infile, resetPin, benchmarkCount) < 0)
+                return 1;
+        }
+        else if (load(ipaddrs[0], infile, resetPin) < 0)
             return 1;
+        else if (showStats) {
+            SOCKADDR_IN addr;
+            if (GetInternetAddress(ipaddrs[0], 80, &addr) == 0)
+                printStats(&addr, ipaddrs[0]);
+        }
     }
     
     else {
-        if ((ret = discover(addrs, 2000)) < 0) {
+        if ((ret = discover(modules, DISCOVER_TIMEOUT, discoverCount)) < 0) {
             printf("error: discover failed: %d\n", ret);
             return 1;
         }
+        for (i = 0; i < modules.count; ++i) {
+            Module *module = &modules.modules[i];
+            if (module->resetPin < 0)
+                printf("from %s got: %s", AddressToString(&module->addr), module->reply);
+            else
+                printf("%s: mac %s, version %s, reset pin %d, final baud rate %d, images %s, %s\n",
+                       AddressToString(&module->addr), module->mac, module->version, module->resetPin,
+                       module->finalBaudRate, module->images[0] ? module->images : "none", module->busy ? "busy" : "idle");
+        }
     }
     
     return 0;
@@ -104,70 +352,134 @@ void Usage()
 {
     printf("\
 usage: espload\n\
+         [ -a ]            load every module that answers discovery\n\
+         [ -b <count> ]    benchmark connect-per-request against keep-alive loads (and cache hits with -x)\n\
          [ -c <size> ]     chunk size (default is %d)\n\
-         [ -i <addr> ]     IP address or host name of module to load\n\
+         [ -d ]            send only the packets that changed since the module's last cached or delta load\n\
+         [ -f <baud> ]     final baud rate or 'auto' to use the fastest one that works\n\
+         [ -i <addr> ]     IP address or host name of module to load (repeat to load several at once)\n\
+         [ -k ]            keep the connection open between requests\n\
+         [ -n <count> ]    stop discovery once this many modules have answered\n\
+         [ -p <count> ]    number of modules to load at once (default is %d)\n\
          [ -r <pin> ]      pin to use for resetting the Propeller (default is %d)\n\
-         [ <name> ]        file to load (discover modules if not given)\n", DEF_CHUNK_SIZE, DEF_RESET_PIN);
+         [ -s ]            send the whole image in a single streaming request\n\
+         [ -t ]            show where each module's load time went\n\
+         [ -x ]            load from the module's image cache, uploading the image only if it's missing\n\
+         [ -z ]            compress the image and send it in a single streaming request\n\
+         [ <name> ]        file to load (discover modules if not given)\n", DEF_CHUNK_SIZE, DEF_WORKER_COUNT, DEF_RESET_PIN);
     exit(1);
 }
 
 int load(const char *hostName, char *fileName, int resetPin)
 {
     uint8_t buffer[MAX_CHUNK_SIZE], *p;
+    const char *connection = keepAlive ? "keep-alive" : "close";
+    char baudArg[64] = "";
     int imageSize, remaining, cnt;
+    SOCKET sock = INVALID_SOCKET;
     SOCKADDR_IN addr;
     uint8_t *image;
-    FILE *fp;
     
     if (GetInternetAddress(hostName, 80, &addr) != 0) {
         printf("error: invalid host name or IP address '%s'\n", hostName);
         return -1;
     }
     
-    /* open the image file */
-    if (!(fp = fopen(fileName, "rb"))) {
-        printf("error: can't open '%s'\n", fileName);
+    /* read the entire image into memory */
+    if (!(image = readFile(fileName, &imageSize)))
         return -1;
-    }
-    
-    /* get the size of the binary file */
-    fseek(fp, 0, SEEK_END);
-    imageSize = (int)ftell(fp);
-    fseek(fp, 0, SEEK_SET);
 
-    /* allocate space for the file */
-    if (!(image = (uint8_t *)malloc(imageSize)))
-        return -1;
+    /* let the module pick its default final baud rate unless one was given */
+    if (finalBaudRate)
+        snprintf(baudArg, sizeof(baudArg), "&final-baud-rate=%s", finalBaudRate);
 
-    /* read the entire image into memory */
-    if ((int)fread(image, 1, imageSize, fp) != imageSize) {
+    /* send the packets that changed since the last image or go through the cache to make this the last image */
+    if (deltaLoad && (cnt = loadDelta(&addr, image, imageSize, resetPin, baudArg)) != 1) {
+        if (cnt == 0 && verbose)
+            printf("image loaded as a delta\n");
         free(image);
-        return -1;
+        return cnt;
     }
     
-    /* close the file */
-    fclose(fp);
+    /* let the module load the image from flash if it already has it */
+    if (useCache || deltaLoad) {
+        int hit;
+        cnt = loadCached(&addr, image, imageSize, resetPin, baudArg, &hit);
+        if (cnt == 0 && verbose)
+            printf("image %s cache\n", hit ? "loaded from" : "uploaded to");
+        free(image);
+        return cnt;
+    }
+
+    /* send the image (or its packet records) as the body of a single /load request */
+    if (streamImage || compressImage) {
+        char packArg[64] = "";
+        uint8_t *body = image, *req;
+        int bodySize = imageSize, hdrCnt;
+        if (compressImage) {
+            if (!(body = packImage(image, imageSize, &bodySize))) {
+                free(image);
+                return -1;
+            }
+            snprintf(packArg, sizeof(packArg), "&compressed=1&size=%d&packet-size=%d", imageSize, DEF_PACKET_SIZE);
+            if (verbose)
+                printf("sending %d bytes of records for %d bytes of image\n", bodySize, imageSize);
+        }
+        if (!(req = (uint8_t *)malloc(bodySize + MAX_HDR_SIZE))) {
+            if (body != image)
+                free(body);
+            free(image);
+            return -1;
+        }
+        hdrCnt = snprintf((char *)req, MAX_HDR_SIZE, "\
+POST /load?reset-pin=%d%s%s&command=run HTTP/1.1\r\n\
+Content-Length: %d\r\n\
+Connection: close\r\n\
+\r\n", resetPin, baudArg, packArg, bodySize);
+        memcpy(&req[hdrCnt], body, bodySize);
+        cnt = sendRequest(&addr, &sock, req, hdrCnt + bodySize, buffer, sizeof(buffer));
+        free(req);
+        if (body != image)
+            free(body);
+        free(image);
+        if (cnt == -1) {
+            printf("error: load request failed\n");
+            return -1;
+        }
+        return 0;
+    }
 
     cnt = snprintf((char *)buffer, sizeof(buffer), "\
-POST /load-begin?size=%d&reset-pin=%d HTTP/1.1\r\n\
-\r\n", imageSize, resetPin);
+POST /load-begin?size=%d&reset-pin=%d%s HTTP/1.1\r\n\
+Content-Length: 0\r\n\
+Connection: %s\r\n\
+\r\n", imageSize, resetPin, baudArg, connection);
     
-    if ((cnt = sendRequest(&addr, buffer, cnt, buffer, sizeof(buffer))) == -1) {
+    if ((cnt = sendRequest(&addr, &sock, buffer, cnt, buffer, sizeof(buffer))) == -1) {
         printf("error: load-begin request failed\n");
+        free(image);
         return -1;
     }
     
     p = image;
     remaining = imageSize;
     while (remaining > 0) {
-        int hdrCnt = snprintf((char *)buffer, sizeof(buffer), "\
+        const char *fmt = "\
 POST /load-data HTTP/1.1\r\n\
-\r\n");
+Content-Length: %d\r\n\
+Connection: %s\r\n\
+\r\n";
+        
+        /* size the header for the largest possible chunk then fill in the actual size */
+        int hdrCnt = snprintf((char *)buffer, sizeof(buffer), fmt, chunkSize, connection);
         if ((cnt = remaining) > chunkSize - hdrCnt)
             cnt = chunkSize - hdrCnt;
+        hdrCnt = snprintf((char *)buffer, sizeof(buffer), fmt, cnt, connection);
+        
         memcpy(&buffer[hdrCnt], p, cnt);
-        if (sendRequest(&addr, buffer, hdrCnt + cnt, buffer, sizeof(buffer)) == -1) {
+        if (sendRequest(&addr, &sock, buffer, hdrCnt + cnt, buffer, sizeof(buffer)) == -1) {
             printf("error: load-data request failed\n");
+            free(image);
             return -1;
         }
         p += cnt;
@@ -176,49 +488,694 @@ POST /load-data HTTP/1.1\r\n\
         
     cnt = snprintf((char *)buffer, sizeof(buffer), "\
 POST /load-end?command=run HTTP/1.1\r\n\
+Content-Length: 0\r\n\
+Connection: close\r\n\
 \r\n");
     
-    if ((cnt = sendRequest(&addr, buffer, cnt, buffer, sizeof(buffer))) == -1) {
+    if ((cnt = sendRequest(&addr, &sock, buffer, cnt, buffer, sizeof(buffer))) == -1) {
         printf("error: load-end request failed\n");
+        free(image);
         return -1;
     }
     
+    /* close the connection if the module left it open */
+    if (sock != INVALID_SOCKET)
+        CloseSocket(sock);
+    
+    free(image);
+    
     return 0;
 }
 
-// should try:
-// Connection: keep-alive
+/* deploy - load the same image into several modules at once
+    each module gets a single /load request driven by a non-blocking socket and at most
+    'workerCount' of them are in progress at a time; all of them send from the same image buffer
+    (or from the same packet records when compressing)
+*/
+int deploy(Target *targets, int count, char *fileName, int workerCount)
+{
+    unsigned long start, elapsed;
+    int imageSize, bodySize, active, next, finished, loaded, i;
+    char baudArg[64] = "", hashText[17];
+    uint8_t *image, *body;
+    
+    /* read the image once for all of the modules */
+    if (!(image = readFile(fileName, &imageSize)))
+        return -1;
+    imageHash(image, imageSize, hashText);
+    body = image;
+    bodySize = imageSize;
+    if (compressImage && !(body = packImage(image, imageSize, &bodySize))) {
+        free(image);
+        return -1;
+    }
+    if (finalBaudRate)
+        snprintf(baudArg, sizeof(baudArg), "&final-baud-rate=%s", finalBaudRate);
+    
+    for (i = 0; i < count; ++i)
+        targets[i].state = tsWaiting;
+    
+    start = msTimer();
+    active = next = finished = 0;
+    while (finished < count) {
+        struct timeval timeout;
+        fd_set readSet, writeSet;
+        SOCKET maxSock = 0;
+        unsigned long now;
+        
+        /* start loads until the pool is full */
+        while (active < workerCount && next < count) {
+            Target *target = &targets[next++];
+            startTarget(target, imageSize, bodySize, hashText, baudArg);
+            
+            /* a connect that fails at once never reaches the select loop below */
+            if (target->state == tsFailed) {
+                finishTarget(target);
+                ++finished;
+            }
+            else
+                ++active;
+        }
+        
+        /* wait for any of the sockets to be ready */
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        for (i = 0; i < next; ++i) {
+            Target *target = &targets[i];
+            if (target->state == tsConnecting || target->state == tsSending)
+                FD_SET(target->sock, &writeSet);
+            else if (target->state == tsReceiving)
+                FD_SET(target->sock, &readSet);
+            else
+                continue;
+            if (target->sock > maxSock)
+                maxSock = target->sock;
+        }
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;
+        if (select(maxSock + 1, &readSet, &writeSet, NULL, &timeout) < 0) {
+            printf("error: select failed\n");
+            if (body != image)
+                free(body);
+            free(image);
+            return -1;
+        }
+        
+        /* advance each load whose socket is ready */
+        now = msTimer();
+        for (i = 0; i < next; ++i) {
+            Target *target = &targets[i];
+            if (target->state == tsDone || target->state == tsFailed)
+                continue;
+            if (FD_ISSET(target->sock, &readSet) || FD_ISSET(target->sock, &writeSet))
+                stepTarget(target, body);
+            else if (now - target->start > DEPLOY_TIMEOUT)
+                failTarget(target, "timeout");
+            if (target->state == tsDone || target->state == tsFailed) {
+                finishTarget(target);
+                --active;
+                ++finished;
+            }
+        }
+    }
+    elapsed = msTimer() - start;
+    if (body != image)
+        free(body);
+    free(image);
+    
+    /* show the totals */
+    loaded = 0;
+    for (i = 0; i < count; ++i) {
+        if (targets[i].state == tsDone)
+            ++loaded;
+    }
+    printf("%d of %d modules loaded in %lu ms", loaded, count, elapsed);
+    if (elapsed > 0)
+        printf(" (%.1f images/minute)", loaded * 60000.0 / elapsed);
+    putchar('\n');
+    
+    /* the modules keep the stats of their last load so they can be collected once all are done */
+    for (i = 0; showStats && i < count; ++i) {
+        if (targets[i].state == tsDone)
+            printStats(&targets[i].addr, targets[i].name);
+    }
+    
+    return loaded == count ? 0 : -1;
+}
 
-int sendRequest(SOCKADDR_IN *addr, uint8_t *req, int reqSize, uint8_t *res, int resMax)
+/* startTarget - connect to a module and prepare its /load or /load-cached request
+    'bodySize' is the size of the image or of its packet records when compressing
+*/
+void startTarget(Target *target, int imageSize, int bodySize, const char *hashText, const char *baudArg)
 {
-    SOCKET sock;
+    char packArg[64] = "";
+    target->start = msTimer();
+    target->sent = 0;
+    target->resCnt = 0;
+    target->bodySize = target->cached ? 0 : bodySize;
+    if (compressImage)
+        snprintf(packArg, sizeof(packArg), "&compressed=1&size=%d&packet-size=%d", imageSize, DEF_PACKET_SIZE);
+    if (target->cached)
+        target->hdrSize = snprintf(target->hdr, sizeof(target->hdr), "\
+POST /load-cached?hash=%s&reset-pin=%d%s&command=run HTTP/1.1\r\n\
+Content-Length: 0\r\n\
+Connection: close\r\n\
+\r\n", hashText, target->resetPin, baudArg);
+    else
+        target->hdrSize = snprintf(target->hdr, sizeof(target->hdr), "\
+POST /load?reset-pin=%d%s%s&command=run HTTP/1.1\r\n\
+Content-Length: %d\r\n\
+Connection: close\r\n\
+\r\n", target->resetPin, baudArg, packArg, bodySize);
+    if (ConnectSocketNonBlocking(&target->addr, &target->sock) != 0) {
+        target->sock = INVALID_SOCKET;
+        failTarget(target, "connect failed");
+        return;
+    }
+    target->state = tsConnecting;
+}
+
+/* stepTarget - move a module's load along once its socket is ready */
+void stepTarget(Target *target, uint8_t *body)
+{
+    uint8_t discard[MAX_RESPONSE_SIZE];
     int cnt;
     
-    if (ConnectSocket(addr, &sock) != 0) {
+    switch (target->state) {
+    case tsConnecting:
+        if (SocketConnectResult(target->sock) != 0) {
+            failTarget(target, "connect failed");
+            break;
+        }
+        target->state = tsSending;
+        break;
+        
+    case tsSending:
+        /* send the header and then the body straight from the shared buffer */
+        if (target->sent < target->hdrSize)
+            cnt = SendSocketData(target->sock, &target->hdr[target->sent], target->hdrSize - target->sent);
+        else
+            cnt = SendSocketData(target->sock, &body[target->sent - target->hdrSize], target->hdrSize + target->bodySize - target->sent);
+        if (cnt < 0) {
+            if (!SocketWouldBlock())
+                failTarget(target, "send failed");
+            break;
+        }
+        if ((target->sent += cnt) == target->hdrSize + target->bodySize)
+            target->state = tsReceiving;
+        break;
+        
+    case tsReceiving:
+        /* the module closes the connection after its response */
+        if (target->resCnt < MAX_RESPONSE_SIZE - 1)
+            cnt = ReceiveSocketData(target->sock, &target->res[target->resCnt], MAX_RESPONSE_SIZE - 1 - target->resCnt);
+        else
+            cnt = ReceiveSocketData(target->sock, discard, sizeof(discard));
+        if (cnt < 0) {
+            if (!SocketWouldBlock())
+                failTarget(target, "receive failed");
+        }
+        else if (cnt > 0) {
+            if (target->resCnt < MAX_RESPONSE_SIZE - 1)
+                target->resCnt += cnt;
+        }
+        else if (responseCode(target->res, target->resCnt) != 200)
+            failTarget(target, "load failed");
+        else {
+            closesocket(target->sock);
+            target->state = tsDone;
+        }
+        break;
+        
+    default:
+        break;
+    }
+}
+
+/* finishTarget - record how long a module's load took and show its result */
+void finishTarget(Target *target)
+{
+    target->elapsed = msTimer() - target->start;
+    if (target->state == tsDone)
+        printf("%s: loaded%s in %lu ms\n", target->name, target->cached ? " from cache" : "", target->elapsed);
+    else
+        printf("%s: %s after %lu ms\n", target->name, target->error, target->elapsed);
+}
+
+void failTarget(Target *target, const char *error)
+{
+    if (target->sock != INVALID_SOCKET) {
+        closesocket(target->sock);
+        target->sock = INVALID_SOCKET;
+    }
+    target->error = error;
+    target->state = tsFailed;
+}
+
+/* loadCached - load an image through the module's image cache, uploading it first if it isn't there */
+int loadCached(SOCKADDR_IN *addr, uint8_t *image, int imageSize, int resetPin, const char *baudArg, int *pHit)
+{
+    uint8_t buffer[MAX_CHUNK_SIZE], *req;
+    const char *connection = keepAlive ? "keep-alive" : "close";
+    SOCKET sock = INVALID_SOCKET;
+    char hashText[17];
+    int cnt;
+    
+    imageHash(image, imageSize, hashText);
+    
+    /* ask whether the module already has the image */
+    cnt = snprintf((char *)buffer, sizeof(buffer), "\
+GET /cache?hash=%s HTTP/1.1\r\n\
+Content-Length: 0\r\n\
+Connection: %s\r\n\
+\r\n", hashText, connection);
+    
+    if ((cnt = sendRequest(addr, &sock, buffer, cnt, buffer, sizeof(buffer))) == -1) {
+        printf("error: cache request failed\n");
+        return -1;
+    }
+    *pHit = responseCode(buffer, cnt) == 200;
+    
+    /* upload the image to the cache if it's missing */
+    if (!*pHit) {
+        int hdrCnt;
+        if (!(req = (uint8_t *)malloc(imageSize + MAX_HDR_SIZE))) {
+            if (sock != INVALID_SOCKET)
+                CloseSocket(sock);
+            return -1;
+        }
+        hdrCnt = snprintf((char *)req, MAX_HDR_SIZE, "\
+POST /cache?hash=%s HTTP/1.1\r\n\
+Content-Length: %d\r\n\
+Connection: %s\r\n\
+\r\n", hashText, imageSize, connection);
+        memcpy(&req[hdrCnt], image, imageSize);
+        cnt = sendRequest(addr, &sock, req, hdrCnt + imageSize, buffer, sizeof(buffer));
+        free(req);
+        if (cnt == -1 || responseCode(buffer, cnt) != 200) {
+            printf("error: storing image in cache failed\n");
+            if (sock != INVALID_SOCKET)
+                CloseSocket(sock);
+            return -1;
+        }
+    }
+    
+    /* load the image from the cache */
+    cnt = snprintf((char *)buffer, sizeof(buffer), "\
+POST /load-cached?hash=%s&reset-pin=%d%s&command=run HTTP/1.1\r\n\
+Content-Length: 0\r\n\
+Connection: close\r\n\
+\r\n", hashText, resetPin, baudArg);
+    
+    if ((cnt = sendRequest(addr, &sock, buffer, cnt, buffer, sizeof(buffer))) == -1 || responseCode(buffer, cnt) != 200) {
+        printf("error: load-cached request failed\n");
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
+        return -1;
+    }
+    
+    /* close the connection if the module left it open */
+    if (sock != INVALID_SOCKET)
+        CloseSocket(sock);
+    
+    return 0;
+}
+
+/* loadDelta - load an image by sending only the packets that differ from the module's last image
+    returns 1 without loading anything if the module has no last image for the reset pin
+*/
+int loadDelta(SOCKADDR_IN *addr, uint8_t *image, int imageSize, int resetPin, const char *baudArg)
+{
+    uint8_t buffer[MAX_CHUNK_SIZE], *body, *req;
+    const char *connection = keepAlive ? "keep-alive" : "close";
+    SOCKET sock = INVALID_SOCKET;
+    char hashText[17], baseText[17], *p;
+    int baseSize, offset, hdrCnt, bodySize, changed, total, cnt;
+    
+    imageHash(image, imageSize, hashText);
+    
+    /* get the packet hashes of the module's last image */
+    cnt = snprintf((char *)buffer, sizeof(buffer), "\
+GET /last-image?reset-pin=%d&packet-size=%d HTTP/1.1\r\n\
+Content-Length: 0\r\n\
+Connection: %s\r\n\
+\r\n", resetPin, DEF_PACKET_SIZE, connection);
+    
+    if ((cnt = sendRequest(addr, &sock, buffer, cnt, buffer, sizeof(buffer) - 1)) == -1) {
+        printf("error: last-image request failed\n");
+        return -1;
+    }
+    buffer[cnt] = '\0';
+    if (responseCode(buffer, cnt) != 200
+    ||  !(p = strstr((char *)buffer, "\r\n\r\n"))
+    ||  sscanf(p + 4, "hash=%16s\nsize=%d\n", baseText, &baseSize) != 2) {
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
+        return 1;
+    }
+    p = strstr(p + 4, "size=");
+    
+    if (!(body = (uint8_t *)malloc(imageSize + (imageSize / DEF_PACKET_SIZE + 1) * DELTA_HEADER_SIZE))) {
+        printf("error: insufficient memory\n");
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
+        return -1;
+    }
+    
+    /* add each packet whose hash doesn't match the one at the same offset in the last image */
+    bodySize = changed = total = 0;
+    for (offset = 0; offset < imageSize; offset += cnt) {
+        unsigned long baseHash = 0;
+        int baseCnt = 0;
+        cnt = imageSize - offset < DEF_PACKET_SIZE ? imageSize - offset : DEF_PACKET_SIZE;
+        if (offset < baseSize && p && (p = strchr(p, '\n')) != NULL) {
+            baseCnt = baseSize - offset < DEF_PACKET_SIZE ? baseSize - offset : DEF_PACKET_SIZE;
+            baseHash = strtoul(++p, NULL, 16);
+        }
+        ++total;
+        if (baseCnt == cnt && baseHash == packetHash(&image[offset], cnt))
+            continue;
+        body[bodySize++] = offset;
+        body[bodySize++] = offset >> 8;
+        body[bodySize++] = cnt;
+        body[bodySize++] = cnt >> 8;
+        memcpy(&body[bodySize], &image[offset], cnt);
+        bodySize += cnt;
+        ++changed;
+    }
+    if (verbose)
+        printf("sending %d of %d packets\n", changed, total);
+    
+    if (!(req = (uint8_t *)malloc(bodySize + MAX_HDR_SIZE))) {
+        free(body);
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
+        return -1;
+    }
+    hdrCnt = snprintf((char *)req, MAX_HDR_SIZE, "\
+POST /load-delta?base=%s&hash=%s&size=%d&packet-size=%d&reset-pin=%d%s&command=run HTTP/1.1\r\n\
+Content-Length: %d\r\n\
+Connection: close\r\n\
+\r\n", baseText, hashText, imageSize, DEF_PACKET_SIZE, resetPin, baudArg, bodySize);
+    memcpy(&req[hdrCnt], body, bodySize);
+    cnt = sendRequest(addr, &sock, req, hdrCnt + bodySize, buffer, sizeof(buffer));
+    free(req);
+    free(body);
+    
+    if (cnt == -1 || responseCode(buffer, cnt) != 200) {
+        printf("error: load-delta request failed\n");
+        if (sock != INVALID_SOCKET)
+            CloseSocket(sock);
+        return -1;
+    }
+    
+    /* close the connection if the module left it open */
+    if (sock != INVALID_SOCKET)
+        CloseSocket(sock);
+    
+    return 0;
+}
+
+/* packetHash - hash one packet the same way the module does when describing its last image */
+uint32_t packetHash(const uint8_t *data, int size)
+{
+    uint64_t hash = IMAGE_HASH_INIT;
+    int i;
+    for (i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= IMAGE_HASH_PRIME;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* imageHash - hash an image the same way the module's image cache does */
+void imageHash(const uint8_t *image, int imageSize, char *hashText)
+{
+    uint64_t hash = IMAGE_HASH_INIT;
+    int i;
+    for (i = 0; i < imageSize; ++i) {
+        hash ^= image[i];
+        hash *= IMAGE_HASH_PRIME;
+    }
+    sprintf(hashText, "%08lx%08lx", (unsigned long)(hash >> 32), (unsigned long)(hash & 0xffffffff));
+}
+
+int benchmark(const char *hostName, char *fileName, int resetPin, int count)
+{
+    static const char *modeNames[] = { "connect-per-request", "keep-alive", "cache hit" };
+    int modeCount = useCache ? 3 : 2;
+    unsigned long total[3];
+    char label[32];
+    int mode, i;
+    
+    /* the request dumps would dominate the timing */
+    verbose = 0;
+    
+    /* load the image 'count' times without and then with keep-alive, then from the cache if asked */
+    for (mode = 0; mode < modeCount; ++mode) {
+        keepAlive = mode > 0;
+        useCache = mode == 2;
+        total[mode] = 0;
+        
+        /* make sure the image is in the cache so only hits are timed */
+        if (useCache && load(hostName, fileName, resetPin) < 0)
+            return -1;
+            
+        for (i = 0; i < count; ++i) {
+            unsigned long start = msTimer(), elapsed;
+            if (load(hostName, fileName, resetPin) < 0)
+                return -1;
+            elapsed = msTimer() - start;
+            printf("%s load %d: %lu ms\n", modeNames[mode], i + 1, elapsed);
+            total[mode] += elapsed;
+        }
+    }
+    
+    for (mode = 0; mode < modeCount; ++mode) {
+        snprintf(label, sizeof(label), "%s:", modeNames[mode]);
+        printf("%-20s %lu ms per image\n", label, total[mode] / count);
+    }
+    
+    return 0;
+}
+
+int sendRequest(SOCKADDR_IN *addr, SOCKET *pSock, uint8_t *req, int reqSize, uint8_t *res, int resMax)
+{
+    int cnt, serverKeepAlive;
+    
+    /* connect unless the previous request left the connection open */
+    if (*pSock == INVALID_SOCKET && ConnectSocket(addr, pSock) != 0) {
         printf("error: connect failed\n");
+        *pSock = INVALID_SOCKET;
         return -1;
     }
     
-    printf("REQ:\n");
-    dumpHdr(req, reqSize);
+    if (verbose) {
+        printf("REQ:\n");
+        dumpHdr(req, reqSize);
+    }
     
-    if (SendSocketData(sock, req, reqSize) != reqSize) {
+    if (SendSocketData(*pSock, req, reqSize) != reqSize) {
         printf("error: send request failed\n");
+        CloseSocket(*pSock);
+        *pSock = INVALID_SOCKET;
         return -1;
     }
     
-    if ((cnt = ReceiveSocketDataTimeout(sock, res, resMax, 10000)) == -1) {
+    if ((cnt = receiveResponse(*pSock, res, resMax, &serverKeepAlive)) == -1) {
         printf("error: receive response failed\n");
+        CloseSocket(*pSock);
+        *pSock = INVALID_SOCKET;
         return -1;
     }
     
-    printf("RES:\n");
-    dumpHdr(res, cnt);
+    if (verbose) {
+        printf("RES:\n");
+        dumpHdr(res, cnt);
+    }
         
-    CloseSocket(sock);
+    /* close the connection unless both sides want to keep it */
+    if (!keepAlive || !serverKeepAlive) {
+        CloseSocket(*pSock);
+        *pSock = INVALID_SOCKET;
+    }
     
     return cnt;
 }
+
+/* receiveResponse - receive an HTTP response using its Content-Length to find the end */
+int receiveResponse(SOCKET sock, uint8_t *res, int resMax, int *pKeepAlive)
+{
+    int cnt, hdrSize, contentLength, remaining;
+    uint8_t discard[1024];
+    char *end, *p;
+    
+    /* receive at least the full response header */
+    *pKeepAlive = 0;
+    cnt = 0;
+    end = NULL;
+    while (!end) {
+        int n;
+        if (cnt >= resMax - 1 || (n = ReceiveSocketDataTimeout(sock, &res[cnt], resMax - cnt - 1, 10000)) == -1)
+            return cnt > 0 ? cnt : -1;
+        cnt += n;
+        res[cnt] = '\0';
+        end = strstr((char *)res, "\r\n\r\n");
+    }
+    hdrSize = (int)(end - (char *)res) + 4;
+    
+    /* find the header fields that determine whether the connection can be reused */
+    contentLength = -1;
+    for (p = (char *)res; p && p < end; ) {
+        if (strncasecmp(p, "Content-Length:", 15) == 0)
+            contentLength = atoi(p + 15);
+        else if (strncasecmp(p, "Connection:", 11) == 0) {
+            char *value = p + 11;
+            while (*value == ' ')
+                ++value;
+            *pKeepAlive = strncasecmp(value, "keep-alive", 10) == 0;
+        }
+        if ((p = strstr(p, "\r\n")) != NULL)
+            p += 2;
+    }
+    
+    /* without a Content-Length the response ends when the module closes the connection */
+    if (contentLength < 0) {
+        *pKeepAlive = 0;
+        return cnt;
+    }
+    
+    /* receive the rest of the body, discarding whatever doesn't fit in the buffer */
+    remaining = hdrSize + contentLength - cnt;
+    while (remaining > 0) {
+        int n;
+        if (cnt < resMax) {
+            int max = resMax - cnt < remaining ? resMax - cnt : remaining;
+            if ((n = ReceiveSocketDataTimeout(sock, &res[cnt], max, 10000)) == -1)
+                return -1;
+            cnt += n;
+        }
+        else {
+            int max = (int)sizeof(discard) < remaining ? (int)sizeof(discard) : remaining;
+            if ((n = ReceiveSocketDataTimeout(sock, discard, max, 10000)) == -1)
+                return -1;
+        }
+        remaining -= n;
+    }
+    
+    return cnt;
+}
+
+/* readFile - read an entire image file into memory */
+uint8_t *readFile(const char *fileName, int *pSize)
+{
+    uint8_t *image;
+    int imageSize;
+    FILE *fp;
+    
+    /* open the image file */
+    if (!(fp = fopen(fileName, "rb"))) {
+        printf("error: can't open '%s'\n", fileName);
+        return NULL;
+    }
+    
+    /* get the size of the binary file */
+    fseek(fp, 0, SEEK_END);
+    imageSize = (int)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    /* allocate space for the file and read it */
+    if (!(image = (uint8_t *)malloc(imageSize))
+    ||  (int)fread(image, 1, imageSize, fp) != imageSize) {
+        printf("error: can't read '%s'\n", fileName);
+        if (image)
+            free(image);
+        fclose(fp);
+        return NULL;
+    }
+    
+    /* close the file */
+    fclose(fp);
+    
+    *pSize = imageSize;
+    return image;
+}
+
+/* packImage - split an image into DEF_PACKET_SIZE byte packets and build a record for each one */
+uint8_t *packImage(const uint8_t *image, int imageSize, int *pPackedSize)
+{
+    int packetCount = (imageSize + DEF_PACKET_SIZE - 1) / DEF_PACKET_SIZE;
+    int offset, cnt = 0;
+    uint8_t *records;
+    
+    if (!(records = (uint8_t *)malloc(imageSize + packetCount * RECORD_HEADER_SIZE))) {
+        printf("error: insufficient memory\n");
+        return NULL;
+    }
+    
+    for (offset = 0; offset < imageSize; offset += DEF_PACKET_SIZE) {
+        int size = imageSize - offset < DEF_PACKET_SIZE ? imageSize - offset : DEF_PACKET_SIZE;
+        cnt += PackRecord(&image[offset], size, &records[cnt]);
+    }
+    
+    *pPackedSize = cnt;
+    return records;
+}
+
+/* responseCode - get the status code from an HTTP response */
+int responseCode(const uint8_t *res, int cnt)
+{
+    const char *p = (const char *)res;
+    if (cnt < 12 || strncmp(p, "HTTP/", 5) != 0 || !(p = strchr(p, ' ')))
+        return -1;
+    return atoi(p + 1);
+}
+
+/* printStats - fetch the timing of a module's last load from /stats and show it */
+int printStats(SOCKADDR_IN *addr, const char *name)
+{
+    static const char req[] = "GET /stats HTTP/1.1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    uint8_t res[MAX_RESPONSE_SIZE];
+    SOCKET sock = INVALID_SOCKET;
+    int saveVerbose = verbose;
+    char *body, *line, *next;
+    int cnt;
+    
+    verbose = 0;
+    cnt = sendRequest(addr, &sock, (uint8_t *)req, sizeof(req) - 1, res, sizeof(res) - 1);
+    verbose = saveVerbose;
+    if (sock != INVALID_SOCKET)
+        CloseSocket(sock);
+    if (cnt == -1 || responseCode(res, cnt) != 200) {
+        printf("%s: no load stats\n", name);
+        return -1;
+    }
+    
+    res[cnt] = '\0';
+    if (!(body = strstr((char *)res, "\r\n\r\n")))
+        return -1;
+    for (line = body + 4; *line; line = next) {
+        if ((next = strchr(line, '\n')) != NULL)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+        printf("%s: %s\n", name, line);
+    }
+    
+    return 0;
+}
+
+/* msTimer - get a millisecond timestamp for measuring elapsed time */
+unsigned long msTimer()
+{
+#ifdef __MINGW32__
+    return GetTickCount();
+#else
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
     
 void dumpHdr(const uint8_t *buf, int size)
 {
@@ -240,68 +1197,121 @@ void dumpHdr(const uint8_t *buf, int size)
     putchar('\n');
 }
 
-int discover(XbeeAddrList &addrs, int timeout)
+/* discover - broadcast on every interface at once and collect the modules that answer
+    returns early once 'maxCount' modules have answered or none has answered for DISCOVER_QUIET_TIME
+*/
+int discover(ModuleList &modules, int timeout, int maxCount)
 {
     IFADDR ifaddrs[MAX_IF_ADDRS];
-    int cnt, i;
-    
-    if ((cnt = GetInterfaceAddresses(ifaddrs, MAX_IF_ADDRS)) < 0)
-        return -1;
-    
-    for (i = 0; i < cnt; ++i) {
-        int ret;
-        if ((ret = discover1(&ifaddrs[i], addrs, timeout)) < 0)
-            return ret;
-    }
-    
-    return 0;
-}
-
-int discover1(IFADDR *ifaddr, XbeeAddrList &addrs, int timeout)
-{
-    uint8_t txBuf[1024]; // BUG: get rid of this magic number!
-    uint8_t rxBuf[1024]; // BUG: get rid of this magic number!
+    uint8_t rxBuf[MAX_REPLY_SIZE];
+    const char *txBuf = DISCOVER_MESSAGE;
+    unsigned long start, lastReply;
     SOCKADDR_IN bcastaddr;
     SOCKADDR_IN addr;
     SOCKET sock;
-    int cnt;
+    int ifCount, cnt, i;
     
-    /* create a broadcast socket */
-    if (OpenBroadcastSocket(DEF_DISCOVER_PORT, &sock) != 0) {
+    modules.count = 0;
+    if ((ifCount = GetInterfaceAddresses(ifaddrs, MAX_IF_ADDRS)) < 0)
+        return -1;
+    
+    /* create a broadcast socket on any free port so our own broadcasts don't come back to us */
+    if (OpenBroadcastSocket(0, &sock) != 0) {
         printf("error: OpenBroadcastSocket failed\n");
         return -2;
     }
         
-    /* build a broadcast address */
-    bcastaddr = ifaddr->bcast;
-    bcastaddr.sin_port = htons(DEF_DISCOVER_PORT);
-    
-    /* send the broadcast packet */
-    sprintf((char *)txBuf, "Me here! Ignore this message.\n");
-    if ((cnt = SendSocketDataTo(sock, txBuf, sizeof(txBuf), &bcastaddr)) != sizeof(txBuf)) {
-        perror("error: SendSocketDataTo failed");
-        CloseSocket(sock);
-        return -1;
+    /* send the broadcast packet on every interface */
+    for (i = 0; i < ifCount; ++i) {
+        bcastaddr = ifaddrs[i].bcast;
+        bcastaddr.sin_port = htons(DEF_DISCOVER_PORT);
+        if (SendSocketDataTo(sock, (void *)txBuf, strlen(txBuf), &bcastaddr) != (int)strlen(txBuf))
+            printf("warning: broadcast on %s failed\n", AddressToString(&ifaddrs[i].addr));
     }
 
-    /* receive Xbee responses */
-    while (SocketDataAvailableP(sock, timeout)) {
+    /* collect responses until the timeout, a quiet period or enough modules */
+    start = lastReply = msTimer();
+    while (modules.count < maxCount) {
+        unsigned long now = msTimer();
+        long wait = (long)(start + timeout - now);
+        if (modules.count > 0 && (long)(lastReply + DISCOVER_QUIET_TIME - now) < wait)
+            wait = (long)(lastReply + DISCOVER_QUIET_TIME - now);
+        if (wait <= 0 || !SocketDataAvailableP(sock, (int)wait))
+            break;
 
         /* get the next response */
-        memset(rxBuf, 0, sizeof(rxBuf));
-        if ((cnt = ReceiveSocketDataAndAddress(sock, rxBuf, sizeof(rxBuf), &addr)) < 0) {
+        if ((cnt = ReceiveSocketDataAndAddress(sock, rxBuf, sizeof(rxBuf) - 1, &addr)) < 0) {
             printf("error: ReceiveSocketData failed\n");
             CloseSocket(sock);
             return -3;
         }
+        rxBuf[cnt] = '\0';
         
-        printf("from %s got: %s", AddressToString(&addr), rxBuf);
+        /* remember each module once */
+        for (i = 0; i < modules.count; ++i) {
+            if (modules.modules[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr)
+                break;
+        }
+        if (i == modules.count) {
+            modules.modules[i].addr = addr;
+            snprintf(modules.modules[i].reply, sizeof(modules.modules[i].reply), "%s", (char *)rxBuf);
+            parseDiscoverReply(&modules.modules[i]);
+            ++modules.count;
+            lastReply = msTimer();
+        }
     }
     
     /* close the socket */
     CloseSocket(sock);
     
-    /* return successfully */
-    return 0;
+    /* return the number of modules found */
+    return modules.count;
+}
+
+/* parseDiscoverReply - pick out the key=value lines that follow the first line of a discovery reply */
+void parseDiscoverReply(Module *module)
+{
+    const char *p = module->reply, *value, *end;
+    int len;
+    
+    module->mac[0] = module->version[0] = module->images[0] = '\0';
+    module->resetPin = module->maxPacketSize = module->finalBaudRate = -1;
+    module->busy = 0;
+    
+    while ((p = strchr(p, '\n')) != NULL) {
+        ++p;
+        if (!(value = strchr(p, '=')))
+            break;
+        ++value;
+        if (!(end = strchr(value, '\n')))
+            end = value + strlen(value);
+        len = (int)(end - value);
+        if (strncmp(p, "mac=", 4) == 0)
+            snprintf(module->mac, sizeof(module->mac), "%.*s", len, value);
+        else if (strncmp(p, "version=", 8) == 0)
+            snprintf(module->version, sizeof(module->version), "%.*s", len, value);
+        else if (strncmp(p, "reset-pin=", 10) == 0)
+            module->resetPin = atoi(value);
+        else if (strncmp(p, "max-packet-size=", 16) == 0)
+            module->maxPacketSize = atoi(value);
+        else if (strncmp(p, "final-baud-rate=", 16) == 0)
+            module->finalBaudRate = atoi(value);
+        else if (strncmp(p, "images=", 7) == 0)
+            snprintf(module->images, sizeof(module->images), "%.*s", len, value);
+        else if (strncmp(p, "state=", 6) == 0)
+            module->busy = strncmp(value, "busy", 4) == 0;
+    }
 }
 
+/* moduleHasImage - check whether a module's discovery reply lists an image in its cache */
+int moduleHasImage(Module *module, const char *hashText)
+{
+    const char *p = module->images;
+    int len = (int)strlen(hashText);
+    while ((p = strstr(p, hashText)) != NULL) {
+        if ((p == module->images || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
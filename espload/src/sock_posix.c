@@ -11,6 +11,8 @@
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <errno.h>
 #endif
 
 #include "sock.h"
@@ -132,6 +134,67 @@ int ConnectSocket(SOCKADDR_IN *addr, SOCKET *pSocket)
     return 0;
 }
 
+/* ConnectSocketNonBlocking - start connecting a non-blocking socket to the server */
+int ConnectSocketNonBlocking(SOCKADDR_IN *addr, SOCKET *pSocket)
+{
+    SOCKET sock;
+#ifdef __MINGW32__
+    u_long nonBlocking = 1;
+
+    if (InitWinSock() != 0)
+        return -1;
+#endif
+
+    /* create the socket */
+    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        return -1;
+
+    /* make it non-blocking */
+#ifdef __MINGW32__
+    if (ioctlsocket(sock, FIONBIO, &nonBlocking) != 0) {
+#else
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) != 0) {
+#endif
+        closesocket(sock);
+        return -1;
+    }
+
+    /* start the connection; it completes when the socket becomes writable */
+    if (connect(sock, (SOCKADDR *)addr, sizeof(*addr)) != 0 && !SocketWouldBlock()) {
+        closesocket(sock);
+        return -1;
+    }
+
+    /* return the socket */
+    *pSocket = sock;
+    return 0;
+}
+
+/* SocketConnectResult - check whether a non-blocking connect succeeded once the socket is writable */
+int SocketConnectResult(SOCKET sock)
+{
+    int error = 0;
+#ifdef __MINGW32__
+    int len = sizeof(error);
+#else
+    socklen_t len = sizeof(error);
+#endif
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &len) != 0)
+        return -1;
+    return error == 0 ? 0 : -1;
+}
+
+/* SocketWouldBlock - check whether the last operation on a non-blocking socket failed only because it would block */
+int SocketWouldBlock(void)
+{
+#ifdef __MINGW32__
+    int error = WSAGetLastError();
+    return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS;
+#else
+    return errno == EWOULDBLOCK || errno == EAGAIN || errno == EINPROGRESS;
+#endif
+}
+
 /* BindSocket - bind a socket to a port */
 int BindSocket(short port, SOCKET *pSocket)
 {
@@ -0,0 +1,90 @@
+#ifndef __ESP8266WIFI_H__
+#define __ESP8266WIFI_H__
+
+// host stand-ins for the parts of the ESP8266 WiFi library that busyservice.cpp uses; each
+// connection is a SimSocket that a test writes requests into and reads responses from
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SIM_SOCKET_BUFFER_SIZE  1024
+#define SIM_SERVER_BACKLOG      8
+
+// one TCP connection as seen from both ends
+struct SimSocket {
+    char input[SIM_SOCKET_BUFFER_SIZE];     // bytes sent by the client
+    int inputCount;
+    int readCount;                          // number of input bytes the module has read
+    char output[SIM_SOCKET_BUFFER_SIZE];    // bytes sent by the module
+    int outputCount;
+    bool clientClosed;                      // the client has closed its end
+    bool stopped;                           // the module has closed its end
+
+    SimSocket() { reset(); }
+    void reset() { inputCount = readCount = outputCount = 0; clientClosed = stopped = false; output[0] = '\0'; }
+    void send(const char *text) {
+        int cnt = strlen(text);
+        if (cnt > SIM_SOCKET_BUFFER_SIZE - inputCount)
+            cnt = SIM_SOCKET_BUFFER_SIZE - inputCount;
+        memcpy(&input[inputCount], text, cnt);
+        inputCount += cnt;
+    }
+};
+
+// the module's end of a SimSocket; like WiFiClient it is a handle that can be copied
+class WiFiClient
+{
+public:
+    WiFiClient() : m_socket(NULL) {}
+    WiFiClient(SimSocket *socket) : m_socket(socket) {}
+    int available() { return m_socket && !m_socket->stopped ? m_socket->inputCount - m_socket->readCount : 0; }
+    int read() { return available() > 0 ? (uint8_t)m_socket->input[m_socket->readCount++] : -1; }
+    size_t write(const uint8_t *buf, size_t size) {
+        if (!m_socket || m_socket->stopped || m_socket->clientClosed)
+            return 0;
+        if (size > (size_t)(SIM_SOCKET_BUFFER_SIZE - 1 - m_socket->outputCount))
+            size = SIM_SOCKET_BUFFER_SIZE - 1 - m_socket->outputCount;
+        memcpy(&m_socket->output[m_socket->outputCount], buf, size);
+        m_socket->outputCount += size;
+        m_socket->output[m_socket->outputCount] = '\0';
+        return size;
+    }
+    size_t print(const char *text) { return write((const uint8_t *)text, strlen(text)); }
+    uint8_t connected() { return m_socket && !m_socket->stopped && !m_socket->clientClosed; }
+    void stop() { if (m_socket) m_socket->stopped = true; }
+    operator bool() { return available() > 0 || connected(); }
+
+private:
+    SimSocket *m_socket;
+};
+
+// a listening socket with a backlog of clients that have connected but not been accepted
+class WiFiServer
+{
+public:
+    WiFiServer(int port) : m_count(0) { (void)port; }
+    bool hasClient() { return m_count > 0; }
+    WiFiClient available() {
+        if (m_count == 0)
+            return WiFiClient();
+        SimSocket *socket = m_backlog[0];
+        memmove(&m_backlog[0], &m_backlog[1], --m_count * sizeof(m_backlog[0]));
+        return WiFiClient(socket);
+    }
+    bool connect(SimSocket *socket) {
+        if (m_count >= SIM_SERVER_BACKLOG)
+            return false;
+        m_backlog[m_count++] = socket;
+        return true;
+    }
+
+private:
+    SimSocket *m_backlog[SIM_SERVER_BACKLOG];
+    int m_count;
+};
+
+// supplied by the test so it controls the clock
+unsigned long millis();
+
+#endif
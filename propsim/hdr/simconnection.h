@@ -0,0 +1,42 @@
+#ifndef __SIMCONNECTION_H__
+#define __SIMCONNECTION_H__
+
+#include "propconnection.h"
+#include "simpropeller.h"
+
+// size of the ESP8266 UART transmit FIFO
+#define SIM_TX_FIFO_SIZE    128
+
+// longest stretch of virtual time a wait runs before calling the idle handler
+#define SIM_IDLE_INTERVAL   1000.0
+
+// virtual time charged for each call to the idle handler, about what the firmware takes to
+// check for discovery requests and waiting clients when there are none
+#define SIM_IDLE_TIME       100.0
+
+// connection to a simulated Propeller that runs on a virtual clock instead of in real time
+class SimPropellerConnection : public PropellerConnection
+{
+public:
+    SimPropellerConnection(SimPropeller &propeller);
+    ~SimPropellerConnection() {}
+    int generateResetSignal();
+    int sendData(uint8_t *buffer, int size);
+    int receiveDataExactTimeout(uint8_t *buffer, int size, int timeout);
+    unsigned long microseconds() { return (unsigned long)m_now; }
+    double now() { return m_now; }
+    int bytesCorrupted() { return m_bytesCorrupted; }
+    void setIdleTime(double us) { m_idleTime = us; }
+
+private:
+    void pause(double us);
+    void serviceIdle();
+
+    SimPropeller &m_propeller;
+    double m_now;
+    double m_txFree;
+    double m_idleTime;
+    int m_bytesCorrupted;
+};
+
+#endif
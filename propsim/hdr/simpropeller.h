@@ -0,0 +1,187 @@
+#ifndef __SIMPROPELLER_H__
+#define __SIMPROPELLER_H__
+
+#include <stdint.h>
+
+/* size of Propeller hub RAM and of the boot EEPROM image */
+#define SIM_RAM_SIZE        32768
+
+/* a byte on one of the serial lines; all times are in microseconds */
+typedef struct {
+    double start;       // time at which the start bit begins
+    double time;        // time at which the stop bit ends
+    int baudRate;       // baud rate used by the sender
+    uint8_t data;
+} SimByte;
+
+class SimByteQueue
+{
+public:
+    SimByteQueue();
+    ~SimByteQueue();
+    void push(const SimByte &byte);
+    SimByte &front() { return m_bytes[m_head]; }
+    void pop();
+    void clear() { m_head = m_count = 0; }
+    bool empty() { return m_count == 0; }
+    int count() { return m_count; }
+private:
+    SimByte *m_bytes;
+    int m_size;
+    int m_head;
+    int m_count;
+};
+
+/* simulation parameters */
+typedef struct {
+    double clockSpeed;          // actual Propeller clock frequency in Hz
+    int maxBaudRate;            // highest baud rate the wiring carries reliably
+    double romChecksumTime;     // time the ROM booter takes to checksum RAM
+    double launchTime;          // time from the ROM's final ack to the loaded program running
+    double ackLatency;          // second-stage overhead from end of packet to start of its ack
+    double eepromProgramTime;   // time the ROM booter takes to program the whole EEPROM
+    double eepromVerifyTime;    // time the ROM booter takes to read back and verify the whole EEPROM
+    double eepromWriteTime;     // EEPROM page write cycle time
+    int eepromClockRate;        // I2C clock rate the host sets the second-stage loader's EEPROM timing for
+    int windowSize;             // > 1 to model a second-stage loader that buffers this many packets
+    int packetSize;             // payload size of full packets (the host and a windowed loader must agree)
+    bool decompress;            // model a second-stage loader that takes data packets as compressed records
+    int dropInterval;           // drop every nth packet received by the second stage (0 for none)
+} SimConfig;
+
+void SimDefaultConfig(SimConfig *config);
+
+/* moments in a load that the simulator timestamps */
+enum SimEvent {
+    seResetReleased,
+    seHandshake,
+    seRomImage,
+    seRomChecksum,
+    seRomProgram,
+    seRomVerify,
+    seLoaderReady,
+    seFirstPacket,
+    seLastPacket,
+    seVerifyRAM,
+    seProgramEEPROM,
+    seReadyToLaunch,
+    seLaunch,
+    seCount
+};
+
+extern const char *SimEventNames[seCount];
+
+typedef struct {
+    double eventTime[seCount];  // time of each event or a negative value if it hasn't happened
+    int packetsReceived;        // packets completely received by the second stage
+    int packetsDropped;         // packets dropped by dropInterval or for lack of buffer space
+    int packetsRejected;        // packets negatively acknowledged
+    int recordBytes;            // bytes of data packet records received by a decompressing loader
+    int recordDataBytes;        // bytes of data they unpacked to
+    int bytesLost;              // bytes that arrived while the second stage wasn't listening
+    int bytesCorrupted;         // bytes garbled by a baud rate mismatch
+} SimStats;
+
+/* a Propeller with its ROM booter, running either IP_Loader.spin or a downloaded program */
+class SimPropeller
+{
+public:
+    SimPropeller(const SimConfig &config);
+    ~SimPropeller();
+    void reset(double time);
+    void release(double time);
+    void receive(const SimByte &byte);
+    double nextEventTime();
+    void advance(double time);
+    bool outputAvailable() { return !m_output.empty(); }
+    SimByte &output() { return m_output.front(); }
+    void consumeOutput() { m_output.pop(); }
+    void clearOutput(double time);
+    bool running() { return m_state == psRunning; }
+    const uint8_t *ram() { return m_ram; }
+    const uint8_t *eeprom() { return m_eeprom; }
+    const SimStats &stats() { return m_stats; }
+
+private:
+    enum State {
+        psReset,            // held in reset
+        psHandshake,        // ROM: receiving the tx handshake
+        psTemplates,        // ROM: answering timing templates with the rx handshake and version
+        psCommand,          // ROM: receiving the command long
+        psLength,           // ROM: receiving the image length in longs
+        psImage,            // ROM: receiving the image
+        psChecksum,         // ROM: waiting to report the checksum
+        psProgram,          // ROM: waiting to report EEPROM programming
+        psVerify,           // ROM: waiting to report EEPROM verification
+        psLaunching,        // waiting for the loaded program to start
+        psLoader,           // IP_Loader.spin: receiving packets
+        psRunning,          // the downloaded application is running
+        psShutdown          // the ROM gave up or the loader failed
+    };
+
+    void processRomByte(const SimByte &byte);
+    void romBit(int bit, const SimByte &byte);
+    void romTemplate(int bit, const SimByte &byte);
+    void romImageDone(double time);
+    void processLoaderByte(const SimByte &byte);
+    void packetDone(double time);
+    int unpackPacket(int size);
+    double executePacket(const uint8_t *code, int size, double time);
+    void launchProgram(double time);
+    void startLoader(double time);
+    void sendAck(int32_t tag, double time, double bitTime);
+    void sendByte(uint8_t data, double time, double bitTime);
+    void event(SimEvent event, double time);
+    void shutdown(const char *reason);
+    bool corrupted(const SimByte &byte, double bitTime);
+    double timerTime();
+
+    static uint32_t getLong(const uint8_t *buf);
+    static void setLong(uint8_t *buf, uint32_t value);
+
+    SimConfig m_config;
+    SimStats m_stats;
+    State m_state;
+    SimByteQueue m_input;
+    SimByteQueue m_output;
+    double m_now;
+    double m_txFree;
+
+    /* ROM booter state */
+    uint8_t m_lfsr;
+    int m_bitCount;
+    uint32_t m_long;
+    int m_templates;
+    uint32_t m_command;
+    uint32_t m_imageLongs;
+    uint32_t m_longCount;
+    double m_romBitTime;
+    double m_readyTime;
+    bool m_checksumOK;
+
+    /* second-stage loader state */
+    uint8_t m_packet[2048];
+    uint8_t m_unpacked[2048];
+    int m_packetSize;
+    double m_initialBitTime;
+    double m_finalBitTime;
+    double m_failsafeTimeout;
+    double m_endOfPacketTimeout;
+    double m_eepromBitTime;
+    double m_eopTime;
+    double m_failsafeTime;
+    double m_launchTime;
+    double m_busyUntil;
+    int32_t m_expectedID;
+    int32_t m_packetCount;
+    int32_t m_checksum;
+    uint32_t m_memAddr;
+    bool m_readyToLaunch;
+    uint8_t m_received[SIM_RAM_SIZE / 4 + 1];
+    int m_dropCounter;
+
+    uint8_t m_ram[SIM_RAM_SIZE];
+    uint8_t m_eeprom[SIM_RAM_SIZE];
+};
+
+#endif
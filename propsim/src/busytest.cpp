@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include "busyservice.h"
+#include "simpropeller.h"
+#include "simconnection.h"
+#include "fastproploader.h"
+#include "propimage.h"
+
+#define LOAD_IMAGE_SIZE     8192        /* size of the image loaded while clients arrive */
+#define LOAD_CLIENTS        8           /* clients that arrive during the load */
+#define LOAD_CLIENT_GAP     50          /* milliseconds between their arrivals */
+#define LOAD_IDLE_TIME      2000.0      /* microseconds charged for each idle call, about what answering a client takes */
+#define LAUNCH_WAIT         5000000.0   /* how long to run the Propeller after the last packet */
+#define SPLIT_INTERVAL      300         /* milliseconds between the two halves of a request */
+#define MAX_SOCKETS         32          /* connections made by the checks that don't load */
+
+ResponseLevel responseVerbosity = rlError;
+
+/* the clock the busy service reads: a counter the checks advance or the simulated load's virtual time */
+unsigned long clockMillis;
+SimPropellerConnection *clockConnection = NULL;
+
+WiFiServer server(80);
+BusyService busyService(server);
+int statusCount;
+
+/* clients that arrive during the simulated load */
+SimSocket loadSockets[LOAD_CLIENTS];
+double loadArrival[LOAD_CLIENTS];
+double loadAnswer[LOAD_CLIENTS];
+int loadConnected;
+
+/* a busy service keeps handles to the clients it has answered, so a socket is never reused */
+SimSocket sockets[MAX_SOCKETS];
+int socketCount;
+
+int failures = 0;
+
+SimSocket *newSocket();
+void sendStatus(WiFiClient &client, bool keepOpen);
+void serviceWhileBusy();
+void loadIdleHandler();
+void checkStatusInPieces();
+void checkBusy();
+void checkBadRequest();
+void checkFull();
+void checkTimeout();
+void checkClientGone();
+void checkDuringLoad(int romOnly, int windowSize);
+void check(bool condition, const char *fmt, ...);
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        printf("usage: busytest\n");
+        return 1;
+    }
+
+    busyService.setStatusSender(sendStatus);
+
+    checkStatusInPieces();
+    checkBusy();
+    checkBadRequest();
+    checkFull();
+    checkTimeout();
+    checkClientGone();
+    checkDuringLoad(1, 0);
+    checkDuringLoad(0, 1);
+    checkDuringLoad(0, MAX_WINDOW_SIZE);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
+
+SimSocket *newSocket()
+{
+    if (socketCount >= MAX_SOCKETS) {
+        printf("error: out of sockets\n");
+        exit(1);
+    }
+    return &sockets[socketCount++];
+}
+
+unsigned long millis()
+{
+    return clockConnection ? (unsigned long)(clockConnection->now() / 1000.0) : clockMillis;
+}
+
+void sendStatus(WiFiClient &client, bool keepOpen)
+{
+    client.print("HTTP/1.1 200 OK\r\nContent-Length: 11\r\nConnection: close\r\n\r\nstate=busy\n");
+    check(!keepOpen, "status sent with the connection kept open");
+    ++statusCount;
+}
+
+/* serviceWhileBusy
+    what the firmware's ServiceWhileBusy does apart from discovery
+*/
+void serviceWhileBusy()
+{
+    busyService.acceptClients();
+    busyService.serviceClients();
+}
+
+/* checkStatusInPieces
+    a status request that arrives over two idle calls is answered once its request line is complete
+*/
+void checkStatusInPieces()
+{
+    SimSocket *socket = newSocket();
+
+    clockMillis = 0;
+    statusCount = 0;
+    server.connect(socket);
+    socket->send("GET /sta");
+    serviceWhileBusy();
+    check(!socket->stopped && socket->outputCount == 0, "status answered before its request line was complete");
+    check(busyService.waitingCount() == 1, "client not waiting for the rest of its request");
+
+    clockMillis += SPLIT_INTERVAL;
+    socket->send("tus HTTP/1.1\r\nHost: module\r\n\r\n");
+    serviceWhileBusy();
+    check(socket->stopped && statusCount == 1 && strncmp(socket->output, "HTTP/1.1 200 OK", 15) == 0, "status request not answered");
+    check(busyService.waitingCount() == 0, "answered client still waiting");
+}
+
+/* checkBusy
+    anything other than a status request is turned away with 503 Busy
+*/
+void checkBusy()
+{
+    static const char *requests[] = {
+        "POST /run HTTP/1.1\r\nContent-Length: 100\r\n\r\n",
+        "GET /stats HTTP/1.1\r\n\r\n",
+        "POST /status HTTP/1.1\r\n\r\n"
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+        SimSocket *socket = newSocket();
+        clockMillis = 0;
+        statusCount = 0;
+        server.connect(socket);
+        socket->send(requests[i]);
+        serviceWhileBusy();
+        check(socket->stopped && statusCount == 0 && strncmp(socket->output, "HTTP/1.1 503 Busy", 17) == 0, "request %u not answered with 503", i);
+    }
+}
+
+/* checkBadRequest
+    a request line the parser rejects is turned away rather than left waiting
+*/
+void checkBadRequest()
+{
+    char line[HTTP_MAX_REQUEST_LINE + 1];
+    SimSocket *socket = newSocket();
+
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+
+    clockMillis = 0;
+    server.connect(socket);
+    socket->send(line);
+    serviceWhileBusy();
+    check(socket->stopped && strncmp(socket->output, "HTTP/1.1 503 Busy", 17) == 0, "overlong request line not answered with 503");
+    check(busyService.waitingCount() == 0, "rejected client still waiting");
+}
+
+/* checkFull
+    a client that arrives while every slot is taken is closed, and the slots are reused once answered
+*/
+void checkFull()
+{
+    SimSocket *clients[MAX_WAITING_CLIENTS + 1], *late;
+    int i;
+
+    clockMillis = 0;
+    for (i = 0; i < MAX_WAITING_CLIENTS + 1; ++i)
+        server.connect(clients[i] = newSocket());
+    serviceWhileBusy();
+    check(busyService.waitingCount() == MAX_WAITING_CLIENTS, "%d clients waiting instead of %d", busyService.waitingCount(), MAX_WAITING_CLIENTS);
+    for (i = 0; i < MAX_WAITING_CLIENTS; ++i)
+        check(!clients[i]->stopped, "client %d closed while a slot was free", i);
+    check(clients[MAX_WAITING_CLIENTS]->stopped && clients[MAX_WAITING_CLIENTS]->outputCount == 0, "client beyond the slots not closed");
+
+    for (i = 0; i < MAX_WAITING_CLIENTS; ++i)
+        clients[i]->send("GET /status HTTP/1.1\r\n");
+    serviceWhileBusy();
+    for (i = 0; i < MAX_WAITING_CLIENTS; ++i)
+        check(clients[i]->stopped && clients[i]->outputCount > 0, "client %d not answered", i);
+
+    server.connect(late = newSocket());
+    late->send("GET /status HTTP/1.1\r\n");
+    serviceWhileBusy();
+    check(late->stopped && late->outputCount > 0, "freed slot not reused");
+}
+
+/* checkTimeout
+    a client that doesn't send its request line in time is closed without an answer
+*/
+void checkTimeout()
+{
+    SimSocket *socket = newSocket();
+
+    clockMillis = 1000000;
+    server.connect(socket);
+    socket->send("GET /status");
+    serviceWhileBusy();
+
+    clockMillis += WAITING_CLIENT_TIMEOUT - 1;
+    busyService.serviceClients();
+    check(!socket->stopped, "client closed before its time was up");
+
+    clockMillis += 1;
+    busyService.serviceClients();
+    check(socket->stopped && socket->outputCount == 0, "silent client not closed after %d ms", WAITING_CLIENT_TIMEOUT);
+    check(busyService.waitingCount() == 0, "timed out client still waiting");
+}
+
+/* checkClientGone
+    a client that closes its end before sending anything frees its slot
+*/
+void checkClientGone()
+{
+    SimSocket *socket = newSocket();
+
+    clockMillis = 0;
+    server.connect(socket);
+    serviceWhileBusy();
+    check(busyService.waitingCount() == 1, "client not given a slot");
+    socket->clientClosed = true;
+    serviceWhileBusy();
+    check(busyService.waitingCount() == 0, "closed client still holds a slot");
+}
+
+/* checkDuringLoad
+    loads a simulated Propeller while clients connect and checks that the load succeeds and each
+    client is answered before it would time out; with 'romOnly' the image is sent with the ROM boot
+    protocol at the initial baud rate, otherwise through the second-stage loader
+*/
+void checkDuringLoad(int romOnly, int windowSize)
+{
+    char name[64];
+    static uint8_t image[LOAD_IMAGE_SIZE];
+    PropellerImage header(image, LOAD_IMAGE_SIZE);
+    SimConfig config;
+    double longestWait = 0.0;
+    int result, answered = 0, i;
+
+    /* random code behind a header the loaders and the simulated Propeller accept */
+    srand(1);
+    for (i = 0; i < LOAD_IMAGE_SIZE; ++i)
+        image[i] = rand();
+    header.setWord(offsetof(SpinHdr, pbase), 0x0010);
+    header.setWord(offsetof(SpinHdr, vbase), LOAD_IMAGE_SIZE);
+    header.setWord(offsetof(SpinHdr, dbase), LOAD_IMAGE_SIZE + 8);
+    header.updateChecksum();
+
+    SimDefaultConfig(&config);
+    config.windowSize = windowSize;
+    SimPropeller propeller(config);
+    SimPropellerConnection connection(propeller);
+    FastPropellerLoader loader(connection);
+
+    /* the first client arrives a little after the reset and the rest follow at regular intervals */
+    for (i = 0; i < LOAD_CLIENTS; ++i) {
+        loadSockets[i].reset();
+        loadSockets[i].send(i & 1 ? "POST /run HTTP/1.1\r\n\r\n" : "GET /status HTTP/1.1\r\n\r\n");
+        loadArrival[i] = (i + 1) * LOAD_CLIENT_GAP * 1000.0;
+        loadAnswer[i] = -1.0;
+    }
+    loadConnected = 0;
+
+    clockConnection = &connection;
+    connection.setIdleTime(LOAD_IDLE_TIME);
+    connection.setIdleHandler(loadIdleHandler);
+    if (romOnly) {
+        PropellerLoader romLoader(connection);
+        connection.setBaudRate(INITIAL_BAUD_RATE);
+        result = romLoader.load(image, LOAD_IMAGE_SIZE, ltDownloadAndRun);
+    }
+    else {
+        result = loader.loadBegin(LOAD_IMAGE_SIZE, INITIAL_BAUD_RATE, FINAL_BAUD_RATE, windowSize);
+        if (result == 0)
+            result = loader.loadData(image, LOAD_IMAGE_SIZE);
+        if (result == 0)
+            result = loader.loadEnd(ltDownloadAndRun);
+    }
+
+    /* let time pass the way a wait on the Propeller does until the last client has been answered */
+    while (connection.now() < loadArrival[LOAD_CLIENTS - 1] + WAITING_CLIENT_TIMEOUT * 1000.0) {
+        connection.receiveDataExactTimeout(image, 1, 1);
+        if (busyService.waitingCount() == 0 && loadConnected == LOAD_CLIENTS)
+            break;
+    }
+    connection.setIdleHandler(NULL);
+    clockConnection = NULL;
+    propeller.advance(connection.now() + LAUNCH_WAIT);
+
+    if (romOnly)
+        snprintf(name, sizeof(name), "rom load");
+    else
+        snprintf(name, sizeof(name), "load with a window of %d", windowSize);
+    check(result == 0 && propeller.stats().eventTime[seLaunch] >= 0.0 && memcmp(propeller.ram(), image, LOAD_IMAGE_SIZE) == 0,
+          "%s failed while clients were being serviced", name);
+    for (i = 0; i < LOAD_CLIENTS; ++i) {
+        const char *expected = i & 1 ? "HTTP/1.1 503 Busy" : "HTTP/1.1 200 OK";
+        if (loadAnswer[i] >= 0.0 && strncmp(loadSockets[i].output, expected, strlen(expected)) == 0) {
+            if (loadAnswer[i] - loadArrival[i] > longestWait)
+                longestWait = loadAnswer[i] - loadArrival[i];
+            ++answered;
+        }
+        else
+            check(false, "client %d not answered during the %s", i, name);
+    }
+    check(longestWait < WAITING_CLIENT_TIMEOUT * 1000.0, "client waited %.3f ms", longestWait / 1000.0);
+    printf("%s: %d of %d clients answered, longest wait %.3f ms\n",
+           name, answered, LOAD_CLIENTS, longestWait / 1000.0);
+}
+
+/* loadIdleHandler
+    connects the clients whose time has come, services them and notes when each is answered
+*/
+void loadIdleHandler()
+{
+    double now = clockConnection->now();
+    int i;
+
+    while (loadConnected < LOAD_CLIENTS && loadArrival[loadConnected] <= now)
+        server.connect(&loadSockets[loadConnected++]);
+
+    serviceWhileBusy();
+
+    for (i = 0; i < loadConnected; ++i) {
+        if (loadAnswer[i] < 0.0 && loadSockets[i].stopped)
+            loadAnswer[i] = now;
+    }
+}
+
+void check(bool condition, const char *fmt, ...)
+{
+    va_list ap;
+    if (!condition) {
+        printf("error: ");
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        putchar('\n');
+        ++failures;
+    }
+}
+
+void AppendResponseText(ResponseLevel level, const char *fmt, ...)
+{
+    va_list ap;
+    if (level <= responseVerbosity) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        putchar('\n');
+        va_end(ap);
+    }
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+// the encoder and its translation tables are private to proploader.cpp
+#include "proploader.cpp"
+
+#define MAX_IMAGE_SIZE      32768       /* largest image the ROM loader accepts */
+#define MAX_STREAM_SIZE     (MAX_IMAGE_SIZE * 8 + 16)
+
+ResponseLevel responseVerbosity = rlError;
+
+static int encode5(const uint8_t *image, int imageSize, uint8_t *stream);
+static int encodeChunked(const uint8_t *image, int imageSize, int chunkSize, uint8_t *stream, int streamMax);
+static double seconds();
+static char *nextArg(int argc, char *argv[], int *pi);
+static void Usage();
+
+int main(int argc, char *argv[])
+{
+    int maxSize = MAX_IMAGE_SIZE;
+    int step = 1;
+    uint8_t *image, *expected, *actual;
+    double t, time5 = 0.0, time10 = 0.0;
+    long long totalBytes = 0;
+    int failures = 0, size, i;
+
+    /* get the arguments */
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-')
+            Usage();
+        switch(argv[i][1]) {
+        case 'm':
+            maxSize = atoi(nextArg(argc, argv, &i));
+            break;
+        case 's':
+            step = atoi(nextArg(argc, argv, &i));
+            break;
+        case '?':
+            /* fall through */
+        default:
+            Usage();
+            break;
+        }
+    }
+
+    if (maxSize < 1 || maxSize > MAX_IMAGE_SIZE || step < 1) {
+        printf("error: sizes must be between 1 and %d\n", MAX_IMAGE_SIZE);
+        return 1;
+    }
+
+    if (!(image = (uint8_t *)malloc(MAX_IMAGE_SIZE))
+    ||  !(expected = (uint8_t *)malloc(MAX_STREAM_SIZE))
+    ||  !(actual = (uint8_t *)malloc(MAX_STREAM_SIZE))) {
+        printf("error: out of memory\n");
+        return 1;
+    }
+
+    /* use the same pseudo-random image every run */
+    srand(1);
+    for (i = 0; i < MAX_IMAGE_SIZE; ++i)
+        image[i] = rand();
+
+    for (size = 1; size <= maxSize; size += step) {
+        int expectedSize, actualSize;
+
+        /* the five bit translation is the reference */
+        t = seconds();
+        expectedSize = encode5(image, size, expected);
+        time5 += seconds() - t;
+
+        /* the ten bit translation with the whole image at hand */
+        t = seconds();
+        actualSize = PropellerLoader::encodeImage(image, size, actual, MAX_STREAM_SIZE);
+        time10 += seconds() - t;
+        totalBytes += size;
+
+        if (actualSize != expectedSize || memcmp(actual, expected, expectedSize) != 0) {
+            printf("error: encodeImage differs for a %d byte image\n", size);
+            ++failures;
+            continue;
+        }
+
+        /* the ten bit translation fed a READ_BUFFER_SIZE chunk at a time as an ImageReader would */
+        actualSize = encodeChunked(image, size, READ_BUFFER_SIZE, actual, MAX_STREAM_SIZE);
+        if (actualSize != expectedSize || memcmp(actual, expected, expectedSize) != 0) {
+            printf("error: chunked encoding differs for a %d byte image\n", size);
+            ++failures;
+        }
+    }
+
+    printf("%lld bytes encoded in images of 1 to %d bytes\n", totalBytes, maxSize);
+    printf("  %-16s %10.3f ms %10.1f MB/sec\n", "PDSTx (5 bit)", time5 * 1000.0, totalBytes / time5 / 1e6);
+    printf("  %-16s %10.3f ms %10.1f MB/sec\n", "PDSTx10 (10 bit)", time10 * 1000.0, totalBytes / time10 / 1e6);
+    if (failures > 0)
+        printf("%d image sizes failed\n", failures);
+    else
+        printf("all image sizes match\n");
+
+    free(image);
+    free(expected);
+    free(actual);
+
+    return failures == 0 ? 0 : 1;
+}
+
+/* encode5
+    encodes an image five bits at a time using only PDSTx, the way the encoder did before PDSTx10
+*/
+static int encode5(const uint8_t *image, int imageSize, uint8_t *stream)
+{
+    static uint8_t masks[] = { 0x00, 0x01, 0x03, 0x07, 0x0f, 0x1f };
+    int bitsRemaining = imageSize * 8;
+    uint32_t bitBuffer = 0;
+    int bitCount = 0;
+    int cnt = 0;
+
+    while (bitsRemaining > 0) {
+        int bits, bitsIn = bitsRemaining > 5 ? 5 : bitsRemaining;
+        while (bitCount < bitsIn) {
+            bitBuffer |= (uint32_t)*image++ << bitCount;
+            bitCount += 8;
+        }
+        bits = bitBuffer & masks[bitsIn];
+        stream[cnt++] = PDSTx[bits][bitsIn - 1].encoding;
+        bitBuffer >>= PDSTx[bits][bitsIn - 1].bitCount;
+        bitCount -= PDSTx[bits][bitsIn - 1].bitCount;
+        bitsRemaining -= PDSTx[bits][bitsIn - 1].bitCount;
+    }
+
+    return cnt;
+}
+
+/* encodeChunked
+    encodes an image supplied to StreamEncoder 'chunkSize' bytes at a time into ENCODE_BUFFER_SIZE
+    pieces the way PropellerLoader::sendLoaderStream does
+*/
+static int encodeChunked(const uint8_t *image, int imageSize, int chunkSize, uint8_t *stream, int streamMax)
+{
+    StreamEncoder encoder(NULL, imageSize);
+    int offset = 0, byteCount = 0;
+
+    while (!encoder.done()) {
+        int cnt;
+        if (encoder.needsInput()) {
+            cnt = imageSize - offset > chunkSize ? chunkSize : imageSize - offset;
+            if (cnt <= 0)
+                return -1;
+            encoder.supply(&image[offset], cnt);
+            offset += cnt;
+        }
+        cnt = streamMax - byteCount > ENCODE_BUFFER_SIZE ? ENCODE_BUFFER_SIZE : streamMax - byteCount;
+        if ((cnt = encoder.encode(&stream[byteCount], cnt)) == 0 && !encoder.needsInput())
+            return -1;
+        byteCount += cnt;
+    }
+
+    return byteCount;
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *nextArg(int argc, char *argv[], int *pi)
+{
+    if (argv[*pi][2])
+        return &argv[*pi][2];
+    if (++(*pi) >= argc)
+        Usage();
+    return argv[*pi];
+}
+
+static void Usage()
+{
+    printf("\
+usage: encodertest\n\
+         [ -m <bytes> ]    largest image size to check (default is %d)\n\
+         [ -s <bytes> ]    image size increment (default is 1)\n", MAX_IMAGE_SIZE);
+    exit(1);
+}
+
+void AppendResponseText(ResponseLevel level, const char *fmt, ...)
+{
+    va_list ap;
+    if (level <= responseVerbosity) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        putchar('\n');
+        va_end(ap);
+    }
+}
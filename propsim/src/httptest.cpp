@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "httprequest.h"
+
+#define FUZZ_ITERATIONS     300000      /* mutated requests parsed by default */
+#define SPEED_ITERATIONS    1000000     /* requests parsed for the throughput figure by default */
+#define MAX_INPUT_SIZE      1024        /* largest mutated request */
+#define MAX_MUTATIONS       8           /* most mutations applied to one request */
+
+// a request the parser should accept and what it should find in it
+struct KnownRequest {
+    const char *text;
+    HttpMethod method;
+    const char *path;
+    const char *key;
+    const char *value;
+    int contentLength;
+    bool keepAlive;
+    bool expectContinue;
+};
+
+static KnownRequest knownRequests[] = {
+{   "GET / HTTP/1.1\r\nHost: thing2.local\r\n\r\n",
+    hmGet, "/", NULL, NULL, -1, true, false },
+{   "GET /status HTTP/1.0\r\n\r\n",
+    hmGet, "/status", NULL, NULL, -1, false, false },
+{   "POST /run HTTP/1.1\r\nContent-Length: 1234\r\nExpect: 100-continue\r\nConnection: close\r\n\r\n",
+    hmPost, "/run", NULL, NULL, 1234, false, true },
+{   "\r\n\r\nPOST /load-begin?size=32768&baud-rate=921600 HTTP/1.1\r\ncontent-length: 0\r\n\r\n",
+    hmPost, "/load-begin", "baud-rate", "921600", 0, true, false },
+{   "GET /cache-query?image=a%20b+c&x HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n",
+    hmGet, "/cache-query", "image", "a b c", -1, true, false },
+{   "POST /load-data HTTP/1.1\r\nContent-Length: 99999999999\r\n\r\n",
+    hmPost, "/load-data", NULL, NULL, -1, true, false },
+{   "GET /f%2fg?x HTTP/1.1\nX-Long-Header: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\n\n",
+    hmGet, "/f/g", "x", "", -1, true, false },
+{   "GET /a+b%2b?x=c+d%2b HTTP/1.1\r\n\r\n",
+    hmGet, "/a+b+", "x", "c d+", -1, true, false }
+};
+#define KNOWN_REQUEST_COUNT (int)(sizeof(knownRequests) / sizeof(knownRequests[0]))
+
+// requests the parser should reject and the status it should answer with
+static struct {
+    const char *text;
+    int errorCode;
+} badRequests[] = {
+{   "GET\r\n\r\n", 400 },
+{   "GET /\r\n\r\n", 400 },
+{   NULL, 414 }     // a request line longer than HTTP_MAX_REQUEST_LINE, filled in by checkKnownRequests
+};
+#define BAD_REQUEST_COUNT (int)(sizeof(badRequests) / sizeof(badRequests[0]))
+
+static int checkKnownRequests();
+static HttpParseState parseAll(HttpRequest &req, const char *text, int length);
+static int fuzz(int iterations);
+static int mutate(uint8_t *buf, int length);
+static int checkInvariants(HttpRequest &req, HttpParseState state);
+static void measureThroughput(int iterations);
+static double seconds();
+static char *nextArg(int argc, char *argv[], int *pi);
+static void Usage();
+
+int main(int argc, char *argv[])
+{
+    int fuzzIterations = FUZZ_ITERATIONS;
+    int speedIterations = SPEED_ITERATIONS;
+    int failures, i;
+
+    /* get the arguments */
+    for (i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-')
+            Usage();
+        switch(argv[i][1]) {
+        case 'n':
+            fuzzIterations = atoi(nextArg(argc, argv, &i));
+            break;
+        case 't':
+            speedIterations = atoi(nextArg(argc, argv, &i));
+            break;
+        case '?':
+            /* fall through */
+        default:
+            Usage();
+            break;
+        }
+    }
+
+    /* make the mutations reproducible */
+    srand(1);
+
+    failures = checkKnownRequests();
+    if (fuzzIterations > 0)
+        failures += fuzz(fuzzIterations);
+    if (speedIterations > 0)
+        measureThroughput(speedIterations);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
+
+/* checkKnownRequests
+    parses requests with known contents and returns the number that weren't parsed as expected
+*/
+static int checkKnownRequests()
+{
+    char longLine[HTTP_MAX_REQUEST_LINE + 32];
+    HttpRequest req;
+    int failures = 0, i;
+
+    for (i = 0; i < KNOWN_REQUEST_COUNT; ++i) {
+        KnownRequest *known = &knownRequests[i];
+        const char *value;
+        if (parseAll(req, known->text, strlen(known->text)) != hpComplete
+        ||  req.method() != known->method
+        ||  strcmp(req.path(), known->path) != 0
+        ||  (known->key && (!(value = req.arg(known->key)) || strcmp(value, known->value) != 0))
+        ||  req.contentLength() != known->contentLength
+        ||  req.keepAlive() != known->keepAlive
+        ||  req.expectContinue() != known->expectContinue) {
+            printf("error: request %d not parsed as expected\n", i);
+            ++failures;
+        }
+    }
+
+    /* a request line that just fits in the buffer, then one that doesn't */
+    memset(longLine, 'a', sizeof(longLine));
+    memcpy(longLine, "GET /", 5);
+    memcpy(&longLine[HTTP_MAX_REQUEST_LINE - 10], " HTTP/1.1\n\n", 11);
+    if (parseAll(req, longLine, HTTP_MAX_REQUEST_LINE + 1) != hpComplete) {
+        printf("error: longest request line rejected\n");
+        ++failures;
+    }
+    memset(&longLine[5], 'a', HTTP_MAX_REQUEST_LINE - 5);
+    longLine[HTTP_MAX_REQUEST_LINE] = '\0';
+    badRequests[BAD_REQUEST_COUNT - 1].text = longLine;
+
+    for (i = 0; i < BAD_REQUEST_COUNT; ++i) {
+        if (parseAll(req, badRequests[i].text, strlen(badRequests[i].text)) != hpError
+        ||  req.errorCode() != badRequests[i].errorCode) {
+            printf("error: bad request %d not answered with %d\n", i, badRequests[i].errorCode);
+            ++failures;
+        }
+    }
+
+    return failures;
+}
+
+/* parseAll
+    feeds a request to the parser a byte at a time the way handleRequest does
+*/
+static HttpParseState parseAll(HttpRequest &req, const char *text, int length)
+{
+    HttpParseState state = hpRequestLine;
+    req.reset();
+    for (int i = 0; i < length; ++i) {
+        if ((state = req.parse((uint8_t)text[i])) == hpComplete || state == hpError)
+            break;
+    }
+    return state;
+}
+
+/* fuzz
+    parses mutations of the known requests and returns the number that broke an invariant
+*/
+static int fuzz(int iterations)
+{
+    uint8_t buf[MAX_INPUT_SIZE];
+    HttpRequest req;
+    int failures = 0, i, j;
+    int counts[hpError + 1];
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < iterations; ++i) {
+        HttpParseState state = hpRequestLine;
+        const char *seed = knownRequests[rand() % KNOWN_REQUEST_COUNT].text;
+        int length = strlen(seed);
+
+        memcpy(buf, seed, length);
+        for (j = rand() % MAX_MUTATIONS; j >= 0; --j)
+            length = mutate(buf, length);
+
+        /* keep feeding bytes past the end of the header as a client sending a body would */
+        req.reset();
+        for (j = 0; j < length; ++j) {
+            HttpParseState next = req.parse(buf[j]);
+            if ((state == hpComplete || state == hpError) && next != state) {
+                printf("error: parser left state %d\n", state);
+                ++failures;
+            }
+            state = next;
+        }
+        ++counts[state];
+
+        if (checkInvariants(req, state) != 0) {
+            printf("error: iteration %d broke an invariant\n", i);
+            ++failures;
+        }
+    }
+
+    printf("fuzz: %d requests, %d complete, %d rejected, %d incomplete\n",
+           iterations, counts[hpComplete], counts[hpError], counts[hpRequestLine] + counts[hpHeaders]);
+    return failures;
+}
+
+/* mutate
+    changes a request in one of the ways a confused or hostile client might and returns its new length
+*/
+static int mutate(uint8_t *buf, int length)
+{
+    static const char *tokens[] = { "\r\n", "\n", " ", "?", "&", "=", "%", "%4", "%zz", "+", ":",
+                                    "Content-Length: ", "-1", "99999999999", "Connection: ", "Expect: " };
+    int pos = length > 0 ? rand() % length : 0;
+    int cnt, i;
+
+    switch (rand() % 6) {
+    case 0:     /* flip a byte */
+        if (length > 0)
+            buf[pos] = rand();
+        break;
+    case 1:     /* delete a run of bytes */
+        cnt = rand() % 16;
+        if (cnt > length - pos)
+            cnt = length - pos;
+        memmove(&buf[pos], &buf[pos + cnt], length - pos - cnt);
+        length -= cnt;
+        break;
+    case 2:     /* insert a token */
+        {
+            const char *token = tokens[rand() % (sizeof(tokens) / sizeof(tokens[0]))];
+            cnt = strlen(token);
+            if (length + cnt <= MAX_INPUT_SIZE) {
+                memmove(&buf[pos + cnt], &buf[pos], length - pos);
+                memcpy(&buf[pos], token, cnt);
+                length += cnt;
+            }
+        }
+        break;
+    case 3:     /* repeat a byte to make a long line */
+        cnt = rand() % 400;
+        if (length > 0 && length + cnt <= MAX_INPUT_SIZE) {
+            memmove(&buf[pos + cnt], &buf[pos], length - pos);
+            memset(&buf[pos], buf[pos + cnt], cnt);
+            length += cnt;
+        }
+        break;
+    case 4:     /* insert random bytes */
+        cnt = rand() % 8;
+        if (length + cnt <= MAX_INPUT_SIZE) {
+            memmove(&buf[pos + cnt], &buf[pos], length - pos);
+            for (i = 0; i < cnt; ++i)
+                buf[pos + i] = rand();
+            length += cnt;
+        }
+        break;
+    default:    /* cut the request short */
+        length = pos;
+        break;
+    }
+
+    return length;
+}
+
+/* checkInvariants
+    checks what the handlers rely on after a parse and returns -1 if any of it doesn't hold
+*/
+static int checkInvariants(HttpRequest &req, HttpParseState state)
+{
+    static const char *keys[] = { "size", "baud-rate", "image", "x", "" };
+    unsigned int i;
+
+    if (req.state() != state)
+        return -1;
+    if (state == hpError)
+        return req.errorCode() == 400 || req.errorCode() == 414 ? 0 : -1;
+    if (req.errorCode() != 0)
+        return -1;
+    if (strlen(req.methodName()) >= HTTP_MAX_REQUEST_LINE || strlen(req.path()) >= HTTP_MAX_REQUEST_LINE)
+        return -1;
+    if (req.method() != hmUnknown && state == hpRequestLine)
+        return -1;
+    for (i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        const char *value = req.arg(keys[i]);
+        if (value && strlen(value) >= HTTP_MAX_REQUEST_LINE)
+            return -1;
+    }
+    if (req.contentLength() < -1)
+        return -1;
+    return 0;
+}
+
+/* measureThroughput
+    times parsing a typical load request the way the firmware does
+*/
+static void measureThroughput(int iterations)
+{
+    const char *text = knownRequests[3].text;
+    int length = strlen(text);
+    HttpRequest req;
+    double t;
+    int i;
+
+    t = seconds();
+    for (i = 0; i < iterations; ++i) {
+        if (parseAll(req, text, length) != hpComplete)
+            break;
+    }
+    t = seconds() - t;
+
+    printf("throughput: %d requests of %d bytes in %.3f ms, %.0f requests/sec, %.1f MB/sec\n",
+           i, length, t * 1000.0, i / t, (double)i * length / t / 1e6);
+}
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *nextArg(int argc, char *argv[], int *pi)
+{
+    if (argv[*pi][2])
+        return &argv[*pi][2];
+    if (++(*pi) >= argc)
+        Usage();
+    return argv[*pi];
+}
+
+static void Usage()
+{
+    printf("\
+usage: httptest\n\
+         [ -n <count> ]    number of mutated requests to parse (default is %d)\n\
+         [ -t <count> ]    number of requests to time (default is %d)\n", FUZZ_ITERATIONS, SPEED_ITERATIONS);
+    exit(1);
+}
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include "simpropeller.h"
+#include "simconnection.h"
+#include "fastproploader.h"
+
+#define CHUNK_PACKETS       8           /* packets passed to each loadData call */
+#define SWEEP_STEP          128         /* packet size increment for -s */
+#define LAUNCH_WAIT         5000000.0   /* how long to run the Propeller after the last packet */
+#define AUTO_BAUD_RATE      0           /* final baud rate that asks for the fastest working one */
+
+int verbose = 0;
+int quiet = 0;
+ResponseLevel responseVerbosity = rlDebug;
+
+/* how often the loaders let the firmware service other clients during a load */
+SimPropellerConnection *idleConnection = NULL;
+double lastIdleTime, longestIdleGap;
+int idleCount;
+
+void idleHandler();
+
+int simulate(SimConfig &config, uint8_t *image, int imageSize, LoadType loadType, int romOnly, int initialBaudRate, int finalBaudRate, double idleTime, double *pLoadTime = NULL);
+int sweepPacketSizes(SimConfig &config, uint8_t *image, int imageSize, LoadType loadType, int initialBaudRate, int finalBaudRate, double idleTime);
+int loadRecords(FastPropellerLoader &loader, uint8_t *image, int imageSize, int *pRecordBytes);
+void report(const char *fmt, ...);
+uint8_t *readFile(const char *fileName, int *pSize);
+char *nextArg(int argc, char *argv[], int *pi);
+void Usage();
+
+int main(int argc, char *argv[])
+{
+    int initialBaudRate = INITIAL_BAUD_RATE;
+    int finalBaudRate = FINAL_BAUD_RATE;
+    LoadType loadType = ltDownloadAndRun;
+    char *infile = NULL;
+    double idleTime = SIM_IDLE_TIME;
+    int romOnly = 0;
+    int sweep = 0;
+    SimConfig config;
+    uint8_t *image;
+    int imageSize, ret, i;
+
+    SimDefaultConfig(&config);
+
+    /* get the arguments */
+    for (i = 1; i < argc; ++i) {
+
+        /* handle switches */
+        if (argv[i][0] == '-') {
+            switch(argv[i][1]) {
+            case 'a':
+                finalBaudRate = AUTO_BAUD_RATE;
+                break;
+            case 'b':
+                finalBaudRate = atoi(nextArg(argc, argv, &i));
+                break;
+            case 'c':
+                config.clockSpeed = atof(nextArg(argc, argv, &i));
+                break;
+            case 'd':
+                config.dropInterval = atoi(nextArg(argc, argv, &i));
+                break;
+            case 'e':
+                loadType = ltDownloadAndProgramAndRun;
+                break;
+            case 'i':
+                initialBaudRate = atoi(nextArg(argc, argv, &i));
+                break;
+            case 'k':
+                config.eepromClockRate = atoi(nextArg(argc, argv, &i));
+                break;
+            case 'l':
+                config.ackLatency = atof(nextArg(argc, argv, &i));
+                break;
+            case 'm':
+                config.maxBaudRate = atoi(nextArg(argc, argv, &i));
+                break;
+            case 'p':
+                config.packetSize = atoi(nextArg(argc, argv, &i));
+                break;
+            case 'r':
+                romOnly = 1;
+                break;
+            case 's':
+                sweep = 1;
+                break;
+            case 't':
+                idleTime = atof(nextArg(argc, argv, &i));
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'z':
+                config.decompress = true;
+                break;
+            case 'w':
+                config.windowSize = atoi(nextArg(argc, argv, &i));
+                if (config.windowSize < 1 || config.windowSize > 255) {
+                    printf("error: window size must be between 1 and 255\n");
+                    return 1;
+                }
+                break;
+            case '?':
+                /* fall through */
+            default:
+                Usage();
+                break;
+            }
+        }
+
+        /* handle the input filename */
+        else {
+            if (infile)
+                Usage();
+            infile = argv[i];
+        }
+    }
+
+    if (!infile)
+        Usage();
+    if (initialBaudRate <= 0 || finalBaudRate < 0 || (romOnly && finalBaudRate == AUTO_BAUD_RATE)) {
+        printf("error: baud rates must be positive\n");
+        return 1;
+    }
+    if (idleTime < 0.0) {
+        printf("error: idle handler time can't be negative\n");
+        return 1;
+    }
+    if (sweep && romOnly) {
+        printf("error: the ROM boot protocol has no packet size to sweep\n");
+        return 1;
+    }
+
+    /* read the image to load */
+    if (!(image = readFile(infile, &imageSize)))
+        return 1;
+
+    /* make the transmission IDs reproducible */
+    srand(1);
+
+    if (sweep)
+        ret = sweepPacketSizes(config, image, imageSize, loadType, initialBaudRate, finalBaudRate, idleTime);
+    else
+        ret = simulate(config, image, imageSize, loadType, romOnly, initialBaudRate, finalBaudRate, idleTime);
+    free(image);
+
+    return ret == 0 ? 0 : 1;
+}
+
+void Usage()
+{
+    printf("\
+usage: propsim\n\
+         [ -a ]            use the fastest final baud rate that works\n\
+         [ -b <baud> ]     final baud rate (default is %d)\n\
+         [ -c <hz> ]       actual Propeller clock speed (default is 80000000)\n\
+         [ -d <n> ]        drop every nth packet received by the second-stage loader\n\
+         [ -e ]            program the EEPROM as well as loading RAM\n\
+         [ -i <baud> ]     initial baud rate (default is %d)\n\
+         [ -k <hz> ]       EEPROM I2C clock rate for the second-stage loader (default is %d)\n\
+         [ -l <us> ]       second-stage loader ack latency in microseconds\n\
+         [ -m <baud> ]     highest baud rate the line carries reliably\n\
+         [ -p <bytes> ]    second-stage packet size (default is %d)\n\
+         [ -r ]            load using only the ROM boot protocol\n\
+         [ -s ]            compare load times over a range of packet sizes\n\
+         [ -t <us> ]       time the firmware's idle handler takes each call (default is %d)\n\
+         [ -v ]            show the loader's progress messages\n\
+         [ -w <count> ]    simulate a second-stage loader that buffers <count> packets\n\
+         [ -z ]            compress packets for a second-stage loader that decompresses them\n\
+         <name>            file to load\n", FINAL_BAUD_RATE, INITIAL_BAUD_RATE, EEPROM_CLOCK_RATE, DEFAULT_PACKET_SIZE, (int)SIM_IDLE_TIME);
+    exit(1);
+}
+
+char *nextArg(int argc, char *argv[], int *pi)
+{
+    if (argv[*pi][2])
+        return &argv[*pi][2];
+    if (++(*pi) >= argc)
+        Usage();
+    return argv[*pi];
+}
+
+uint8_t *readFile(const char *fileName, int *pSize)
+{
+    uint8_t *image;
+    int imageSize;
+    FILE *fp;
+
+    /* open the image file */
+    if (!(fp = fopen(fileName, "rb"))) {
+        printf("error: can't open '%s'\n", fileName);
+        return NULL;
+    }
+
+    /* get the size of the binary file */
+    fseek(fp, 0, SEEK_END);
+    imageSize = (int)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (imageSize <= 0 || imageSize > SIM_RAM_SIZE || (imageSize & 3) != 0) {
+        printf("error: '%s' is not a valid Propeller image\n", fileName);
+        fclose(fp);
+        return NULL;
+    }
+
+    /* read the entire image into memory */
+    if (!(image = (uint8_t *)malloc(imageSize))
+    ||  (int)fread(image, 1, imageSize, fp) != imageSize) {
+        printf("error: can't read '%s'\n", fileName);
+        if (image)
+            free(image);
+        fclose(fp);
+        return NULL;
+    }
+
+    /* close the file */
+    fclose(fp);
+
+    *pSize = imageSize;
+    return image;
+}
+
+int simulate(SimConfig &config, uint8_t *image, int imageSize, LoadType loadType, int romOnly, int initialBaudRate, int finalBaudRate, double idleTime, double *pLoadTime)
+{
+    int chunkSize = CHUNK_PACKETS * config.packetSize;
+    SimPropeller propeller(config);
+    SimPropellerConnection connection(propeller);
+    double tStart, tBegin, tData, tEnd, tLaunch;
+    int recordBytes = 0;
+    int result = 0, i;
+
+    connection.setBaudRate(initialBaudRate);
+    connection.resetStats();
+    tStart = tBegin = tData = connection.now();
+
+    /* measure the gaps between idle calls */
+    idleConnection = &connection;
+    lastIdleTime = tStart;
+    longestIdleGap = 0.0;
+    idleCount = 0;
+    connection.setIdleTime(idleTime);
+    connection.setIdleHandler(idleHandler);
+
+    /* load the image directly using the ROM boot protocol */
+    if (romOnly) {
+        PropellerLoader loader(connection);
+        if (loader.load(image, imageSize, loadType) != 0) {
+            printf("error: load failed\n");
+            result = -1;
+        }
+        tBegin = tData = connection.now();
+    }
+
+    /* load the image through the second-stage loader */
+    else {
+        FastPropellerLoader loader(connection);
+        if (loader.setEepromClockRate(config.eepromClockRate) != 0) {
+            printf("error: invalid EEPROM clock rate\n");
+            result = -1;
+        }
+        else if (finalBaudRate == AUTO_BAUD_RATE) {
+            if (loader.loadBeginAuto(imageSize, initialBaudRate, &finalBaudRate, config.windowSize, config.packetSize) != 0) {
+                printf("error: loadBeginAuto failed\n");
+                result = -1;
+            }
+            else
+                report("final baud rate: %d\n", finalBaudRate);
+        }
+        else if (loader.loadBegin(imageSize, initialBaudRate, finalBaudRate, config.windowSize, config.packetSize) != 0) {
+            printf("error: loadBegin failed\n");
+            result = -1;
+        }
+        tBegin = tData = connection.now();
+        if (result == 0 && config.decompress && loadRecords(loader, image, imageSize, &recordBytes) != 0) {
+            printf("error: loadRecords failed\n");
+            result = -1;
+        }
+        for (i = 0; result == 0 && !config.decompress && i < imageSize; i += chunkSize) {
+            int cnt = imageSize - i > chunkSize ? chunkSize : imageSize - i;
+            if (loader.loadData(&image[i], cnt) != 0) {
+                printf("error: loadData failed\n");
+                result = -1;
+            }
+        }
+        tData = connection.now();
+        if (result == 0 && loader.loadEnd(loadType) != 0) {
+            printf("error: loadEnd failed\n");
+            result = -1;
+        }
+    }
+    tEnd = connection.now();
+    connection.endPhase();
+    connection.setIdleHandler(NULL);
+    if (tEnd - lastIdleTime > longestIdleGap)
+        longestIdleGap = tEnd - lastIdleTime;
+
+    /* give the Propeller time to start the program */
+    propeller.advance(tEnd + LAUNCH_WAIT);
+
+    /* show the host's view of the load */
+    const SimStats &stats = propeller.stats();
+    report("host phases (ms):\n");
+    report("  %-20s %10.3f\n", romOnly ? "rom load" : "load begin", (tBegin - tStart) / 1000.0);
+    if (!romOnly) {
+        report("  %-20s %10.3f\n", "load data", (tData - tBegin) / 1000.0);
+        report("  %-20s %10.3f\n", "load end", (tEnd - tData) / 1000.0);
+    }
+    report("  %-20s %10.3f\n", "total", (tEnd - tStart) / 1000.0);
+
+    /* show the phases timed by the loaders */
+    const LoadStats &loadStats = connection.stats();
+    report("loader phases (ms):\n");
+    for (i = 0; i < lpCount; ++i) {
+        if (loadStats.phaseTime[i] > 0)
+            report("  %-20s %10.3f\n", LoadPhaseNames[i], loadStats.phaseTime[i] / 1000.0);
+    }
+
+    /* show the Propeller's view of the load */
+    report("propeller events (ms):\n");
+    for (i = 0; i < seCount; ++i) {
+        if (stats.eventTime[i] >= 0.0)
+            report("  %-20s %10.3f\n", SimEventNames[i], (stats.eventTime[i] - tStart) / 1000.0);
+    }
+    report("packets: %d received, %d dropped, %d rejected\n", stats.packetsReceived, stats.packetsDropped, stats.packetsRejected);
+    report("bytes: %d lost, %d corrupted to propeller, %d corrupted to host\n", stats.bytesLost, stats.bytesCorrupted, connection.bytesCorrupted());
+    report("ack wait: %.3f ms in %d acks\n", connection.ackWaitTime() / 1000.0, connection.ackCount());
+    report("ack latency (ms): min %.3f, avg %.3f, max %.3f, p99 %.3f\n", loadStats.ackMinTime / 1000.0,
+           loadStats.ackCount > 0 ? loadStats.ackWaitTime / 1000.0 / loadStats.ackCount : 0.0,
+           loadStats.ackMaxTime / 1000.0, connection.ackPercentileTime(99) / 1000.0);
+    report("packets: %d sent, %d retries, %d ack timeouts\n", loadStats.packetCount, loadStats.retryCount, loadStats.ackTimeouts);
+    report("idle: %d calls, longest gap %.3f ms\n", idleCount, longestIdleGap / 1000.0);
+    if (recordBytes > 0)
+        report("compression: %d bytes sent in %d bytes of records (%.1f%%)\n", imageSize, recordBytes, recordBytes * 100.0 / imageSize);
+
+    if (result != 0)
+        return -1;
+
+    /* show the throughput */
+    tLaunch = stats.eventTime[seLaunch];
+    if (tLaunch < 0.0) {
+        printf("error: program not launched\n");
+        return -1;
+    }
+    if (!romOnly)
+        report("data throughput: %.0f bytes/sec\n", imageSize * 1e6 / (tData - tBegin));
+    report("load throughput: %.0f bytes/sec (%d bytes in %.3f ms to launch)\n", imageSize * 1e6 / (tLaunch - tStart), imageSize, (tLaunch - tStart) / 1000.0);
+
+    /* verify the Propeller's memory */
+    if (memcmp(propeller.ram(), image, imageSize) != 0) {
+        printf("error: RAM does not match the image\n");
+        return -1;
+    }
+    if ((loadType & ltDownloadAndProgram) && memcmp(propeller.eeprom(), image, imageSize) != 0) {
+        printf("error: EEPROM does not match the image\n");
+        return -1;
+    }
+    report("verified\n");
+
+    if (pLoadTime)
+        *pLoadTime = tLaunch - tStart;
+    return 0;
+}
+
+/* loadRecords
+    sends the image the way the module does when it's uploaded compressed: each packet is packed
+    into a record and the next record is packed while the previous one is being acknowledged
+*/
+int loadRecords(FastPropellerLoader &loader, uint8_t *image, int imageSize, int *pRecordBytes)
+{
+    uint8_t records[2][MAX_PACKET_SIZE + RECORD_HEADER_SIZE];
+    uint8_t unpacked[2][MAX_PACKET_SIZE];
+    int packetSize = loader.packetSize();
+    int current = 0, i;
+
+    *pRecordBytes = 0;
+    for (i = 0; i < imageSize; i += packetSize) {
+        int cnt = imageSize - i > packetSize ? packetSize : imageSize - i;
+        int recordSize = PackRecord(&image[i], cnt, records[current]);
+        *pRecordBytes += recordSize;
+        if ((i > 0 && loader.loadPacketFinish() != 0)
+        ||  loader.loadRecordStart(records[current], recordSize, unpacked[current]) != 0)
+            return -1;
+        current ^= 1;
+    }
+
+    return imageSize > 0 ? loader.loadPacketFinish() : 0;
+}
+
+/* sweepPacketSizes
+    loads the image with each packet size from SWEEP_STEP to MAX_PACKET_SIZE and compares the times to launch
+*/
+int sweepPacketSizes(SimConfig &config, uint8_t *image, int imageSize, LoadType loadType, int initialBaudRate, int finalBaudRate, double idleTime)
+{
+    int packetSize, result = 0;
+    double loadTime;
+
+    printf("packet size sweep (%d byte image):\n", imageSize);
+    printf("  %6s %8s %12s %12s\n", "size", "packets", "launch (ms)", "bytes/sec");
+
+    quiet = 1;
+    for (packetSize = SWEEP_STEP; ; packetSize += SWEEP_STEP) {
+
+        /* finish with the largest packet the loader can buffer */
+        if (packetSize > MAX_PACKET_SIZE)
+            packetSize = MAX_PACKET_SIZE;
+
+        config.packetSize = packetSize;
+        srand(1);
+        printf("  %6d %8d ", packetSize, (imageSize + packetSize - 1) / packetSize);
+        if (simulate(config, image, imageSize, loadType, 0, initialBaudRate, finalBaudRate, idleTime, &loadTime) != 0) {
+            printf("%12s\n", "failed");
+            result = -1;
+        }
+        else
+            printf("%12.3f %12.0f\n", loadTime / 1000.0, imageSize * 1e6 / loadTime);
+        if (packetSize == MAX_PACKET_SIZE)
+            break;
+    }
+    quiet = 0;
+
+    return result;
+}
+
+void idleHandler()
+{
+    double now = idleConnection->now();
+    if (now - lastIdleTime > longestIdleGap)
+        longestIdleGap = now - lastIdleTime;
+    lastIdleTime = now;
+    ++idleCount;
+}
+
+void AppendResponseText(ResponseLevel level, const char *fmt, ...)
+{
+    va_list ap;
+    if (verbose && level <= responseVerbosity) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        putchar('\n');
+        va_end(ap);
+    }
+}
+
+/* report
+    prints part of a load's report unless only the sweep summary is wanted
+*/
+void report(const char *fmt, ...)
+{
+    va_list ap;
+    if (!quiet) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+    }
+}
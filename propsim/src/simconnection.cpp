@@ -0,0 +1,118 @@
+#include <math.h>
+#include "simconnection.h"
+
+#define BAUD_TOLERANCE      0.02    /* largest baud rate mismatch the UART tolerates */
+
+SimPropellerConnection::SimPropellerConnection(SimPropeller &propeller)
+    : m_propeller(propeller), m_now(0.0), m_txFree(0.0), m_idleTime(SIM_IDLE_TIME), m_bytesCorrupted(0)
+{
+    m_resetPin = DEF_RESET_PIN;
+}
+
+/* generateResetSignal
+    follows the timing of SerialPropellerConnection::generateResetSignal
+*/
+int SimPropellerConnection::generateResetSignal()
+{
+    if (m_resetPin == -1)
+        return -1;
+    if (m_now < m_txFree)
+        pause(m_txFree - m_now);
+    pause(10000.0);
+    m_propeller.reset(m_now);
+    pause(10000.0);
+    m_propeller.release(m_now);
+    pause(100000.0);
+    m_propeller.advance(m_now);
+    m_propeller.clearOutput(m_now);
+    m_txFree = m_now;
+    return 0;
+}
+
+/* pause
+    lets virtual time pass, calling the idle handler as SerialPropellerConnection::pause does
+*/
+void SimPropellerConnection::pause(double us)
+{
+    double end = m_now + us;
+    while (m_now < end) {
+        m_now = m_now + SIM_IDLE_INTERVAL < end ? m_now + SIM_IDLE_INTERVAL : end;
+        serviceIdle();
+    }
+}
+
+/* serviceIdle
+    calls the idle handler and lets the time it takes pass, as it does in the firmware
+*/
+void SimPropellerConnection::serviceIdle()
+{
+    if (m_idleHandler) {
+        idle();
+        m_now += m_idleTime;
+    }
+}
+
+/* sendData
+    queues the bytes on the simulated line and returns once all but the last SIM_TX_FIFO_SIZE
+    of them have been transmitted; like SerialPropellerConnection::sendData it doesn't call the
+    idle handler, so the bytes of a packet go out without a pause
+*/
+int SimPropellerConnection::sendData(uint8_t *buf, int len)
+{
+    double byteTime = 10e6 / m_baudRate;
+
+    for (int i = 0; i < len; ++i) {
+        SimByte byte;
+        byte.start = m_txFree > m_now ? m_txFree : m_now;
+        byte.time = byte.start + byteTime;
+        byte.baudRate = m_baudRate;
+        byte.data = buf[i];
+        m_propeller.receive(byte);
+        m_txFree = byte.time;
+        if (m_now < m_txFree - SIM_TX_FIFO_SIZE * byteTime)
+            m_now = m_txFree - SIM_TX_FIFO_SIZE * byteTime;
+    }
+
+    return len;
+}
+
+/* receiveDataExactTimeout
+    runs the simulated Propeller until the requested number of bytes has arrived; like
+    Stream::readBytes the timeout applies to each byte
+*/
+int SimPropellerConnection::receiveDataExactTimeout(uint8_t *buf, int len, int timeout)
+{
+    for (int i = 0; i < len; ++i) {
+        double deadline = m_now + timeout * 1000.0;
+        for (;;) {
+            double next;
+            m_propeller.advance(m_now);
+            if (m_propeller.outputAvailable() && m_propeller.output().time <= m_now) {
+                SimByte &byte = m_propeller.output();
+                buf[i] = byte.data;
+                if (fabs((double)byte.baudRate - m_baudRate) > m_baudRate * BAUD_TOLERANCE) {
+                    buf[i] ^= 0x5a;
+                    ++m_bytesCorrupted;
+                }
+                m_propeller.consumeOutput();
+                break;
+            }
+            next = m_propeller.nextEventTime();
+            if (m_propeller.outputAvailable() && m_propeller.output().time < next)
+                next = m_propeller.output().time;
+            if (next > m_now + SIM_IDLE_INTERVAL)
+                next = m_now + SIM_IDLE_INTERVAL;
+            if (next > deadline) {
+                m_now = deadline;
+                serviceIdle();
+                return -1;
+            }
+            if (next > m_now)
+                m_now = next;
+            serviceIdle();
+        }
+    }
+
+    /* return the full size of the buffer */
+    return len;
+}
@@ -0,0 +1,729 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "simpropeller.h"
+#include "fastproploader.h"
+
+// The second-stage loader and its executable packets.  The simulator recognizes them by content rather
+// than by executing them.
+#include "IP_Loader.h"
+
+#define INFINITE_TIME           1e30
+
+#define MAX_PAYLOAD             1392        /* size of the packet buffer in IP_Loader.spin (header included) */
+#define BAUD_TOLERANCE          0.02        /* largest baud rate mismatch a receiver tolerates */
+#define GARBLE(_b)              ((_b) ^ 0x5a)
+
+#define TEMPLATE_COUNT          (250 + 8)   /* timing templates for the rx handshake and the version */
+#define PROPELLER_VERSION       1
+
+/* cycle counts of the second-stage loader's inner loops */
+#define COPY_CYCLES_PER_LONG    32
+#define UNPACK_CYCLES_PER_BYTE  40
+#define CLEAR_CYCLES_PER_LONG   24
+#define SUM_CYCLES_PER_BYTE     32
+
+/* cycles the second-stage loader spends on each I2C bit beyond its SCL high and low times */
+#define I2C_BIT_CYCLES          49
+#define EEPROM_PAGE_SIZE        64
+
+#define CALL_FRAME              0xfff9ffff
+
+const char *SimEventNames[seCount] = {
+    "reset released",
+    "rom handshake",
+    "rom image received",
+    "rom checksum ack",
+    "rom eeprom program",
+    "rom eeprom verify",
+    "loader ready",
+    "first packet",
+    "last packet",
+    "verify ram",
+    "program eeprom",
+    "ready to launch",
+    "launch"
+};
+
+void SimDefaultConfig(SimConfig *config)
+{
+    config->clockSpeed = 80000000.0;
+    config->maxBaudRate = 3000000;
+    config->romChecksumTime = 100000.0;
+    config->launchTime = 10000.0;
+    config->ackLatency = 20.0;
+    config->eepromProgramTime = 3300000.0;
+    config->eepromVerifyTime = 740000.0;
+    config->eepromWriteTime = 5000.0;
+    config->eepromClockRate = EEPROM_CLOCK_RATE;
+    config->windowSize = 1;
+    config->packetSize = DEFAULT_PACKET_SIZE;
+    config->decompress = false;
+    config->dropInterval = 0;
+}
+
+//////////////////
+// SimByteQueue //
+//////////////////
+
+SimByteQueue::SimByteQueue()
+    : m_bytes(NULL), m_size(0), m_head(0), m_count(0)
+{
+}
+
+SimByteQueue::~SimByteQueue()
+{
+    if (m_bytes)
+        free(m_bytes);
+}
+
+void SimByteQueue::push(const SimByte &byte)
+{
+    /* grow the ring buffer when it fills up */
+    if (m_count >= m_size) {
+        int newSize = m_size ? m_size * 2 : 1024;
+        SimByte *newBytes = (SimByte *)malloc(newSize * sizeof(SimByte));
+        if (!newBytes) {
+            fprintf(stderr, "error: out of memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < m_count; ++i)
+            newBytes[i] = m_bytes[(m_head + i) % m_size];
+        if (m_bytes)
+            free(m_bytes);
+        m_bytes = newBytes;
+        m_size = newSize;
+        m_head = 0;
+    }
+    m_bytes[(m_head + m_count++) % m_size] = byte;
+}
+
+void SimByteQueue::pop()
+{
+    if (m_count > 0) {
+        m_head = (m_head + 1) % m_size;
+        --m_count;
+    }
+}
+
+//////////////////
+// SimPropeller //
+//////////////////
+
+SimPropeller::SimPropeller(const SimConfig &config)
+    : m_config(config)
+{
+    memset(m_eeprom, 0, sizeof(m_eeprom));
+    reset(0.0);
+}
+
+SimPropeller::~SimPropeller()
+{
+}
+
+void SimPropeller::reset(double time)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    for (int i = 0; i < seCount; ++i)
+        m_stats.eventTime[i] = -1.0;
+    memset(m_ram, 0, sizeof(m_ram));
+    m_state = psReset;
+    m_input.clear();
+    m_output.clear();
+    m_now = time;
+    m_txFree = time;
+}
+
+void SimPropeller::release(double time)
+{
+    reset(time);
+    m_state = psHandshake;
+    m_lfsr = 'P';
+    m_bitCount = 0;
+    m_romBitTime = 0.0;
+    event(seResetReleased, time);
+}
+
+void SimPropeller::receive(const SimByte &byte)
+{
+    if (m_state != psReset)
+        m_input.push(byte);
+}
+
+void SimPropeller::clearOutput(double time)
+{
+    m_output.clear();
+    if (m_txFree < time)
+        m_txFree = time;
+}
+
+/* timerTime
+    returns the time of the pending timeout or INFINITE_TIME if there is none; a start bit
+    that begins before the timeout expires cancels it
+*/
+double SimPropeller::timerTime()
+{
+    double time = INFINITE_TIME;
+    if (m_state == psLoader)
+        time = m_packetSize > 0 ? m_eopTime : m_failsafeTime;
+    else if (m_state == psLaunching)
+        time = m_launchTime;
+    if (!m_input.empty() && m_input.front().start < time)
+        return INFINITE_TIME;
+    return time;
+}
+
+double SimPropeller::nextEventTime()
+{
+    double time = timerTime();
+    if (!m_input.empty() && m_input.front().time < time)
+        time = m_input.front().time;
+    return time;
+}
+
+void SimPropeller::advance(double time)
+{
+    for (;;) {
+        double timer = timerTime();
+
+        /* handle timeouts */
+        if (timer <= time && (m_input.empty() || timer <= m_input.front().time)) {
+            m_now = timer;
+            if (m_state == psLaunching)
+                launchProgram(timer);
+            else if (m_packetSize > 0)
+                packetDone(timer);
+            else if (m_readyToLaunch) {
+                m_launchTime = timer;
+                m_state = psLaunching;
+            }
+            else
+                shutdown("failsafe timeout");
+        }
+
+        /* handle received bytes */
+        else if (!m_input.empty() && m_input.front().time <= time) {
+            SimByte byte = m_input.front();
+            m_input.pop();
+            m_now = byte.time;
+            if (m_state == psLoader)
+                processLoaderByte(byte);
+            else
+                processRomByte(byte);
+        }
+
+        /* nothing more happens before the requested time */
+        else
+            break;
+    }
+    if (m_now < time)
+        m_now = time;
+}
+
+/* processRomByte
+    decodes a byte sent using the 3-bits-per-byte encoding of the Propeller download protocol; each
+    pulse (a run of low bit periods including the start bit) is a '1' if it is one bit period long
+    and a '0' if it is two bit periods long
+*/
+void SimPropeller::processRomByte(const SimByte &byte)
+{
+    SimByte rxByte = byte;
+    int frame, bit, run;
+
+    switch (m_state) {
+    case psHandshake:
+    case psTemplates:
+    case psCommand:
+    case psLength:
+    case psImage:
+        break;
+    case psChecksum:
+    case psProgram:
+    case psVerify:
+        /* the host polls with a timing template; answer it once the result is ready */
+        if (byte.time >= m_readyTime) {
+            sendByte(m_checksumOK ? 0xfe : 0xff, byte.time, m_romBitTime);
+            if (!m_checksumOK) {
+                shutdown("rom checksum error");
+                return;
+            }
+            if (m_state == psChecksum) {
+                event(seRomChecksum, byte.time);
+                if (m_command & 2) {
+                    memcpy(m_eeprom, m_ram, sizeof(m_eeprom));
+                    m_readyTime = byte.time + m_config.eepromProgramTime;
+                    m_state = psProgram;
+                    return;
+                }
+            }
+            else if (m_state == psProgram) {
+                event(seRomProgram, byte.time);
+                m_readyTime = byte.time + m_config.eepromVerifyTime;
+                m_state = psVerify;
+                return;
+            }
+            else
+                event(seRomVerify, byte.time);
+            if (m_command & 1) {
+                m_launchTime = byte.time + m_config.launchTime;
+                m_state = psLaunching;
+            }
+            else
+                shutdown("rom command complete");
+        }
+        return;
+    default:
+        return;
+    }
+
+    /* the booter measures the bit period from the first timing template */
+    if (m_romBitTime == 0.0)
+        m_romBitTime = 1e6 / byte.baudRate;
+    if (corrupted(byte, m_romBitTime)) {
+        rxByte.data = GARBLE(byte.data);
+        ++m_stats.bytesCorrupted;
+    }
+
+    /* decode the pulses in the byte including its start and stop bits */
+    frame = (rxByte.data << 1) | 0x200;
+    for (bit = 0; bit < 10 && m_state != psShutdown; ) {
+        if (frame & (1 << bit)) {
+            ++bit;
+            continue;
+        }
+        for (run = 0; bit < 10 && !(frame & (1 << bit)); ++bit)
+            ++run;
+        if (run == 1)
+            romBit(1, rxByte);
+        else if (run == 2)
+            romBit(0, rxByte);
+        else
+            shutdown("invalid pulse width");
+    }
+}
+
+void SimPropeller::romBit(int bit, const SimByte &byte)
+{
+    int expected;
+
+    switch (m_state) {
+    case psHandshake:
+        /* a timing template ('1' then '0') followed by the 250 bit tx handshake */
+        if (m_bitCount < 2)
+            expected = m_bitCount == 0 ? 1 : 0;
+        else {
+            expected = m_lfsr & 1;
+            m_lfsr = ((m_lfsr << 1) & 0xfe) | (((m_lfsr >> 7) ^ (m_lfsr >> 5) ^ (m_lfsr >> 4) ^ (m_lfsr >> 1)) & 1);
+        }
+        if (bit != expected) {
+            shutdown("tx handshake mismatch");
+            return;
+        }
+        if (++m_bitCount == 2 + 250) {
+            event(seHandshake, byte.time);
+            m_templates = 0;
+            m_bitCount = 0;
+            m_state = psTemplates;
+        }
+        break;
+    case psTemplates:
+        romTemplate(bit, byte);
+        break;
+    case psCommand:
+    case psLength:
+    case psImage:
+        m_long |= (uint32_t)bit << m_bitCount;
+        if (++m_bitCount < 32)
+            break;
+        m_bitCount = 0;
+        if (m_state == psCommand) {
+            if ((m_command = m_long) == 0 || m_command > 3) {
+                shutdown("rom shutdown command");
+                return;
+            }
+            m_state = psLength;
+        }
+        else if (m_state == psLength) {
+            if ((m_imageLongs = m_long) == 0 || m_imageLongs > SIM_RAM_SIZE / 4) {
+                shutdown("invalid image length");
+                return;
+            }
+            m_longCount = 0;
+            m_state = psImage;
+        }
+        else {
+            setLong(&m_ram[m_longCount * 4], m_long);
+            if (++m_longCount == m_imageLongs)
+                romImageDone(byte.time);
+        }
+        m_long = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/* romTemplate
+    each '1' '0' pair is a timing template that the Propeller answers with one bit of the rx handshake
+    or of its version number; the host packs two templates in a byte and gets one byte back for them
+*/
+void SimPropeller::romTemplate(int bit, const SimByte &byte)
+{
+    int response;
+
+    if (bit != (m_bitCount == 0 ? 1 : 0)) {
+        shutdown("invalid timing template");
+        return;
+    }
+    if (++m_bitCount < 2)
+        return;
+    m_bitCount = 0;
+
+    if (m_templates < 250) {
+        response = m_lfsr & 1;
+        m_lfsr = ((m_lfsr << 1) & 0xfe) | (((m_lfsr >> 7) ^ (m_lfsr >> 5) ^ (m_lfsr >> 4) ^ (m_lfsr >> 1)) & 1);
+    }
+    else
+        response = (PROPELLER_VERSION >> (m_templates - 250)) & 1;
+
+    if ((m_templates & 1) == 0)
+        m_long = response;
+    else
+        sendByte(0xce | m_long | (response << 5), byte.time, m_romBitTime);
+
+    if (++m_templates == TEMPLATE_COUNT) {
+        m_long = 0;
+        m_state = psCommand;
+    }
+}
+
+void SimPropeller::romImageDone(double time)
+{
+    uint16_t dbase = m_ram[10] | (m_ram[11] << 8);
+    uint8_t checksum = 0;
+
+    event(seRomImage, time);
+
+    /* insert the initial call frame and checksum all of RAM */
+    if (dbase >= 8 && dbase <= SIM_RAM_SIZE) {
+        setLong(&m_ram[dbase - 4], CALL_FRAME);
+        setLong(&m_ram[dbase - 8], CALL_FRAME);
+    }
+    for (int i = 0; i < SIM_RAM_SIZE; ++i)
+        checksum += m_ram[i];
+
+    m_checksumOK = checksum == 0;
+    m_readyTime = time + m_config.romChecksumTime;
+    m_state = psChecksum;
+}
+
+void SimPropeller::launchProgram(double time)
+{
+    int initAreaOffset = sizeof(rawLoaderImage) + RAW_LOADER_INIT_OFFSET_FROM_END;
+
+    /* the booter starts the second-stage loader once its init area has been patched by the host */
+    if (memcmp(m_ram + 6, rawLoaderImage + 6, initAreaOffset - 6) == 0
+    &&  memcmp(m_ram + initAreaOffset + 40, rawLoaderImage + initAreaOffset + 40, sizeof(rawLoaderImage) - initAreaOffset - 40) == 0
+    &&  m_stats.eventTime[seLoaderReady] < 0.0) {
+        startLoader(time);
+        return;
+    }
+
+    /* the loader refuses to launch an application with an invalid program base */
+    if (m_ram[6] != 0x10 || m_ram[7] != 0x00) {
+        shutdown("invalid program base");
+        return;
+    }
+
+    event(seLaunch, time);
+    m_state = psRunning;
+}
+
+void SimPropeller::startLoader(double time)
+{
+    int initAreaOffset = sizeof(rawLoaderImage) + RAW_LOADER_INIT_OFFSET_FROM_END;
+    double cyclesToUs = 1e6 / m_config.clockSpeed;
+
+    /* fetch the values patched in by the host */
+    m_initialBitTime = getLong(&m_ram[initAreaOffset + 4]) * cyclesToUs;
+    m_finalBitTime = getLong(&m_ram[initAreaOffset + 8]) * cyclesToUs;
+    m_failsafeTimeout = getLong(&m_ram[initAreaOffset + 16]) * 12 * cyclesToUs;
+    m_endOfPacketTimeout = getLong(&m_ram[initAreaOffset + 20]) * 12 * cyclesToUs;
+    m_eepromBitTime = (getLong(&m_ram[initAreaOffset + 28]) + getLong(&m_ram[initAreaOffset + 32]) + I2C_BIT_CYCLES) * cyclesToUs;
+    m_expectedID = getLong(&m_ram[initAreaOffset + 36]);
+    if (m_initialBitTime <= 0.0 || m_finalBitTime <= 0.0) {
+        shutdown("invalid loader bit time");
+        return;
+    }
+
+    m_packetCount = m_expectedID;
+    m_packetSize = 0;
+    m_memAddr = 0;
+    m_checksum = 0;
+    m_readyToLaunch = false;
+    m_dropCounter = 0;
+    memset(m_received, 0, sizeof(m_received));
+    m_state = psLoader;
+
+    /* wait for eight idle byte periods then send the "ready" ack at the initial baud rate */
+    m_txFree = time + 80 * m_initialBitTime;
+    if (m_config.decompress)
+        sendAck(COMPRESS_MAGIC | m_config.windowSize, time, m_initialBitTime);
+    else
+        sendAck(m_config.windowSize > 1 ? WINDOW_MAGIC | m_config.windowSize : 0, time, m_initialBitTime);
+    event(seLoaderReady, m_busyUntil);
+}
+
+void SimPropeller::processLoaderByte(const SimByte &byte)
+{
+    uint8_t data = byte.data;
+
+    /* the stop-and-wait loader can't receive while it copies a packet or sends an ack */
+    if (m_config.windowSize <= 1 && byte.start < m_busyUntil) {
+        ++m_stats.bytesLost;
+        return;
+    }
+    if (corrupted(byte, m_finalBitTime)) {
+        data = GARBLE(data);
+        ++m_stats.bytesCorrupted;
+    }
+
+    /* a packet larger than the buffer overwrites the loader itself */
+    if (m_packetSize >= MAX_PAYLOAD + (m_config.decompress ? RECORD_HEADER_SIZE : 0)) {
+        shutdown("packet buffer overflow");
+        return;
+    }
+    m_packet[m_packetSize++] = data;
+    m_eopTime = byte.time + m_endOfPacketTimeout;
+
+    /* the windowed loader ends a data packet by its length rather than by line silence */
+    if (m_config.windowSize > 1 && m_packetSize >= 8 && (int32_t)getLong(m_packet) > 0) {
+        if (!m_config.decompress && m_packetSize == 8 + m_config.packetSize)
+            packetDone(byte.time);
+        else if (m_config.decompress && m_packetSize >= 8 + RECORD_HEADER_SIZE
+             &&  m_packetSize == 8 + RECORD_HEADER_SIZE + RecordPackedSize(&m_packet[8]))
+            packetDone(byte.time);
+    }
+}
+
+void SimPropeller::packetDone(double time)
+{
+    int32_t packetID = getLong(&m_packet[0]);
+    int32_t tag = getLong(&m_packet[4]);
+    int size = m_packetSize - 8;
+    double ackTime = time + m_config.ackLatency;
+    double cyclesToUs = 1e6 / m_config.clockSpeed;
+
+    m_packetSize = 0;
+    if (size < 0)
+        return;
+    ++m_stats.packetsReceived;
+
+    /* simulate packet loss */
+    if (m_config.dropInterval > 0 && ++m_dropCounter % m_config.dropInterval == 0) {
+        ++m_stats.packetsDropped;
+        m_failsafeTime = time + m_failsafeTimeout;
+        return;
+    }
+
+    /* a decompressing loader unpacks the record in each data packet and ignores one that's damaged */
+    const uint8_t *data = &m_packet[8];
+    bool compressed = false;
+    if (m_config.decompress && packetID > 0) {
+        int recordSize = size;
+        if ((size = unpackPacket(recordSize)) < 0) {
+            ++m_stats.packetsDropped;
+            m_failsafeTime = time + m_failsafeTimeout;
+            return;
+        }
+        compressed = recordSize - RECORD_HEADER_SIZE < size;
+        data = m_unpacked;
+    }
+
+    /* the windowed loader accepts any data packet that fits in its window */
+    if (m_config.windowSize > 1 && packetID > 0 && packetID != m_expectedID) {
+        int index = m_packetCount - packetID;
+        /* a packet it already has (or never will need) gets the usual negative ack */
+        if (packetID > m_expectedID) {
+            ++m_stats.packetsRejected;
+            sendAck(tag, ackTime, m_finalBitTime);
+            return;
+        }
+        if (packetID <= m_expectedID - m_config.windowSize || index < 0 || index >= (int)sizeof(m_received)) {
+            ++m_stats.packetsDropped;
+            m_failsafeTime = time + m_failsafeTimeout;
+            return;
+        }
+        if (!m_received[index]) {
+            memcpy(&m_ram[index * m_config.packetSize], data, size);
+            m_received[index] = 1;
+            if ((uint32_t)(index * m_config.packetSize + size) > m_memAddr)
+                m_memAddr = index * m_config.packetSize + size;
+        }
+        sendAck(tag, ackTime, m_finalBitTime);
+        return;
+    }
+
+    /* negatively acknowledge an unexpected packet */
+    if (packetID != m_expectedID) {
+        ++m_stats.packetsRejected;
+        sendAck(tag, ackTime, m_finalBitTime);
+        return;
+    }
+
+    /* IDs of zero and below are executable packets */
+    if (m_expectedID-- < 1) {
+        ackTime = executePacket(&m_packet[8], size, time);
+        if (m_state == psLoader)
+            sendAck(tag, ackTime, m_finalBitTime);
+        return;
+    }
+
+    /* copy the data packet to hub RAM */
+    event(seFirstPacket, time);
+    m_stats.eventTime[seLastPacket] = time;
+    if (m_config.windowSize > 1) {
+        int index = m_packetCount - packetID;
+        memcpy(&m_ram[index * m_config.packetSize], data, size);
+        m_received[index] = 1;
+        if ((uint32_t)(index * m_config.packetSize + size) > m_memAddr)
+            m_memAddr = index * m_config.packetSize + size;
+        while (m_expectedID > 0 && m_received[m_packetCount - m_expectedID])
+            --m_expectedID;
+    }
+    else {
+        if (m_memAddr + size > SIM_RAM_SIZE) {
+            shutdown("image too large");
+            return;
+        }
+        memcpy(&m_ram[m_memAddr], data, size);
+        m_memAddr += (size + 3) & ~3;
+        if (compressed)
+            ackTime += size * UNPACK_CYCLES_PER_BYTE * cyclesToUs;
+        else
+            ackTime += ((size + 3) / 4) * COPY_CYCLES_PER_LONG * cyclesToUs;
+    }
+    sendAck(tag, ackTime, m_finalBitTime);
+}
+
+/* unpackPacket
+    unpacks the record in a data packet for a decompressing loader into m_unpacked
+    returns the size of the data or -1 if the record is damaged
+*/
+int SimPropeller::unpackPacket(int size)
+{
+    int dataSize = UnpackRecord(&m_packet[8], size, m_unpacked, sizeof(m_unpacked));
+    if (dataSize >= 0) {
+        m_stats.recordBytes += size;
+        m_stats.recordDataBytes += dataSize;
+    }
+    return dataSize;
+}
+
+/* executePacket
+    performs the finalization step identified by an executable packet's code
+    returns the time at which the step is complete and its ack can be sent
+*/
+double SimPropeller::executePacket(const uint8_t *code, int size, double time)
+{
+    double cyclesToUs = 1e6 / m_config.clockSpeed;
+    double doneTime = time + m_config.ackLatency;
+
+    if (size >= (int)sizeof(verifyRAM) && memcmp(code, verifyRAM, sizeof(verifyRAM)) == 0) {
+        uint16_t dbase = m_ram[10] | (m_ram[11] << 8);
+        int longs = (SIM_RAM_SIZE - m_memAddr) / 4;
+        memset(&m_ram[m_memAddr], 0, SIM_RAM_SIZE - m_memAddr);
+        if (dbase >= 8 && dbase <= SIM_RAM_SIZE) {
+            setLong(&m_ram[dbase - 4], CALL_FRAME);
+            setLong(&m_ram[dbase - 8], CALL_FRAME);
+        }
+        m_checksum = 0;
+        for (int i = 0; i < SIM_RAM_SIZE; ++i)
+            m_checksum += m_ram[i];
+        m_expectedID = -m_checksum;
+        m_memAddr = 0;
+        doneTime += (longs * CLEAR_CYCLES_PER_LONG + SIM_RAM_SIZE * SUM_CYCLES_PER_BYTE) * cyclesToUs;
+        event(seVerifyRAM, doneTime);
+    }
+    else if (size >= (int)sizeof(programVerifyEEPROM) && memcmp(code, programVerifyEEPROM, sizeof(programVerifyEEPROM)) == 0) {
+        /* every page is sent and then written, after which the whole EEPROM is read back */
+        double busTime = SIM_RAM_SIZE * 9 * m_eepromBitTime;
+        memcpy(m_eeprom, m_ram, sizeof(m_eeprom));
+        m_expectedID = -m_checksum * 2;
+        doneTime += (SIM_RAM_SIZE / EEPROM_PAGE_SIZE) * m_config.eepromWriteTime + 2 * busTime;
+        event(seProgramEEPROM, doneTime);
+    }
+    else if (size >= (int)sizeof(readyToLaunch) && memcmp(code, readyToLaunch, sizeof(readyToLaunch)) == 0) {
+        m_readyToLaunch = true;
+        event(seReadyToLaunch, doneTime);
+    }
+    else if (size >= (int)sizeof(launchNow) && memcmp(code, launchNow, sizeof(launchNow)) == 0) {
+        m_launchTime = doneTime;
+        m_state = psLaunching;
+    }
+    else
+        shutdown("unknown executable packet");
+    return doneTime;
+}
+
+/* sendAck
+    sends the loader's two long acknowledgement: the next expected packet ID and the transmission ID
+    of the packet that prompted it
+*/
+void SimPropeller::sendAck(int32_t tag, double time, double bitTime)
+{
+    uint8_t ack[8];
+    setLong(&ack[0], m_expectedID);
+    setLong(&ack[4], tag);
+    for (int i = 0; i < (int)sizeof(ack); ++i)
+        sendByte(ack[i], time, bitTime);
+    m_busyUntil = m_txFree;
+    m_failsafeTime = m_txFree + m_failsafeTimeout;
+}
+
+void SimPropeller::sendByte(uint8_t data, double time, double bitTime)
+{
+    SimByte byte;
+    byte.start = time > m_txFree ? time : m_txFree;
+    byte.time = byte.start + 10 * bitTime;
+    byte.baudRate = (int)(1e6 / bitTime + 0.5);
+    byte.data = data;
+    m_txFree = byte.time;
+    m_output.push(byte);
+}
+
+/* corrupted
+    returns true if a byte sent at its baud rate can't be read by a receiver using the given bit time
+*/
+bool SimPropeller::corrupted(const SimByte &byte, double bitTime)
+{
+    double baudRate = 1e6 / bitTime;
+    return byte.baudRate > m_config.maxBaudRate || fabs(byte.baudRate - baudRate) > baudRate * BAUD_TOLERANCE;
+}
+
+void SimPropeller::event(SimEvent event, double time)
+{
+    if (m_stats.eventTime[event] < 0.0)
+        m_stats.eventTime[event] = time;
+}
+
+void SimPropeller::shutdown(const char *reason)
+{
+    fprintf(stderr, "propeller: %s\n", reason);
+    m_state = psShutdown;
+}
+
+uint32_t SimPropeller::getLong(const uint8_t *buf)
+{
+     return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+}
+
+void SimPropeller::setLong(uint8_t *buf, uint32_t value)
+{
+     buf[3] = value >> 24;
+     buf[2] = value >> 16;
+     buf[1] = value >>  8;
+     buf[0] = value;
+}